@@ -1,563 +1,5857 @@
 #include "grtfs.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
-/* global file structure vars */
+/* diagnostic messages on failed checks and image errors; building with
+ *   -DGRTFS_NO_DIAGNOSTICS removes them, leaving only the counters of
+ *   tfs_stats() */
+#ifdef GRTFS_NO_DIAGNOSTICS
+#define GRTFS_DIAG( ... ) ( (void) 0 )
+#else
+#define GRTFS_DIAG( ... ) printf( __VA_ARGS__ )
+#endif
 
-char storage[N_BYTES];
-struct file_block *blocks;
-struct directory_entry *directory;
-unsigned char *file_allocation_table;
+/* name index: open-addressed hash table of the files keyed by name,
+ *   held in blocks of the image, linear probing, an fd of 0 marks an
+ *   empty bucket; it starts at NAME_INDEX_SIZE buckets and doubles
+ *   whenever it would be more than half full */
+#define NAME_INDEX_SIZE ( 2 * N_DIRECTORY_ENTRIES )
+
+/* slots the directory file is grown by when it has no unused one */
+#define DIRECTORY_GROW_SLOTS 32
+
+/* slots of the table finding the entry in memory of an fd, at least
+ *   twice MAX_OPEN_FILES and a power of 2 */
+#define FD_TABLE_SIZE 2048
+
+/* changed blocks of the directory file and of the name index a mounted
+ *   image keeps in memory before a call that adds to them syncs it, so
+ *   that a sync mostly fits the JOURNAL_SPARE_BLOCKS of one transaction */
+#define OVERLAY_SYNC_BLOCKS ( JOURNAL_SPARE_BLOCKS - 64 )
+
+/* most files tfs_delete_many() holds the locks of at once */
+#define DELETE_BATCH 64
+
+/* most free block runs examined when looking for one long enough for
+ *   an allocation */
+#define RUN_SEARCH_LIMIT 64
+
+/* blocks a file is grown by beyond what a write needs, so that files
+ *   written a little at a time side by side still get long runs; they
+ *   are given back when the file is closed */
+#define PREALLOC_BLOCKS 8
+
+/* blocks the defragmenter copies at a time when it moves a run */
+#define DEFRAG_COPY_BLOCKS 64
+
+/* blocks a write copies at a time when it stops sharing them */
+#define UNSHARE_COPY_BLOCKS 64
+
+/* blocks tfs_snapshot_save() copies at a time */
+#define SAVE_COPY_BLOCKS 256
+
+/* most blocks a group of a compressed file takes, its 4 byte length
+ *   pushing a group stored as it is past GROUP_BLOCKS */
+#define MAX_GROUP_BLOCKS ( GROUP_BLOCKS + 1 )
+
+/* slots of the compressor's table of earlier positions, by hash of the
+ *   4 bytes there */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+/* most slots of the dedup index, and the slots a lookup or an insert
+ *   examines from the one its hash picks */
+#define MAX_DEDUP_SLOTS ( 1 << 20 )
+#define DEDUP_PROBES 8
+
+/* longest span of a view standing for bytes that read as zeros; all
+ *   of them point at zero_span */
+#define ZERO_SPAN_BYTES 4096
+static char zero_span[ZERO_SPAN_BYTES];
+
+/* group of a compressed file: length blocks from block block hold its
+ *   compressed bytes */
+struct group{
+  unsigned int block;
+  unsigned int length;
+};
+
+/* slot of the dedup index: block of the file at fd, when fd is not 0,
+ *   had the hash of its bytes and of the FAT entry after it when the
+ *   file was closed */
+struct dedup_slot{
+  uint32_t hash;
+  uint32_t block;
+  uint32_t fd;
+};
+
+/* dedup hash of a logical block of a file: block held bytes that, with
+ *   next after it in the file's chain, hashed to hash */
+struct block_hash{
+  uint32_t block;
+  uint32_t next;
+  uint32_t hash;
+};
+
+/* extent of a file: length blocks from physical block block hold the
+ *   file's logical blocks from logical on; a hole extent has no data
+ *   blocks, its logical blocks read as zeros, and block is the hole
+ *   record standing for it in the FAT chain */
+struct extent{
+  unsigned int logical;
+  unsigned int block;
+  unsigned int length;
+  unsigned int hole;
+};
+
+/* block cache of a mounted image: file blocks are read from and
+ *   written back to the image file a page of CACHE_PAGE_BLOCKS blocks
+ *   at a time; pages are found through hash chains of buckets and
+ *   evicted least recently used first */
+#define CACHE_PAGE_BLOCKS 32
+#define CACHE_PAGE_BYTES ( CACHE_PAGE_BLOCKS * BLOCK_SIZE )
+#define DEFAULT_CACHE_BYTES ( 16 * 1024 * 1024 )
+#define MAX_WRITE_PAGES 64
+
+struct cache_page{
+  unsigned int page;
+  unsigned int valid;
+  unsigned int dirty;
+  unsigned int pins;
+  int hash_next;
+  int lru_prev;
+  int lru_next;
+};
+
+/* lock covers all of the cache apart from the bytes of pinned pages and
+ *   is never held while taking another lock, nor while bytes are
+ *   copied to or from a page; lru_head is the most recently used page,
+ *   and a page pinned, by the spans of views or by one of the copies
+ *   under way, is never evicted; copied is signalled as each copy
+ *   ends */
+struct block_cache{
+  pthread_mutex_t lock;
+  pthread_cond_t copied;
+  unsigned int copies;
+  struct cache_page *pages;
+  char *data;
+  int *buckets;
+  unsigned int n_pages;
+  unsigned int bucket_mask;
+  int lru_head;
+  int lru_tail;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long writebacks;
+};
+
+/* request queue: submitted requests wait in a ring of depth slots
+ *   until a worker takes up to QUEUE_BATCH of them at once, and their
+ *   completions wait in a second ring of depth slots until collected;
+ *   in_flight counts the requests submitted and not yet collected, so
+ *   neither ring can overflow; lock covers all of the queue */
+#define QUEUE_BATCH 64
+#define MAX_QUEUE_WORKERS 64
+
+struct grtfs_queue{
+  grtfs_ctx *ctx;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct grtfs_request *requests;
+  struct grtfs_completion *completions;
+  unsigned int depth;
+  unsigned int request_head;
+  unsigned int n_requests;
+  unsigned int completion_head;
+  unsigned int n_completions;
+  unsigned int in_flight;
+  unsigned int stopping;
+  unsigned int n_workers;
+  pthread_t workers[MAX_QUEUE_WORKERS];
+};
+
+/* snapshot: a copy of the superblock, the directory, the file
+ *   allocation table and the blocks of the directory file and of the
+ *   name index of a context, whose data blocks the context keeps as
+ *   they are until the snapshot is freed; the blocks of the directory
+ *   file and of the index are written in place, so they are taken from
+ *   the copy instead, n_meta of them, meta_blocks holding the number
+ *   of each */
+struct grtfs_snapshot{
+  grtfs_ctx *ctx;
+  char *metadata;
+  uint32_t *meta_blocks;
+  char *meta_bytes;
+  unsigned int n_meta;
+};
+
+/* blocks of a chain of the directory file or of the name index, mapped
+ *   as the extents of a file are, without holes: mapped counts the
+ *   blocks of the chain the extents cover, and next is the block of the
+ *   chain after them, found in the FAT as more of it is wanted */
+struct chain_map{
+  struct extent *extents;
+  unsigned int n_extents;
+  unsigned int max_extents;
+  unsigned int mapped;
+  unsigned int next;
+};
+
+/* changed block of the directory file or of the name index of a mounted
+ *   image, kept until a commit has written it; dirty is cleared as a
+ *   commit copies it and set again by a change after that */
+struct meta_block{
+  uint32_t block;
+  uint32_t dirty;
+  struct meta_block *next;
+  char bytes[BLOCK_SIZE];
+};
+
+/* per-file state kept outside the image
+ *
+ * lock is held for reading by reads and views and for writing by calls
+ *   that change the file; state_lock serializes what reads change
+ *   under a lock held for reading: building the extent map, the group
+ *   cached for a compressed file and the stream position; map_valid
+ *   is set last when the map is built, so a read finding it set uses
+ *   the map as it is; extent_hint and bytes_read change atomically
+ *
+ * the extent map lists the file's blocks as runs of contiguous blocks
+ *   and holes in logical order and is built from the FAT chain the
+ *   first time the file is read or written; mapped counts the logical
+ *   blocks it covers, and extent_hint is the extent used last; the map
+ *   does not end with a hole once the file is closed, as blocks past
+ *   the mapped ones read as zeros up to the size anyway
+ *
+ * pins counts the views of the file not yet released; it changes
+ *   only under the context's pin_lock
+ *
+ * unshared counts the logical blocks from the start of the file that
+ *   no other file's chain passes through
+ *
+ * a compressed file has no extents; its groups are mapped in their
+ *   place, and group_data holds the bytes of group cached_group, -1
+ *   when none, decompressed
+ *
+ * hashes holds the dedup hashes of the file's logical blocks as its
+ *   last close while dedup was set found them, max_hashes allocated;
+ *   the first hashed of them are valid for the bytes of their blocks,
+ *   a write lowering hashed to the first block it changes, and one
+ *   whose block or next no longer matches the chain is hashed again
+ *
+ * home is the fd of the file whose entry this is, 0 while the entry in
+ *   memory is free, and stored the entry as last written to its home;
+ *   both change only under the file's lock held for writing and the
+ *   context's lock; wanted counts the calls that found the file and
+ *   wait for its lock, changing atomically, so that it is neither
+ *   evicted nor given to another file meanwhile; lru_prev and lru_next
+ *   link a closed file into the context's list of them while in_lru is
+ *   set, under the context's lock */
+struct file_state{
+  pthread_rwlock_t lock;
+  pthread_mutex_t state_lock;
+  struct extent *extents;
+  unsigned int n_extents;
+  unsigned int max_extents;
+  unsigned int mapped;
+  unsigned int map_valid;
+  unsigned int extent_hint;
+  unsigned int pins;
+  unsigned int unshared;
+  struct group *groups;
+  unsigned int n_groups;
+  unsigned int max_groups;
+  char *group_data;
+  int cached_group;
+  struct block_hash *hashes;
+  unsigned int hashed;
+  unsigned int max_hashes;
+  unsigned int home;
+  struct directory_entry stored;
+  unsigned int wanted;
+  unsigned int lru_prev;
+  unsigned int lru_next;
+  unsigned int in_lru;
+  unsigned long bytes_read;
+  unsigned long bytes_written;
+  unsigned long fat_hops;
+};
+
+/* a file system context: one image and everything derived from it
+ *
+ * storage is malloc'd memory holding the whole image when image_fd is
+ *   -1, where only the blocks before first_data_block are cleared;
+ *   otherwise it is a private mapping of the superblock, the directory
+ *   and the file allocation table of the image file, read in as they
+ *   are touched, file blocks go through the block cache, and
+ *   meta_dirty flags the file allocation table blocks changed since
+ *   the last sync; the superblock is written only by tfs_format()
+ *
+ * the free block bitmap has one bit per block, set while the block is
+ *   free; a summary bit per map word is set while that word has a free
+ *   block, and no summary word below free_hint has one; the bitmap is
+ *   built from the file allocation table one summary word at a time as
+ *   the allocator reaches it, summary words from scanned_words on are
+ *   not built yet
+ *
+ * image_directory is the directory of the image, and the directory
+ *   file holds the files beyond it: its FAT chain and its size in bytes
+ *   are those of entry 0 of the directory, each of its blocks holds one
+ *   entry, its slot, and entry 0's inline data is the directory_header
+ *   describing the slots and the name index; dir_map and index_map map
+ *   the chains of the directory file and of the index, and fixed_used
+ *   has bit fd set while entry fd of the directory holds a file
+ *
+ * the entries of the files in use are kept in directory, that of a
+ *   file at an index of its own, whose file_state is files at the same
+ *   index, while the file is open or was used lately; fd_table finds the
+ *   index of an fd by linear probing from the fd's low bits, 0 marking
+ *   an empty slot, free_active lists the n_free_active free indices,
+ *   and lru_head is the closed file used longest ago, evicted first
+ *   when an index is wanted, its entry being written to its home
+ *
+ * blocks of the directory file and of the index are read through the
+ *   block cache of a mounted image and changed in meta_block copies,
+ *   found by hash chains from the overlay_mask + 1 buckets of overlay,
+ *   which a commit writes and then drops; n_overlay counts them, and
+ *   released lists the n_released blocks of chains of the index given
+ *   up since the last commit, max_released allocated, which stay out of
+ *   the free block bitmap until a commit no longer points to them
+ *
+ * defrag_fd is the file tfs_defrag() goes on with at its next call
+ *
+ * refs counts the files whose FAT chains pass through each block once
+ *   a clone exists, and is NULL before; a count of 0 or 1 means the
+ *   block belongs to one file; frozen counts the snapshots holding each
+ *   block while there are any, and a block freed while a snapshot
+ *   holds it stays out of the free block bitmap until the last of
+ *   them is freed; both change only under lock
+ *
+ * dedup_index is a hash table of dedup_slots slots, a power of 2, that
+ *   remembers the blocks files had when closed while dedup was set; it is
+ *   NULL until first used and changes only under lock; a slot may be
+ *   stale, so a block found in it is checked against the file before
+ *   it is shared
+ *
+ * syncs of a mounted image are served by commits, one at a time under
+ *   commit_lock: syncs counts the syncs asked for and synced those
+ *   served by the last commit done; when journaling, calls that change
+ *   metadata count themselves in changes under change_lock, and a
+ *   commit sets change_paused and waits for changes to drop to 0
+ *   before it copies the metadata
+ *
+ * a view pins its file until released: pin_lock covers the pins of
+ *   every file and is never held while taking another lock, and
+ *   unpinned is signalled when a file's pins drop to 0
+ *
+ * the counters of tfs_stats() are kept where the lock already held
+ *   covers them: transfers count in their file's state, allocation and
+ *   name lookups here under lock, and failed checks, which can happen
+ *   before any lock is taken, and queued requests, which are run by
+ *   workers holding no lock of the context, with relaxed atomic adds
+ *
+ * locking: lock covers the directory of the image, the directory file,
+ *   the name index, the overlay, the table of the files in memory and
+ *   the free block bitmap; each file's lock covers its entry in
+ *   directory, its FAT chain and its file_state, reads holding it
+ *   shared and taking the file's state_lock for what they change (see
+ *   file_state); a file's lock is always taken before lock, under which
+ *   it is only tried, and state_lock after it, and a call that changes
+ *   metadata counts itself in changes before taking either; file
+ *   allocation table entries and the first blocks of files are only
+ *   changed under lock, so a sync sees whole chains */
+struct grtfs_ctx{
+  pthread_mutex_t lock;
+
+  char *storage;
+  struct superblock *superblock;
+  struct file_block *blocks;
+  struct directory_entry *image_directory;
+  uint32_t *file_allocation_table;
+
+  int image_fd;
+  size_t image_bytes;
+  char *meta_dirty;
+  size_t cache_bytes;
+  struct block_cache cache;
+
+  unsigned int journal;
+  unsigned int journaling;
+  uint32_t journal_sequence;
+  pthread_mutex_t change_lock;
+  pthread_cond_t change_done;
+  unsigned int changes;
+  unsigned int change_paused;
+  pthread_mutex_t commit_lock;
+  pthread_cond_t commit_done;
+  unsigned long syncs;
+  unsigned long synced;
+  unsigned long commits;
+  unsigned int committing;
+  unsigned int commit_result;
+  pthread_mutex_t pin_lock;
+  pthread_cond_t unpinned;
+
+  unsigned long long *free_map;
+  unsigned long long *free_summary;
+  unsigned int map_words;
+  unsigned int summary_words;
+  unsigned int free_hint;
+  unsigned int scanned_words;
+  unsigned int defrag_fd;
+  uint32_t *refs;
+  uint32_t *frozen;
+  unsigned int snapshots;
+  unsigned int dedup;
+  struct dedup_slot *dedup_index;
+  unsigned int dedup_slots;
+
+  uint32_t fixed_used;
+  struct chain_map dir_map;
+  struct chain_map index_map;
+  struct meta_block **overlay;
+  unsigned int overlay_mask;
+  unsigned int n_overlay;
+  uint32_t *released;
+  unsigned int n_released;
+  unsigned int max_released;
+
+  unsigned int fd_table[FD_TABLE_SIZE];
+  unsigned int free_active[MAX_OPEN_FILES];
+  unsigned int n_free_active;
+  unsigned int lru_head;
+  unsigned int lru_tail;
+
+  unsigned long blocks_allocated;
+  unsigned long blocks_freed;
+  unsigned long allocator_scans;
+  unsigned long allocator_scan_words;
+  unsigned long name_lookups;
+  unsigned long name_probes;
+  unsigned long blocks_copied;
+  unsigned long bytes_compressed;
+  unsigned long blocks_compressed;
+  unsigned long blocks_deduplicated;
+  unsigned long requests;
+  unsigned long requests_merged;
+  unsigned long failed_checks[N_CHECKS];
+
+  struct directory_entry directory[MAX_OPEN_FILES + 1];
+  struct file_state files[MAX_OPEN_FILES + 1];
+};
 
 
 /* implementation of helper functions */
 
-unsigned int grtfs_check_fd_in_range( unsigned int fd ){
-        if( ( fd < FIRST_VALID_FD ) || ( fd >= N_DIRECTORY_ENTRIES ) ){
-                printf( "*** file_descriptor out of range: %d\n", fd );
+// counts a failed check of the given reason
+void grtfs_check_failed( grtfs_ctx *ctx, unsigned int reason ){
+        __atomic_fetch_add( &ctx->failed_checks[reason], 1, __ATOMIC_RELAXED );
+}
+
+// checks that fd names an entry of the directory or a slot of the
+// directory file ever used; the caller holds ctx->lock
+unsigned int grtfs_check_fd_in_range( grtfs_ctx *ctx, unsigned int fd ){
+        if( !ctx->storage || ( fd < FIRST_VALID_FD ) ||
+                        ( fd >= N_DIRECTORY_ENTRIES + grtfs_directory_header( ctx )->used_slots ) ){
+                GRTFS_DIAG( "*** file_descriptor out of range: %d\n", fd );
+                grtfs_check_failed( ctx, CHECK_FD_RANGE );
                 return( FALSE );
         }
         return( TRUE );
 }
 
-unsigned int grtfs_check_block_in_range( unsigned int b ){
-        if( ( b < 2 ) || ( b >= N_BLOCKS ) ){
-                printf( "*** block number out of range: %d\n", b );
+unsigned int grtfs_check_block_in_range( grtfs_ctx *ctx, unsigned int b ){
+        if( ( b < ctx->superblock->first_data_block ) || ( b >= ctx->superblock->n_blocks ) ){
+                GRTFS_DIAG( "*** block number out of range: %d\n", b );
+                grtfs_check_failed( ctx, CHECK_BLOCK_RANGE );
                 return( FALSE );
         }
         return( TRUE );
 }
 
-unsigned int grtfs_check_file_is_open( unsigned int fd ){
-        if( directory[fd].status != OPEN ){
-                printf( "*** attempt to access invalid or closed file: %d\n", fd );
+unsigned int grtfs_check_file_is_open( grtfs_ctx *ctx, unsigned int fd ){
+        if( ctx->directory[fd].status != OPEN ){
+                GRTFS_DIAG( "*** attempt to access invalid or closed file: %d\n", ctx->files[fd].home );
+                grtfs_check_failed( ctx, CHECK_NOT_OPEN );
                 return( FALSE );
         }
         return( TRUE );
 }
 
-unsigned int grtfs_check_valid_name( char *name ){
+unsigned int grtfs_check_file_is_writable( grtfs_ctx *ctx, unsigned int fd ){
+        if( !( ctx->directory[fd].access & WRITE_ACCESS ) ){
+                GRTFS_DIAG( "*** Write access denied\n" );
+                grtfs_check_failed( ctx, CHECK_ACCESS );
+                return( FALSE );
+        }
+        return( TRUE );
+}
+
+unsigned int grtfs_check_valid_name( grtfs_ctx *ctx, char *name ){
         int i, len = strlen( name );
         if( len > FILENAME_LENGTH ){
-                printf( "*** file name too long\n" );
+                GRTFS_DIAG( "*** file name too long\n" );
+                grtfs_check_failed( ctx, CHECK_NAME );
                 return( FALSE );
         }
         for( i = 0; i < len; i++ ){
                 if( !isalnum( name[i] ) && ( name[i] != '_' ) && ( name[i] != '.' ) ){
-                        printf( "*** file name has non-alphanumeric," );
-                        printf( " non-underscore character\n" );
+                        GRTFS_DIAG( "*** file name has non-alphanumeric," );
+                        GRTFS_DIAG( " non-underscore character\n" );
+                        grtfs_check_failed( ctx, CHECK_NAME );
                         return( FALSE );
                 }
         }
         return( TRUE );
 }
 
-unsigned int grtfs_new_directory_entry(){
-        unsigned int fd;
+// returns the header kept in the inline data of entry 0 of the directory
+struct directory_header *grtfs_directory_header( grtfs_ctx *ctx ){
+        return( (struct directory_header *) ctx->image_directory[0].data );
+}
+
+// returns the changed copy of block b a mounted image keeps, or NULL;
+// the caller holds ctx->lock
+struct meta_block *grtfs_find_meta( grtfs_ctx *ctx, unsigned int b ){
+        struct meta_block *meta;
+        if( !ctx->overlay ) return( NULL );
+        for( meta = ctx->overlay[b & ctx->overlay_mask]; meta && ( meta->block != b ); meta = meta->next );
+        return( meta );
+}
+
+// returns the bytes of block b of the directory file or of the name
+// index: the block itself in an image held in memory, else its changed
+// copy or, read through the block cache, buffer; returns NULL when the
+// image file cannot be read; the caller holds ctx->lock
+char *grtfs_read_meta( grtfs_ctx *ctx, unsigned int b, char *buffer ){
+        struct meta_block *meta;
+        if( ctx->image_fd < 0 ) return( ctx->blocks[b].bytes );
+        meta = grtfs_find_meta( ctx, b );
+        if( meta ) return( meta->bytes );
+        return( grtfs_copy_blocks( ctx, b, 0, buffer, BLOCK_SIZE, FALSE ) ? buffer : NULL );
+}
+
+// returns the bytes of block b of the directory file or of the name
+// index to change, zeroed when fresh is TRUE: the block itself in an
+// image held in memory, else a changed copy flagged for the next commit,
+// the overlay doubling its buckets once it holds as many copies; returns
+// NULL when there is no memory for it or the image file cannot be read;
+// the caller holds ctx->lock
+char *grtfs_change_meta( grtfs_ctx *ctx, unsigned int b, unsigned int fresh ){
+        struct meta_block *meta, *next, **buckets;
+        unsigned int size, i;
+        if( ctx->image_fd < 0 ){
+                if( fresh ) memset( ctx->blocks[b].bytes, 0, BLOCK_SIZE );
+                return( ctx->blocks[b].bytes );
+        }
+        meta = grtfs_find_meta( ctx, b );
+        if( !meta ){
+                size = ctx->overlay ? ctx->overlay_mask + 1 : 0;
+                if( ctx->n_overlay >= size ){
+                        size = size ? 2 * size : 256;
+                        buckets = calloc( size, sizeof( struct meta_block * ) );
+                        if( !buckets ) return( NULL );
+                        for( i = 0; ctx->overlay && ( i <= ctx->overlay_mask ); i++ ){
+                                for( meta = ctx->overlay[i]; meta; meta = next ){
+                                        next = meta->next;
+                                        meta->next = buckets[meta->block & ( size - 1 )];
+                                        buckets[meta->block & ( size - 1 )] = meta;
+                                }
+                        }
+                        free( ctx->overlay );
+                        ctx->overlay = buckets;
+                        ctx->overlay_mask = size - 1;
+                }
+                meta = malloc( sizeof( struct meta_block ) );
+                if( !meta ) return( NULL );
+                if( !fresh && !grtfs_copy_blocks( ctx, b, 0, meta->bytes, BLOCK_SIZE, FALSE ) ){
+                        free( meta );
+                        return( NULL );
+                }
+                meta->block = b;
+                meta->next = ctx->overlay[b & ctx->overlay_mask];
+                ctx->overlay[b & ctx->overlay_mask] = meta;
+                __atomic_store_n( &ctx->n_overlay, ctx->n_overlay + 1, __ATOMIC_RELAXED );
+        }
+        meta->dirty = TRUE;
+        if( fresh ) memset( meta->bytes, 0, BLOCK_SIZE );
+        return( meta->bytes );
+}
+
+// drops the changed copy of block b, a block of a chain given up, so
+// that no commit writes it over what the block holds once used again;
+// the caller holds ctx->lock
+void grtfs_drop_meta( grtfs_ctx *ctx, unsigned int b ){
+        struct meta_block **link, *meta;
+        if( !ctx->overlay ) return;
+        for( link = &ctx->overlay[b & ctx->overlay_mask]; ( meta = *link ) && ( meta->block != b );
+                        link = &meta->next );
+        if( !meta ) return;
+        *link = meta->next;
+        free( meta );
+        __atomic_store_n( &ctx->n_overlay, ctx->n_overlay - 1, __ATOMIC_RELAXED );
+}
+
+// drops the changed copies a commit has written, or all of them and the
+// buckets when all is TRUE; the caller holds ctx->lock
+void grtfs_purge_overlay( grtfs_ctx *ctx, unsigned int all ){
+        struct meta_block **link, *meta;
+        unsigned int i;
+        for( i = 0; ctx->overlay && ( i <= ctx->overlay_mask ); i++ ){
+                for( link = &ctx->overlay[i]; ( meta = *link ); ){
+                        if( meta->dirty && !all ){
+                                link = &meta->next;
+                                continue;
+                        }
+                        *link = meta->next;
+                        free( meta );
+                        __atomic_store_n( &ctx->n_overlay, ctx->n_overlay - 1, __ATOMIC_RELAXED );
+                }
+        }
+        if( !all ) return;
+        free( ctx->overlay );
+        ctx->overlay = NULL;
+        ctx->overlay_mask = 0;
+}
+
+int grtfs_compare_meta( const void *a, const void *b ){
+        uint32_t x = ( *(struct meta_block * const *) a )->block, y = ( *(struct meta_block * const *) b )->block;
+        return( ( x > y ) - ( x < y ) );
+}
+
+// returns the number of changed copies not yet copied by a commit; the
+// caller holds ctx->lock
+unsigned int grtfs_dirty_meta( grtfs_ctx *ctx ){
+        struct meta_block *meta;
+        unsigned int i, count = 0;
+        for( i = 0; ctx->overlay && ( i <= ctx->overlay_mask ); i++ )
+                for( meta = ctx->overlay[i]; meta; meta = meta->next ) count += meta->dirty;
+        return( count );
+}
+
+// copies the count changed copies grtfs_dirty_meta() counted to images
+// in order of block number, listing the block of each in list, and
+// clears their dirty flags; returns FALSE when there is no memory to
+// sort them; the caller holds ctx->lock
+unsigned int grtfs_copy_overlay( grtfs_ctx *ctx, uint32_t *list, char *images, unsigned int count ){
+        struct meta_block **sorted, *meta;
+        unsigned int i, n = 0;
+        sorted = malloc( ( count + 1 ) * sizeof( struct meta_block * ) );
+        if( !sorted ) return( FALSE );
+        for( i = 0; ctx->overlay && ( i <= ctx->overlay_mask ); i++ )
+                for( meta = ctx->overlay[i]; meta; meta = meta->next )
+                        if( meta->dirty ) sorted[n++] = meta;
+        qsort( sorted, n, sizeof( struct meta_block * ), grtfs_compare_meta );
+        for( i = 0; i < n; i++ ){
+                list[i] = sorted[i]->block;
+                memcpy( images + (size_t) i * BLOCK_SIZE, sorted[i]->bytes, BLOCK_SIZE );
+                sorted[i]->dirty = FALSE;
+        }
+        free( sorted );
+        return( TRUE );
+}
+
+// flags the changed copies of the count blocks of list again, as the
+// commit that copied them failed; the caller holds ctx->lock
+void grtfs_redirty_overlay( grtfs_ctx *ctx, uint32_t *list, unsigned int count ){
+        struct meta_block *meta;
+        unsigned int i;
+        for( i = 0; i < count; i++ ){
+                meta = grtfs_find_meta( ctx, list[i] );
+                if( meta ) meta->dirty = TRUE;
+        }
+}
+
+// syncs a mounted image once the changed copies it keeps number more
+// than OVERLAY_SYNC_BLOCKS; the caller holds no lock
+void grtfs_limit_overlay( grtfs_ctx *ctx ){
+        if( __atomic_load_n( &ctx->n_overlay, __ATOMIC_RELAXED ) > OVERLAY_SYNC_BLOCKS ) grtfs_sync( ctx );
+}
+
+// makes room in a chain map for count more extents; returns FALSE when
+// there is no memory for that
+unsigned int grtfs_chain_reserve( struct chain_map *map, unsigned int count ){
+        struct extent *extents;
+        unsigned int max = map->max_extents ? map->max_extents : 16;
+        if( map->n_extents + count <= map->max_extents ) return( TRUE );
+        while( max < map->n_extents + count ) max *= 2;
+        extents = realloc( map->extents, max * sizeof( struct extent ) );
+        if( !extents ) return( FALSE );
+        map->extents = extents;
+        map->max_extents = max;
+        return( TRUE );
+}
+
+// adds block b to the end of a chain map, which has room for an extent
+// more
+void grtfs_chain_append( struct chain_map *map, unsigned int b ){
+        struct extent *last = map->n_extents > 0 ? &map->extents[map->n_extents - 1] : NULL;
+        if( !last || ( last->block + last->length != b ) ){
+                last = &map->extents[map->n_extents++];
+                last->logical = map->mapped;
+                last->block = b;
+                last->length = 0;
+                last->hole = FALSE;
+        }
+        last->length++;
+        map->mapped++;
+}
+
+// returns block logical of the chain from first on that map maps,
+// mapping the chain up to it from the FAT first, or 0 when the chain
+// ends or leaves the file blocks before it or there is no memory to map
+// it; the caller holds ctx->lock
+unsigned int grtfs_chain_block( grtfs_ctx *ctx, struct chain_map *map, unsigned int first, unsigned int logical ){
+        unsigned int low = 0, high, middle;
+        if( map->mapped == 0 ){
+                map->n_extents = 0;
+                map->next = first;
+        }
+        while( map->mapped <= logical ){
+                if( ( map->next < ctx->superblock->first_data_block ) || ( map->next >= ctx->superblock->n_blocks ) ||
+                                ( map->mapped >= ctx->superblock->n_blocks ) || !grtfs_chain_reserve( map, 1 ) )
+                        return( 0 );
+                grtfs_chain_append( map, map->next );
+                map->next = ctx->file_allocation_table[map->next];
+        }
+        for( high = map->n_extents; high - low > 1; ){
+                middle = ( low + high ) / 2;
+                if( map->extents[middle].logical <= logical ) low = middle;
+                else high = middle;
+        }
+        return( map->extents[low].block + logical - map->extents[low].logical );
+}
+
+// allocates a chain of n blocks, each cleared, as the blocks of the
+// directory file or of the name index, linking it on from block last
+// or, when last is 0, making *first its first block, and maps it in map
+// after what map already maps; returns the number of blocks taken, fewer
+// than n when the image is full or a block cannot be had; the caller
+// holds ctx->lock
+unsigned int grtfs_new_chain( grtfs_ctx *ctx, struct chain_map *map, unsigned int *first, unsigned int last,
+                unsigned int n ){
+        unsigned int b, i, length, done = 0;
+        while( done < n ){
+                b = grtfs_new_run( ctx, last + 1, n - done, &length );
+                if( b == 0 ) break;
+                for( i = 0; ( i < length ) && grtfs_change_meta( ctx, b + i, TRUE ); i++ );
+                if( ( i < length ) || !grtfs_chain_reserve( map, 1 ) ){
+                        while( i-- > 0 ) grtfs_drop_meta( ctx, b + i );
+                        for( i = 0; i < length; i++ ) grtfs_mark_free( ctx, b + i );
+                        ctx->blocks_freed += length;
+                        break;
+                }
+                for( i = 0; i < length; i++ ){
+                        grtfs_set_fat( ctx, b + i, i + 1 < length ? b + i + 1 : LAST_BLOCK );
+                        grtfs_chain_append( map, b + i );
+                }
+                if( last == 0 ) *first = b;
+                else grtfs_set_fat( ctx, last, b );
+                map->next = LAST_BLOCK;
+                last = b + length - 1;
+                done += length;
+        }
+        return( done );
+}
+
+// gives up the first n blocks of a chain of the name index that map maps
+// from first on, the whole chain; a mounted image keeps them out of the
+// free block bitmap, listed in released, until a commit no longer points
+// to them, building the bitmap for each before its FAT entry reads as
+// free; the caller holds ctx->lock
+void grtfs_release_chain( grtfs_ctx *ctx, struct chain_map *map, unsigned int first, unsigned int n ){
+        uint32_t *released;
+        unsigned int e, k, b, max;
+        if( ( n == 0 ) || ( grtfs_chain_block( ctx, map, first, n - 1 ) == 0 ) ) return;
+        for( e = 0; e < map->n_extents; e++ ){
+                for( k = 0; ( k < map->extents[e].length ) && ( map->extents[e].logical + k < n ); k++ ){
+                        b = map->extents[e].block + k;
+                        grtfs_drop_meta( ctx, b );
+                        if( ctx->image_fd < 0 ){
+                                grtfs_free_block( ctx, b );
+                                continue;
+                        }
+                        grtfs_scan_fat( ctx, b / 64 / 64 );
+                        grtfs_set_fat( ctx, b, FREE );
+                        if( ctx->n_released == ctx->max_released ){
+                                max = ctx->max_released ? 2 * ctx->max_released : 64;
+                                released = realloc( ctx->released, max * sizeof( uint32_t ) );
+                                // a block not listed stays out of the bitmap
+                                if( !released ) continue;
+                                ctx->released = released;
+                                ctx->max_released = max;
+                        }
+                        ctx->released[ctx->n_released++] = b;
+                }
+        }
+}
+
+// puts the count blocks of released, given up before a commit that has
+// succeeded, into the free block bitmap, but for those a snapshot holds;
+// the caller holds ctx->lock
+void grtfs_free_released( grtfs_ctx *ctx, uint32_t *released, unsigned int count ){
+        unsigned int i;
+        for( i = 0; i < count; i++ ){
+                if( ctx->frozen && ctx->frozen[released[i]] ) continue;
+                grtfs_mark_free( ctx, released[i] );
+                ctx->blocks_freed++;
+        }
+}
+
+// lists again the count blocks of released taken by a commit that
+// failed; the caller holds ctx->lock
+void grtfs_keep_released( grtfs_ctx *ctx, uint32_t *released, unsigned int count ){
+        uint32_t *list;
+        if( count == 0 ) return;
+        list = realloc( ctx->released, ( ctx->n_released + count ) * sizeof( uint32_t ) );
+        if( !list ) return;
+        memcpy( list + ctx->n_released, released, count * sizeof( uint32_t ) );
+        ctx->released = list;
+        ctx->n_released += count;
+        ctx->max_released = ctx->n_released;
+}
+
+// returns the entry at the home of fd as last written there: the entry
+// of the directory or, read into buffer, the slot of the directory file;
+// returns NULL when the slot cannot be read; the caller holds ctx->lock
+struct directory_entry *grtfs_home_entry( grtfs_ctx *ctx, unsigned int fd, struct directory_entry *buffer ){
+        unsigned int b;
+        if( fd < N_DIRECTORY_ENTRIES ) return( &ctx->image_directory[fd] );
+        b = grtfs_chain_block( ctx, &ctx->dir_map, ctx->image_directory[0].first_block, fd - N_DIRECTORY_ENTRIES );
+        if( b == 0 ) return( NULL );
+        return( (struct directory_entry *) grtfs_read_meta( ctx, b, (char *) buffer ) );
+}
+
+// writes entry to the home of fd; returns FALSE when the slot of the
+// directory file cannot be written; the caller holds ctx->lock
+unsigned int grtfs_write_entry( grtfs_ctx *ctx, unsigned int fd, struct directory_entry *entry ){
+        unsigned int b;
+        char *bytes;
+        if( fd < N_DIRECTORY_ENTRIES ){
+                ctx->image_directory[fd] = *entry;
+                return( TRUE );
+        }
+        b = grtfs_chain_block( ctx, &ctx->dir_map, ctx->image_directory[0].first_block, fd - N_DIRECTORY_ENTRIES );
+        bytes = b ? grtfs_change_meta( ctx, b, TRUE ) : NULL;
+        if( !bytes ) return( FALSE );
+        memcpy( bytes, entry, sizeof( struct directory_entry ) );
+        return( TRUE );
+}
+
+// returns the entry of the file at fd as it stands: the one in memory
+// when it has one, else the one at its home; the caller holds ctx->lock
+struct directory_entry *grtfs_read_entry( grtfs_ctx *ctx, unsigned int fd, struct directory_entry *buffer ){
+        unsigned int a = grtfs_find_active( ctx, fd );
+        if( a != 0 ) return( &ctx->directory[a] );
+        return( grtfs_home_entry( ctx, fd, buffer ) );
+}
+
+// adds DIRECTORY_GROW_SLOTS unused slots to the end of the directory
+// file, in the runs of blocks the allocator finds, the first of them
+// after its last block when that is free; returns FALSE when no slot
+// could be added; the caller holds ctx->lock
+unsigned int grtfs_grow_directory( grtfs_ctx *ctx ){
+        struct directory_entry *file = &ctx->image_directory[0];
+        unsigned int n = file->size / BLOCK_SIZE, last = 0, grown;
+        if( n > 0 ){
+                last = grtfs_chain_block( ctx, &ctx->dir_map, file->first_block, n - 1 );
+                if( last == 0 ) return( FALSE );
+        }else ctx->dir_map.mapped = ctx->dir_map.n_extents = 0;
+        grown = grtfs_new_chain( ctx, &ctx->dir_map, &file->first_block, last, DIRECTORY_GROW_SLOTS );
+        file->size += grown * BLOCK_SIZE;
+        return( grown > 0 );
+}
+
+// finds a home for a new file and returns its fd: the first unused entry
+// of the directory, else the first slot on the list of unused ones of
+// the directory file, else the slot after those ever used, growing the
+// file when it has none; returns 0 when the file cannot grow; the caller
+// holds ctx->lock
+unsigned int grtfs_new_home( grtfs_ctx *ctx ){
+        struct directory_header *header = grtfs_directory_header( ctx );
+        struct directory_entry buffer, *entry = NULL;
+        unsigned int fd, next = 0;
         for( fd = FIRST_VALID_FD; fd < N_DIRECTORY_ENTRIES; fd++ ){
-                if( directory[fd].status == UNUSED ){
+                if( !( ctx->fixed_used & ( 1u << fd ) ) ){
+                        ctx->fixed_used |= 1u << fd;
                         return( fd );
                 }
         }
+        // a list found broken, as a crash can leave it, is dropped, and
+        // the slots still on it are not used again
+        fd = header->free_slot;
+        if( ( fd >= N_DIRECTORY_ENTRIES ) && ( fd < N_DIRECTORY_ENTRIES + header->used_slots ) &&
+                        ( grtfs_find_active( ctx, fd ) == 0 ) )
+                entry = grtfs_home_entry( ctx, fd, &buffer );
+        if( entry ) next = entry->first_block;
+        if( entry && ( entry->status == UNUSED ) &&
+                        ( ( next == 0 ) || ( ( next >= N_DIRECTORY_ENTRIES ) &&
+                                             ( next < N_DIRECTORY_ENTRIES + header->used_slots ) ) ) ){
+                header->free_slot = next;
+                return( fd );
+        }
+        header->free_slot = 0;
+        if( ( header->used_slots == ctx->image_directory[0].size / BLOCK_SIZE ) && !grtfs_grow_directory( ctx ) )
+                return( 0 );
+        return( N_DIRECTORY_ENTRIES + header->used_slots++ );
+}
+
+// gives up the home of a deleted file: an entry of the directory is
+// cleared, and a slot of the directory file goes first on the list of
+// unused ones, holding the fd of the next in its first_block; the caller
+// holds ctx->lock
+void grtfs_free_home( grtfs_ctx *ctx, unsigned int fd ){
+        struct directory_header *header = grtfs_directory_header( ctx );
+        struct directory_entry entry;
+        memset( &entry, 0, sizeof( entry ) );
+        if( fd < N_DIRECTORY_ENTRIES ){
+                ctx->image_directory[fd] = entry;
+                ctx->fixed_used &= ~( 1u << fd );
+                return;
+        }
+        entry.first_block = header->free_slot;
+        if( grtfs_write_entry( ctx, fd, &entry ) ) header->free_slot = fd;
+}
+
+// returns the index in memory of the file at fd, or 0 when it has none;
+// the caller holds ctx->lock
+unsigned int grtfs_find_active( grtfs_ctx *ctx, unsigned int fd ){
+        unsigned int i, a;
+        for( i = fd & ( FD_TABLE_SIZE - 1 ); ( a = ctx->fd_table[i] ) != 0; i = ( i + 1 ) & ( FD_TABLE_SIZE - 1 ) )
+                if( ctx->files[a].home == fd ) return( a );
         return( 0 );
 }
 
-unsigned int grtfs_map_name_to_fd( char *name ){
-        unsigned int fd;
-        if( !grtfs_check_valid_name( name ) ) return( 0 );
-        for( fd = 1; fd < N_DIRECTORY_ENTRIES; fd++ ){
-                if( strcmp( name, directory[fd].name ) == 0 ){
-                        return( fd );
+// adds the file at index a to the fd table; the caller holds ctx->lock
+void grtfs_insert_active( grtfs_ctx *ctx, unsigned int a ){
+        unsigned int i = ctx->files[a].home & ( FD_TABLE_SIZE - 1 );
+        while( ctx->fd_table[i] != 0 ) i = ( i + 1 ) & ( FD_TABLE_SIZE - 1 );
+        ctx->fd_table[i] = a;
+}
+
+// removes the file at index a from the fd table and shifts later slots
+// of its probe run back into the gap; the caller holds ctx->lock
+void grtfs_remove_active( grtfs_ctx *ctx, unsigned int a ){
+        unsigned int mask = FD_TABLE_SIZE - 1, i, j, home;
+        i = ctx->files[a].home & mask;
+        while( ctx->fd_table[i] != a ) i = ( i + 1 ) & mask;
+        for( j = ( i + 1 ) & mask; ctx->fd_table[j] != 0; j = ( j + 1 ) & mask ){
+                home = ctx->files[ctx->fd_table[j]].home & mask;
+                if( ( ( j - home ) & mask ) >= ( ( j - i ) & mask ) ){
+                        ctx->fd_table[i] = ctx->fd_table[j];
+                        i = j;
                 }
         }
-        return( 0 );
+        ctx->fd_table[i] = 0;
 }
 
-unsigned int grtfs_new_block(){
-        unsigned int b;
-        for( b = FIRST_VALID_BLOCK; b < N_BLOCKS; b++ ){
-                if( file_allocation_table[b] == FREE ) return( b );
+// takes the file at index a off the list of closed files; the caller
+// holds ctx->lock
+void grtfs_lru_remove( grtfs_ctx *ctx, unsigned int a ){
+        struct file_state *file = &ctx->files[a];
+        if( !file->in_lru ) return;
+        if( file->lru_prev ) ctx->files[file->lru_prev].lru_next = file->lru_next;
+        else ctx->lru_head = file->lru_next;
+        if( file->lru_next ) ctx->files[file->lru_next].lru_prev = file->lru_prev;
+        else ctx->lru_tail = file->lru_prev;
+        file->in_lru = FALSE;
+}
+
+// puts the file at index a last on the list of closed files, as the one
+// used last; the caller holds ctx->lock
+void grtfs_lru_append( grtfs_ctx *ctx, unsigned int a ){
+        struct file_state *file = &ctx->files[a];
+        grtfs_lru_remove( ctx, a );
+        file->lru_prev = ctx->lru_tail;
+        file->lru_next = 0;
+        if( ctx->lru_tail ) ctx->files[ctx->lru_tail].lru_next = a;
+        else ctx->lru_head = a;
+        ctx->lru_tail = a;
+        file->in_lru = TRUE;
+}
+
+// frees every index in memory, forgetting the files there, and the maps
+// of the chains of the directory file and of the name index; the caller
+// holds no file lock, and no other call runs
+void grtfs_reset_active( grtfs_ctx *ctx ){
+        unsigned int a;
+        for( a = 0; a <= MAX_OPEN_FILES; a++ ){
+                memset( &ctx->directory[a], 0, sizeof( struct directory_entry ) );
+                grtfs_reset_file_state( ctx, a );
+                ctx->files[a].home = 0;
+                ctx->files[a].in_lru = FALSE;
+        }
+        for( a = 0; a < MAX_OPEN_FILES; a++ ) ctx->free_active[a] = MAX_OPEN_FILES - a;
+        ctx->n_free_active = MAX_OPEN_FILES;
+        memset( ctx->fd_table, 0, sizeof( ctx->fd_table ) );
+        ctx->lru_head = ctx->lru_tail = 0;
+        ctx->dir_map.mapped = ctx->dir_map.n_extents = 0;
+        ctx->index_map.mapped = ctx->index_map.n_extents = 0;
+}
+
+// writes the entry of the file at index a to its home when it changed
+// since it was last written there, closed, as no entry at home is open;
+// returns FALSE when it cannot be written; the caller holds the file's
+// lock and ctx->lock
+unsigned int grtfs_store_entry( grtfs_ctx *ctx, unsigned int a ){
+        struct directory_entry entry = ctx->directory[a];
+        if( entry.status == OPEN ){
+                entry.status = CLOSED;
+                entry.byte_offset = 0;
+        }
+        if( memcmp( &entry, &ctx->files[a].stored, sizeof( entry ) ) == 0 ) return( TRUE );
+        if( !grtfs_write_entry( ctx, ctx->files[a].home, &entry ) ) return( FALSE );
+        ctx->files[a].stored = entry;
+        return( TRUE );
+}
+
+// writes the entries of all files in memory to their homes, each under
+// its file's lock; returns FALSE when one cannot be written; the caller
+// holds no lock
+unsigned int grtfs_store_entries( grtfs_ctx *ctx ){
+        unsigned int a, result = TRUE;
+        for( a = 1; a <= MAX_OPEN_FILES; a++ ){
+                pthread_rwlock_rdlock( &ctx->files[a].lock );
+                pthread_mutex_lock( &ctx->lock );
+                if( ( ctx->files[a].home != 0 ) && !grtfs_store_entry( ctx, a ) ) result = FALSE;
+                pthread_mutex_unlock( &ctx->lock );
+                pthread_rwlock_unlock( &ctx->files[a].lock );
+        }
+        return( result );
+}
+
+// finds an index in memory for a file and returns it with its lock held
+// for writing, or 0 when every index is taken by a file open, viewed or
+// busy: a free one if any, else that of the closed file used longest
+// ago, whose entry is written to its home first; locks are only tried,
+// and an index a call waits for is passed over; the caller holds
+// ctx->lock
+unsigned int grtfs_new_active( grtfs_ctx *ctx ){
+        struct file_state *file;
+        unsigned int i, a, next;
+        for( i = ctx->n_free_active; i-- > 0; ){
+                a = ctx->free_active[i];
+                if( __atomic_load_n( &ctx->files[a].wanted, __ATOMIC_RELAXED ) ||
+                                ( pthread_rwlock_trywrlock( &ctx->files[a].lock ) != 0 ) ) continue;
+                ctx->free_active[i] = ctx->free_active[--ctx->n_free_active];
+                return( a );
+        }
+        for( a = ctx->lru_head; a != 0; a = next ){
+                file = &ctx->files[a];
+                next = file->lru_next;
+                if( __atomic_load_n( &file->wanted, __ATOMIC_RELAXED ) ||
+                                ( pthread_rwlock_trywrlock( &file->lock ) != 0 ) ) continue;
+                // an open file leaves the list until it is closed again
+                if( ctx->directory[a].status == OPEN ){
+                        grtfs_lru_remove( ctx, a );
+                }else if( ( grtfs_file_pins( ctx, a ) == 0 ) && grtfs_store_entry( ctx, a ) ){
+                        grtfs_lru_remove( ctx, a );
+                        grtfs_remove_active( ctx, a );
+                        file->home = 0;
+                        return( a );
+                }
+                pthread_rwlock_unlock( &file->lock );
         }
         return( 0 );
 }
 
+// gives the file at fd an index in memory, its entry read from its home
+// and closed, and returns the index with the file's lock held for
+// writing; an fd of no file fails as stale, and 0 is also returned when
+// no index can be had or the home cannot be read; the caller holds
+// ctx->lock and has found no index for fd
+unsigned int grtfs_activate( grtfs_ctx *ctx, unsigned int fd ){
+        struct directory_entry buffer, *home;
+        struct file_state *file;
+        unsigned int a;
+        home = grtfs_home_entry( ctx, fd, &buffer );
+        if( !home ) return( 0 );
+        if( home->status == UNUSED ){
+                GRTFS_DIAG( "*** stale file_descriptor: %d\n", fd );
+                grtfs_check_failed( ctx, CHECK_STALE_FD );
+                return( 0 );
+        }
+        buffer = *home;
+        a = grtfs_new_active( ctx );
+        if( a == 0 ) return( 0 );
+        file = &ctx->files[a];
+        file->stored = buffer;
+        if( buffer.status == OPEN ){
+                buffer.status = CLOSED;
+                buffer.byte_offset = 0;
+        }
+        ctx->directory[a] = buffer;
+        file->home = fd;
+        grtfs_reset_file_state( ctx, a );
+        grtfs_insert_active( ctx, a );
+        grtfs_lru_append( ctx, a );
+        return( a );
+}
 
-/* implementation of public functions */
+// takes the lock of the file at fd, for writing when write is TRUE, and
+// returns the file's index in memory, giving it one when it has none,
+// in which case the lock is held for writing; returns 0 when fd names no
+// file or no index can be had for it; the caller holds ctx->lock, which
+// is released, and has checked that fd is in range
+unsigned int grtfs_lock_fd( grtfs_ctx *ctx, unsigned int fd, unsigned int write ){
+        unsigned int a;
+        for( ;; ){
+                a = grtfs_find_active( ctx, fd );
+                if( a == 0 ){
+                        a = grtfs_activate( ctx, fd );
+                        pthread_mutex_unlock( &ctx->lock );
+                        return( a );
+                }
+                // an index waited for is neither evicted nor reused, so
+                // that waiting on it cannot wait on another file's lock
+                __atomic_add_fetch( &ctx->files[a].wanted, 1, __ATOMIC_RELAXED );
+                pthread_mutex_unlock( &ctx->lock );
+                if( write ) pthread_rwlock_wrlock( &ctx->files[a].lock );
+                else pthread_rwlock_rdlock( &ctx->files[a].lock );
+                __atomic_sub_fetch( &ctx->files[a].wanted, 1, __ATOMIC_RELAXED );
+                // the file may have been deleted meanwhile
+                if( ctx->files[a].home == fd ) return( a );
+                pthread_rwlock_unlock( &ctx->files[a].lock );
+                pthread_mutex_lock( &ctx->lock );
+        }
+}
 
-/* tfs_init()
- *
- * initializes the directory as empty and the file allocation table
- *   to have all blocks free
- *
- * no parameters
- *
- * no return value
- */
+// checks file_descriptor and takes its file's lock as grtfs_lock_fd()
+// does; the caller does not hold ctx->lock
+unsigned int grtfs_lock_file( grtfs_ctx *ctx, unsigned int file_descriptor, unsigned int write ){
+        pthread_mutex_lock( &ctx->lock );
+        if( !grtfs_check_fd_in_range( ctx, file_descriptor ) ){
+                pthread_mutex_unlock( &ctx->lock );
+                return( 0 );
+        }
+        return( grtfs_lock_fd( ctx, file_descriptor, write ) );
+}
 
-void grtfs_init(){
-        unsigned int i;
-        directory = (struct directory_entry *) storage;
-        blocks = (struct file_block *) storage;
-        file_allocation_table = (unsigned char *) &storage[N_BLOCKS];
-        for( i = 0; i < N_BYTES; i++ ){
-                storage[i] = 0;
+// gives a new file of the given name an index in memory and a home, as
+// an open, empty file, and indexes its name; returns the index with the
+// file's lock held for writing, or 0 when no index or home can be had or
+// the index cannot be written; the caller holds ctx->lock and has made
+// room for the name with grtfs_reserve_name()
+unsigned int grtfs_new_file( grtfs_ctx *ctx, char *name ){
+        struct directory_entry *entry;
+        struct file_state *file;
+        unsigned int a = grtfs_new_active( ctx ), fd;
+        if( a == 0 ) return( 0 );
+        file = &ctx->files[a];
+        fd = grtfs_new_home( ctx );
+        if( fd == 0 ){
+                ctx->free_active[ctx->n_free_active++] = a;
+                pthread_rwlock_unlock( &file->lock );
+                return( 0 );
         }
+        entry = &ctx->directory[a];
+        memset( entry, 0, sizeof( struct directory_entry ) );
+        memset( &file->stored, 0, sizeof( struct directory_entry ) );
+        entry->status = OPEN;
+        entry->access = 3; // 0011 : default readable and writable
+        strcpy( entry->name, name );
+        file->home = fd;
+        grtfs_reset_file_state( ctx, a );
+        grtfs_insert_active( ctx, a );
+        if( !grtfs_index_name( ctx, fd, name ) ){
+                grtfs_release_directory_entry( ctx, a );
+                pthread_rwlock_unlock( &file->lock );
+                return( 0 );
+        }
+        return( a );
 }
 
-/* tfs_list_blocks()
- *
- * list file blocks that are being used and next block values
- *   from the file allocation table
- *
- * no parameters
- *
- * no return value
- */
+// deletes the file at index a: gives back its name, its home and its
+// chain of blocks and frees the index; the caller holds the file's lock
+// for writing and ctx->lock
+void grtfs_release_directory_entry( grtfs_ctx *ctx, unsigned int a ){
+        struct directory_header *header = grtfs_directory_header( ctx );
+        struct directory_entry *entry = &ctx->directory[a];
+        struct file_state *file = &ctx->files[a];
+        unsigned int block_index = entry->first_block, next;
+        grtfs_unindex_name( ctx, file->home, entry->name );
+        grtfs_free_home( ctx, file->home );
+        if( ( entry->flags & SHARED_BLOCKS ) && ( header->shared_files > 0 ) ) header->shared_files--;
+        grtfs_lru_remove( ctx, a );
+        grtfs_remove_active( ctx, a );
+        file->home = 0;
+        grtfs_reset_file_state( ctx, a );
+        memset( entry, 0, sizeof( struct directory_entry ) );
+        ctx->free_active[ctx->n_free_active++] = a;
+        if( block_index == FREE ) return;
+        do {
+                next = ctx->file_allocation_table[block_index] & ~HOLE_FLAG;
+                grtfs_free_block( ctx, block_index );
+                block_index = next;
+        } while( block_index != LAST_BLOCK );
+}
 
-void grtfs_list_blocks(){
-        unsigned int b;
-        printf( "-- file alllocation table listing of used blocks --\n" );
-        for( b = FIRST_VALID_BLOCK; b < N_BLOCKS; b++ ){
-                if( file_allocation_table[b] != FREE ){
-                        printf( "  block %3d is used and points to %3d\n",
-                                        b, file_allocation_table[b] );
-                }
+unsigned int grtfs_name_hash( char *name ){
+        unsigned int h = 2166136261u;
+        while( *name ) h = ( h ^ (unsigned char) *name++ ) * 16777619u;
+        return( h );
+}
+
+// returns bucket i of the name index whose chain from first on map maps,
+// in its block so that it can be changed when change is TRUE, else as
+// read into buffer; returns NULL when its block cannot be had; the
+// caller holds ctx->lock
+struct name_bucket *grtfs_name_bucket( grtfs_ctx *ctx, struct chain_map *map, unsigned int first,
+                unsigned int i, unsigned int change, struct name_bucket *buffer ){
+        unsigned int b = grtfs_chain_block( ctx, map, first, i / NAME_BUCKETS_PER_BLOCK );
+        char *bytes;
+        if( b == 0 ) return( NULL );
+        bytes = change ? grtfs_change_meta( ctx, b, FALSE ) : grtfs_read_meta( ctx, b, (char *) buffer );
+        if( !bytes ) return( NULL );
+        return( (struct name_bucket *) bytes + i % NAME_BUCKETS_PER_BLOCK );
+}
+
+// puts fd under hash in the first empty bucket of its probe run in the
+// name index of mask + 1 buckets whose chain from first on map maps;
+// returns FALSE when it cannot be written; the caller holds ctx->lock
+unsigned int grtfs_insert_bucket( grtfs_ctx *ctx, struct chain_map *map, unsigned int first, unsigned int mask,
+                uint32_t hash, unsigned int fd ){
+        struct name_bucket buffer[NAME_BUCKETS_PER_BLOCK], *bucket;
+        unsigned int i, n;
+        for( i = hash & mask, n = 0; n <= mask; i = ( i + 1 ) & mask, n++ ){
+                bucket = grtfs_name_bucket( ctx, map, first, i, FALSE, buffer );
+                if( !bucket ) return( FALSE );
+                if( bucket->fd != 0 ) continue;
+                bucket = grtfs_name_bucket( ctx, map, first, i, TRUE, NULL );
+                if( !bucket ) return( FALSE );
+                bucket->hash = hash;
+                bucket->fd = fd;
+                return( TRUE );
         }
-        printf( "-- end --\n" );
+        return( FALSE );
 }
 
-/* tfs_list_directory()
- *
- * list all directory entries
- *
- * no parameters
- *
- * no return value
- */
+// returns the fd of the file having the given name, or 0 when there is
+// no such file, the context holds no image or the index cannot be read;
+// a bucket whose file is gone or has another name, as a crash can leave
+// one, is passed over; the caller holds ctx->lock
+unsigned int grtfs_lookup_name( grtfs_ctx *ctx, char *name ){
+        struct directory_header *header;
+        struct name_bucket buffer[NAME_BUCKETS_PER_BLOCK], *bucket;
+        struct directory_entry entry_buffer, *entry;
+        unsigned int hash = grtfs_name_hash( name ), mask, i, n;
+        if( !ctx->storage ) return( 0 );
+        header = grtfs_directory_header( ctx );
+        if( header->index_buckets == 0 ) return( 0 );
+        mask = header->index_buckets - 1;
+        ctx->name_lookups++;
+        for( i = hash & mask, n = 0; n <= mask; i = ( i + 1 ) & mask, n++ ){
+                ctx->name_probes++;
+                bucket = grtfs_name_bucket( ctx, &ctx->index_map, header->index_block, i, FALSE, buffer );
+                if( !bucket || ( bucket->fd == 0 ) ) return( 0 );
+                if( bucket->hash != hash ) continue;
+                entry = grtfs_read_entry( ctx, bucket->fd, &entry_buffer );
+                if( entry && ( entry->status != UNUSED ) && ( strcmp( name, entry->name ) == 0 ) )
+                        return( bucket->fd );
+        }
+        return( 0 );
+}
 
-void grtfs_list_directory(){
-        unsigned int fd;
-        unsigned char b;
-        printf( "-- directory listing --\n" );
-        for( fd = FIRST_VALID_FD; fd < N_DIRECTORY_ENTRIES; fd++ ){
-                printf( "  fd = %2d: ", fd );
-                if( directory[fd].status == UNUSED ){
-                        printf( "unused\n" );
-                }else if( directory[fd].status == CLOSED ){
-                        printf( "%s, currently closed, %d bytes in size\n",
-                                        directory[fd].name, directory[fd].size );
-                }else if( directory[fd].status == OPEN ){
-                        printf( "%s, currently open, %d bytes in size\n",
-                                        directory[fd].name, directory[fd].size );
-                }else{
-                        printf( "*** status error\n" );
+// adds the file at fd to the name index under the given name, which
+// grtfs_reserve_name() has made room for; returns FALSE when the index
+// cannot be written; the caller holds ctx->lock
+unsigned int grtfs_index_name( grtfs_ctx *ctx, unsigned int fd, char *name ){
+        struct directory_header *header = grtfs_directory_header( ctx );
+        if( !grtfs_insert_bucket( ctx, &ctx->index_map, header->index_block, header->index_buckets - 1,
+                                grtfs_name_hash( name ), fd ) ) return( FALSE );
+        header->names++;
+        return( TRUE );
+}
+
+// removes the file at fd, indexed under the given name, from the name
+// index and shifts later buckets of its probe run back into the gap; a
+// file not found is passed over; the caller holds ctx->lock
+void grtfs_unindex_name( grtfs_ctx *ctx, unsigned int fd, char *name ){
+        struct directory_header *header = grtfs_directory_header( ctx );
+        struct name_bucket buffer[NAME_BUCKETS_PER_BLOCK], *bucket, *gap, moved;
+        unsigned int hash = grtfs_name_hash( name ), mask = header->index_buckets - 1, i, j, n, home;
+        if( header->index_buckets == 0 ) return;
+        for( i = hash & mask, n = 0; ; i = ( i + 1 ) & mask, n++ ){
+                bucket = n <= mask ? grtfs_name_bucket( ctx, &ctx->index_map, header->index_block, i, FALSE, buffer ) : NULL;
+                if( !bucket || ( bucket->fd == 0 ) ) return;
+                if( ( bucket->hash == hash ) && ( bucket->fd == fd ) ) break;
+        }
+        for( j = ( i + 1 ) & mask; j != i; j = ( j + 1 ) & mask ){
+                bucket = grtfs_name_bucket( ctx, &ctx->index_map, header->index_block, j, FALSE, buffer );
+                if( !bucket ) return;
+                if( bucket->fd == 0 ) break;
+                home = bucket->hash & mask;
+                if( ( ( j - home ) & mask ) >= ( ( j - i ) & mask ) ){
+                        moved = *bucket;
+                        gap = grtfs_name_bucket( ctx, &ctx->index_map, header->index_block, i, TRUE, NULL );
+                        if( !gap ) return;
+                        *gap = moved;
+                        i = j;
                 }
-                if( ( directory[fd].status == CLOSED ) ||
-                                ( directory[fd].status == OPEN ) ){
-                        printf( "           FAT:" );
-                        if( directory[fd].first_block == 0 ){
-                                printf( " no blocks in use\n" );
-                        }else{
-                                b = directory[fd].first_block;
-                                while( b != LAST_BLOCK ){
-                                        printf( " %d", b );
-                                        b = file_allocation_table[b];
-                                }
-                                printf( "\n" );
+        }
+        gap = grtfs_name_bucket( ctx, &ctx->index_map, header->index_block, i, TRUE, NULL );
+        if( !gap ) return;
+        gap->hash = 0;
+        gap->fd = 0;
+        header->names--;
+}
+
+// makes room in the name index for one more name; an index that would be
+// more than half full is built again in a new chain of twice the
+// buckets from the hashes its buckets hold, reading no entry, and its
+// old chain is given up; returns FALSE when the blocks or the memory for
+// that cannot be had; the caller holds ctx->lock
+unsigned int grtfs_reserve_name( grtfs_ctx *ctx ){
+        struct directory_header *header;
+        struct name_bucket buffer[NAME_BUCKETS_PER_BLOCK], old[NAME_BUCKETS_PER_BLOCK];
+        struct chain_map map;
+        unsigned int size, n_blocks, first = 0, k, i, b, result;
+        char *bytes;
+        if( !ctx->storage ) return( FALSE );
+        header = grtfs_directory_header( ctx );
+        if( ( header->index_buckets > 0 ) && ( ( header->names + 1 ) * 2 <= header->index_buckets ) ) return( TRUE );
+        size = header->index_buckets > 0 ? 2 * header->index_buckets : NAME_INDEX_SIZE;
+        while( ( header->names + 1 ) * 2 > size ) size *= 2;
+        n_blocks = size / NAME_BUCKETS_PER_BLOCK;
+        memset( &map, 0, sizeof( map ) );
+        result = ( grtfs_new_chain( ctx, &map, &first, 0, n_blocks ) == n_blocks );
+        for( k = 0; result && ( k < header->index_buckets / NAME_BUCKETS_PER_BLOCK ); k++ ){
+                b = grtfs_chain_block( ctx, &ctx->index_map, header->index_block, k );
+                bytes = b ? grtfs_read_meta( ctx, b, (char *) buffer ) : NULL;
+                result = ( bytes != NULL );
+                if( result ) memcpy( old, bytes, BLOCK_SIZE );
+                for( i = 0; result && ( i < NAME_BUCKETS_PER_BLOCK ); i++ )
+                        if( old[i].fd != 0 ) result = grtfs_insert_bucket( ctx, &map, first, size - 1, old[i].hash, old[i].fd );
+        }
+        if( !result ){
+                // the new chain was never pointed to, so its blocks are free at once
+                for( k = 0; k < map.n_extents; k++ ){
+                        for( i = 0; i < map.extents[k].length; i++ ){
+                                b = map.extents[k].block + i;
+                                grtfs_drop_meta( ctx, b );
+                                grtfs_set_fat( ctx, b, FREE );
+                                grtfs_mark_free( ctx, b );
+                                ctx->blocks_freed++;
                         }
                 }
+                free( map.extents );
+                return( FALSE );
         }
-        printf( "-- end --\n" );
+        grtfs_release_chain( ctx, &ctx->index_map, header->index_block, header->index_buckets / NAME_BUCKETS_PER_BLOCK );
+        free( ctx->index_map.extents );
+        ctx->index_map = map;
+        header->index_block = first;
+        header->index_buckets = size;
+        return( TRUE );
 }
 
-/* tfs_exists()
- *
- * return TRUE if a file name is associated with an active
- *   directory entry
- *
- * preconditions:
- *   (1) the name is valid
- *   (2) the name is associated with an active directory entry
+// returns what grtfs_lookup_name() does for a valid name, 0 otherwise
+unsigned int grtfs_map_name_to_fd( grtfs_ctx *ctx, char *name ){
+        if( !grtfs_check_valid_name( ctx, name ) ) return( 0 );
+        return( grtfs_lookup_name( ctx, name ) );
+}
+
+// builds the free block bitmap from the file allocation table through
+// summary word s; the caller holds ctx->lock
+void grtfs_scan_fat( grtfs_ctx *ctx, unsigned int s ){
+        unsigned int w, b, end, n_blocks = ctx->superblock->n_blocks;
+        unsigned long long word;
+        while( ( ctx->scanned_words <= s ) && ( ctx->scanned_words < ctx->summary_words ) ){
+                for( w = ctx->scanned_words * 64; ( w < ( ctx->scanned_words + 1 ) * 64 ) && ( w < ctx->map_words ); w++ ){
+                        word = 0;
+                        b = w * 64 < ctx->superblock->first_data_block ? ctx->superblock->first_data_block : w * 64;
+                        end = w * 64 + 64 < n_blocks ? w * 64 + 64 : n_blocks;
+                        for( ; b < end; b++ ){
+                                if( ctx->file_allocation_table[b] == FREE ) word |= 1ULL << ( b % 64 );
+                        }
+                        ctx->free_map[w] = word;
+                        if( word ) ctx->free_summary[w / 64] |= 1ULL << ( w % 64 );
+                        else ctx->free_summary[w / 64] &= ~( 1ULL << ( w % 64 ) );
+                }
+                ctx->scanned_words++;
+        }
+}
+
+// the caller holds ctx->lock
+unsigned int grtfs_new_block( grtfs_ctx *ctx ){
+        unsigned int s, w, bit;
+        ctx->allocator_scans++;
+        for( s = ctx->free_hint; s < ctx->summary_words; s++ ){
+                ctx->allocator_scan_words++;
+                if( s >= ctx->scanned_words ) grtfs_scan_fat( ctx, s );
+                if( ctx->free_summary[s] == 0 ) continue;
+                w = s * 64 + __builtin_ctzll( ctx->free_summary[s] );
+                bit = __builtin_ctzll( ctx->free_map[w] );
+                ctx->free_map[w] &= ~( 1ULL << bit );
+                if( ctx->free_map[w] == 0 ) ctx->free_summary[s] &= ~( 1ULL << ( w % 64 ) );
+                ctx->free_hint = s;
+                ctx->blocks_allocated++;
+                return( w * 64 + bit );
+        }
+        ctx->free_hint = ctx->summary_words;
+        return( 0 );
+}
+
+// sets the bitmap bits of a free block; the caller holds ctx->lock
+void grtfs_mark_free( grtfs_ctx *ctx, unsigned int b ){
+        unsigned int w = b / 64;
+        ctx->free_map[w] |= 1ULL << ( b % 64 );
+        ctx->free_summary[w / 64] |= 1ULL << ( w % 64 );
+        if( w / 64 < ctx->free_hint ) ctx->free_hint = w / 64;
+}
+
+// gives back a block of a file's chain; a block that other files'
+// chains still pass through only loses a count, and one a snapshot
+// holds stays out of the free block bitmap; the caller holds ctx->lock
+void grtfs_free_block( grtfs_ctx *ctx, unsigned int b ){
+        if( ctx->refs && ( ctx->refs[b] > 1 ) ){
+                ctx->refs[b]--;
+                return;
+        }
+        if( ctx->refs ) ctx->refs[b] = 0;
+        grtfs_set_fat( ctx, b, FREE );
+        if( ctx->frozen && ctx->frozen[b] ) return;
+        grtfs_mark_free( ctx, b );
+        ctx->blocks_freed++;
+}
+
+// returns the first free block at or after b, or n_blocks when there
+// is none; the caller holds ctx->lock
+unsigned int grtfs_next_free( grtfs_ctx *ctx, unsigned int b ){
+        unsigned int w = b / 64, s;
+        unsigned long long word, summary;
+        if( w >= ctx->map_words ) return( ctx->superblock->n_blocks );
+        if( w / 64 >= ctx->scanned_words ) grtfs_scan_fat( ctx, w / 64 );
+        word = ctx->free_map[w] & ( ~0ULL << ( b % 64 ) );
+        if( word != 0 ) return( w * 64 + __builtin_ctzll( word ) );
+        w++;
+        for( s = w / 64; s < ctx->summary_words; s++ ){
+                ctx->allocator_scan_words++;
+                if( s >= ctx->scanned_words ) grtfs_scan_fat( ctx, s );
+                summary = ctx->free_summary[s];
+                if( s == w / 64 ) summary &= ~0ULL << ( w % 64 );
+                if( summary == 0 ) continue;
+                w = s * 64 + __builtin_ctzll( summary );
+                return( w * 64 + __builtin_ctzll( ctx->free_map[w] ) );
+        }
+        return( ctx->superblock->n_blocks );
+}
+
+// returns the number of free blocks from b on, up to max; the caller
+// holds ctx->lock
+unsigned int grtfs_run_length( grtfs_ctx *ctx, unsigned int b, unsigned int max ){
+        unsigned int n = 0, w, bit, free_bits;
+        unsigned long long word;
+        while( n < max ){
+                w = ( b + n ) / 64;
+                bit = ( b + n ) % 64;
+                if( w >= ctx->map_words ) break;
+                if( w / 64 >= ctx->scanned_words ) grtfs_scan_fat( ctx, w / 64 );
+                word = ~( ctx->free_map[w] >> bit );
+                free_bits = word ? (unsigned int) __builtin_ctzll( word ) : 64 - bit;
+                n += free_bits;
+                if( free_bits < 64 - bit ) break;
+        }
+        return( n < max ? n : max );
+}
+
+// takes the length blocks from b on out of the free block bitmap; the
+// caller holds ctx->lock
+void grtfs_mark_used( grtfs_ctx *ctx, unsigned int b, unsigned int length ){
+        unsigned int w, bit, n;
+        unsigned long long mask;
+        while( length > 0 ){
+                w = b / 64;
+                bit = b % 64;
+                n = 64 - bit < length ? 64 - bit : length;
+                mask = ( n == 64 ? ~0ULL : ( ( 1ULL << n ) - 1 ) ) << bit;
+                ctx->free_map[w] &= ~mask;
+                if( ctx->free_map[w] == 0 ) ctx->free_summary[w / 64] &= ~( 1ULL << ( w % 64 ) );
+                b += n;
+                length -= n;
+        }
+}
+
+// finds the first of the first limit free runs that has want blocks,
+// or the longest of them, without taking it; returns its first block
+// and sets *length to up to want blocks of it, 0 when no block is free;
+// the caller holds ctx->lock
+unsigned int grtfs_find_run( grtfs_ctx *ctx, unsigned int want, unsigned int limit, unsigned int *length ){
+        unsigned int n_blocks = ctx->superblock->n_blocks;
+        unsigned int b, run, best = 0, best_run = 0, tries;
+        b = grtfs_next_free( ctx, ctx->free_hint * 64 * 64 );
+        for( tries = 0; ( b < n_blocks ) && ( tries < limit ); tries++ ){
+                run = grtfs_run_length( ctx, b, want );
+                if( run > best_run ){
+                        best = b;
+                        best_run = run;
+                }
+                if( run == want ) break;
+                b = grtfs_next_free( ctx, b + run );
+        }
+        *length = best_run;
+        return( best );
+}
+
+// allocates a run of up to want contiguous blocks and returns its first
+// block, or 0 when the image is full; the run starts at goal when that
+// block is free, so a file can grow in place, otherwise where
+// grtfs_find_run() finds one among RUN_SEARCH_LIMIT runs; the caller
+// holds ctx->lock
+unsigned int grtfs_new_run( grtfs_ctx *ctx, unsigned int goal, unsigned int want, unsigned int *length ){
+        unsigned int n_blocks = ctx->superblock->n_blocks;
+        unsigned int best, best_run;
+        ctx->allocator_scans++;
+        if( ( goal >= ctx->superblock->first_data_block ) && ( goal < n_blocks ) &&
+                        ( grtfs_next_free( ctx, goal ) == goal ) ){
+                best = goal;
+                best_run = grtfs_run_length( ctx, goal, want );
+        }else{
+                best = grtfs_find_run( ctx, want, RUN_SEARCH_LIMIT, &best_run );
+                if( best_run == 0 ){
+                        ctx->free_hint = ctx->summary_words;
+                        return( 0 );
+                }
+        }
+        grtfs_mark_used( ctx, best, best_run );
+        ctx->blocks_allocated += best_run;
+        *length = best_run;
+        return( best );
+}
+
+// forgets everything a file's state caches about its blocks
+void grtfs_reset_file_state( grtfs_ctx *ctx, unsigned int fd ){
+        ctx->files[fd].n_extents = 0;
+        ctx->files[fd].mapped = 0;
+        ctx->files[fd].map_valid = FALSE;
+        ctx->files[fd].extent_hint = 0;
+        ctx->files[fd].unshared = 0;
+        ctx->files[fd].n_groups = 0;
+        ctx->files[fd].cached_group = -1;
+        ctx->files[fd].hashed = 0;
+}
+
+// makes image the context's image: points the file structure vars into
+// it and loads its directory, leaving the directory file and the name
+// index to be read as they are used and the free block bitmap to be
+// built as the allocator reaches it
+unsigned int grtfs_attach_image( grtfs_ctx *ctx, char *image ){
+        unsigned int n_blocks;
+        ctx->storage = image;
+        ctx->blocks = (struct file_block *) image;
+        ctx->superblock = (struct superblock *) &ctx->blocks[0];
+        ctx->image_directory = (struct directory_entry *) &ctx->blocks[ctx->superblock->directory_block];
+        ctx->file_allocation_table = (uint32_t *) &ctx->blocks[ctx->superblock->fat_block];
+        n_blocks = ctx->superblock->n_blocks;
+
+        ctx->map_words = ( n_blocks + 63 ) / 64;
+        ctx->summary_words = ( ctx->map_words + 63 ) / 64;
+        ctx->free_map = calloc( ctx->map_words, sizeof( unsigned long long ) );
+        ctx->free_summary = calloc( ctx->summary_words, sizeof( unsigned long long ) );
+        if( !ctx->free_map || !ctx->free_summary ) return( FALSE );
+        ctx->free_hint = 0;
+        ctx->scanned_words = 0;
+        return( grtfs_load_directory( ctx ) );
+}
+
+// forgets the files in memory and the maps of the chains of the
+// directory file and of the name index, notes the entries of the
+// directory in use and, when files share blocks with clones, counts the
+// files whose chains pass through each block, reading the slots of the
+// directory file only then; returns FALSE when there is no memory for
+// the counts or a slot cannot be read
+unsigned int grtfs_load_directory( grtfs_ctx *ctx ){
+        struct directory_header *header = grtfs_directory_header( ctx );
+        struct directory_entry buffer, *entry;
+        unsigned int fd, b, n_blocks = ctx->superblock->n_blocks;
+        grtfs_reset_active( ctx );
+        if( header->used_slots > ctx->image_directory[0].size / BLOCK_SIZE )
+                header->used_slots = ctx->image_directory[0].size / BLOCK_SIZE;
+        ctx->fixed_used = 0;
+        for( fd = FIRST_VALID_FD; fd < N_DIRECTORY_ENTRIES; fd++ )
+                if( ctx->image_directory[fd].status != UNUSED ) ctx->fixed_used |= 1u << fd;
+        if( ctx->refs ) memset( ctx->refs, 0, n_blocks * sizeof( uint32_t ) );
+        if( header->shared_files == 0 ) return( TRUE );
+        if( !ctx->refs ) ctx->refs = calloc( n_blocks, sizeof( uint32_t ) );
+        if( !ctx->refs ) return( FALSE );
+        for( fd = FIRST_VALID_FD; fd < N_DIRECTORY_ENTRIES + header->used_slots; fd++ ){
+                entry = grtfs_home_entry( ctx, fd, &buffer );
+                if( !entry ) return( FALSE );
+                if( ( entry->status == UNUSED ) || !( entry->flags & SHARED_BLOCKS ) ) continue;
+                for( b = entry->first_block; ( b >= ctx->superblock->first_data_block ) && ( b < n_blocks );
+                                b = ctx->file_allocation_table[b] & ~HOLE_FLAG )
+                        ctx->refs[b]++;
+        }
+        return( TRUE );
+}
+
+// drops the context's image, closing the image file and freeing the
+// block cache if it is backed by a file; the files in memory are
+// forgotten, and the fds of the image's files fail as out of range
+void grtfs_release_image( grtfs_ctx *ctx ){
+        grtfs_reset_active( ctx );
+        if( ctx->image_fd >= 0 ){
+                grtfs_cache_free( ctx );
+                close( ctx->image_fd );
+                ctx->image_fd = -1;
+                if( ctx->storage ) munmap( ctx->storage, (size_t) ctx->superblock->first_data_block * BLOCK_SIZE );
+        }else free( ctx->storage );
+        ctx->journaling = FALSE;
+        grtfs_purge_overlay( ctx, TRUE );
+        free( ctx->meta_dirty );
+        free( ctx->free_map );
+        free( ctx->free_summary );
+        free( ctx->refs );
+        free( ctx->frozen );
+        free( ctx->dedup_index );
+        free( ctx->dir_map.extents );
+        free( ctx->index_map.extents );
+        free( ctx->released );
+        ctx->refs = NULL;
+        ctx->frozen = NULL;
+        ctx->dedup_index = NULL;
+        memset( &ctx->dir_map, 0, sizeof( struct chain_map ) );
+        memset( &ctx->index_map, 0, sizeof( struct chain_map ) );
+        ctx->released = NULL;
+        ctx->n_released = ctx->max_released = 0;
+        ctx->snapshots = 0;
+        ctx->storage = NULL;
+        ctx->meta_dirty = NULL;
+        ctx->free_map = NULL;
+        ctx->free_summary = NULL;
+}
+
+// sets a file allocation table entry, flagging its block for the next
+// sync of a mounted image; the caller holds ctx->lock
+void grtfs_set_fat( grtfs_ctx *ctx, unsigned int b, unsigned int next ){
+        ctx->file_allocation_table[b] = next;
+        if( ctx->meta_dirty )
+                ctx->meta_dirty[ctx->superblock->fat_block + b / ( BLOCK_SIZE / sizeof( uint32_t ) )] = TRUE;
+}
+
+// writes the directory of a mounted image to the image file; the caller
+// holds ctx->lock and has stored the entries of the files in memory
+unsigned int grtfs_flush_directory( grtfs_ctx *ctx ){
+        size_t bytes = (size_t) ( ctx->superblock->fat_block - ctx->superblock->directory_block ) * BLOCK_SIZE;
+        return( pwrite( ctx->image_fd, ctx->image_directory, bytes,
+                                (off_t) ctx->superblock->directory_block * BLOCK_SIZE ) == (ssize_t) bytes );
+}
+
+// writes the flagged file allocation table blocks of a mounted image to
+// the image file, each run of consecutive blocks in one write; the
+// caller holds ctx->lock
+unsigned int grtfs_flush_fat( grtfs_ctx *ctx ){
+        unsigned int first = ctx->superblock->fat_block, last, end = ctx->superblock->journal_block;
+        size_t bytes;
+        while( first < end ){
+                for( ; ( first < end ) && !ctx->meta_dirty[first]; first++ );
+                for( last = first; ( last < end ) && ctx->meta_dirty[last]; last++ )
+                        ctx->meta_dirty[last] = FALSE;
+                if( first == last ) break;
+                bytes = (size_t) ( last - first ) * BLOCK_SIZE;
+                if( pwrite( ctx->image_fd, ctx->storage + (size_t) first * BLOCK_SIZE, bytes,
+                                        (off_t) first * BLOCK_SIZE ) != (ssize_t) bytes )
+                        return( FALSE );
+                first = last;
+        }
+        return( TRUE );
+}
+
+// writes the changed blocks of the directory file and of the name index
+// of a mounted image in place, each run of consecutive blocks in one
+// write; the caller holds ctx->lock
+unsigned int grtfs_flush_overlay( grtfs_ctx *ctx ){
+        unsigned int count = grtfs_dirty_meta( ctx ), first, i, result;
+        uint32_t *list = malloc( ( count + 1 ) * sizeof( uint32_t ) );
+        char *images = malloc( (size_t) ( count + 1 ) * BLOCK_SIZE );
+        result = list && images && grtfs_copy_overlay( ctx, list, images, count );
+        for( first = 0; result && ( first < count ); first = i ){
+                for( i = first + 1; ( i < count ) && ( list[i] == list[i - 1] + 1 ); i++ );
+                result = grtfs_write_home( ctx, images + (size_t) first * BLOCK_SIZE, list[first], i - first );
+        }
+        if( !result && list && images ) grtfs_redirty_overlay( ctx, list, count );
+        free( list );
+        free( images );
+        return( result );
+}
+
+// writes count blocks from bytes in place from block b on in the image
+// file of a mounted image; file blocks, as those of the directory file
+// and of the name index are, are written under the cache lock and
+// copied into the cached pages holding them, so that no page written
+// back later puts older bytes over them
+unsigned int grtfs_write_home( grtfs_ctx *ctx, char *bytes, unsigned int b, unsigned int count ){
+        struct block_cache *cache = &ctx->cache;
+        size_t length = (size_t) count * BLOCK_SIZE;
+        unsigned int k, number, result;
+        int p;
+        if( b < ctx->superblock->first_data_block )
+                return( pwrite( ctx->image_fd, bytes, length, (off_t) b * BLOCK_SIZE ) == (ssize_t) length );
+        pthread_mutex_lock( &cache->lock );
+        result = ( pwrite( ctx->image_fd, bytes, length, (off_t) b * BLOCK_SIZE ) == (ssize_t) length );
+        for( k = 0; k < count; k++ ){
+                number = ( b + k ) / CACHE_PAGE_BLOCKS;
+                for( p = cache->buckets[number & cache->bucket_mask]; ( p >= 0 ) && ( cache->pages[p].page != number );
+                                p = cache->pages[p].hash_next );
+                if( p >= 0 ) memcpy( cache->data + (size_t) p * CACHE_PAGE_BYTES + ( ( b + k ) % CACHE_PAGE_BLOCKS ) * BLOCK_SIZE,
+                                bytes + (size_t) k * BLOCK_SIZE, BLOCK_SIZE );
+        }
+        pthread_mutex_unlock( &cache->lock );
+        return( result );
+}
+
+// marks the start of a call that changes the directory or the file
+// allocation table of an image synced through its journal, waiting while
+// a commit copies them; the caller holds no lock
+void grtfs_begin_change( grtfs_ctx *ctx ){
+        if( !ctx->journaling ) return;
+        pthread_mutex_lock( &ctx->change_lock );
+        while( ctx->change_paused ) pthread_cond_wait( &ctx->change_done, &ctx->change_lock );
+        ctx->changes++;
+        pthread_mutex_unlock( &ctx->change_lock );
+}
+
+// marks the end of a call started with grtfs_begin_change()
+void grtfs_end_change( grtfs_ctx *ctx ){
+        if( !ctx->journaling ) return;
+        pthread_mutex_lock( &ctx->change_lock );
+        if( --ctx->changes == 0 ) pthread_cond_broadcast( &ctx->change_done );
+        pthread_mutex_unlock( &ctx->change_lock );
+}
+
+// begins a change, takes the lock of the file at file_descriptor for
+// writing once no view of the file is left and returns its index in
+// memory; it waits for views holding neither, so that the thread
+// holding a view can still sync or change other files; returns 0, the
+// change ended, when the fd names no file or no index can be had
+unsigned int grtfs_lock_unpinned( grtfs_ctx *ctx, unsigned int file_descriptor ){
+        struct file_state *file;
+        unsigned int a;
+        for( ;; ){
+                grtfs_begin_change( ctx );
+                a = grtfs_lock_file( ctx, file_descriptor, TRUE );
+                if( a == 0 ){
+                        grtfs_end_change( ctx );
+                        return( 0 );
+                }
+                file = &ctx->files[a];
+                if( grtfs_file_pins( ctx, a ) == 0 ) return( a );
+                pthread_rwlock_unlock( &file->lock );
+                grtfs_end_change( ctx );
+                pthread_mutex_lock( &ctx->pin_lock );
+                while( file->pins > 0 ) pthread_cond_wait( &ctx->unpinned, &ctx->pin_lock );
+                pthread_mutex_unlock( &ctx->pin_lock );
+        }
+}
+
+// returns the pins of a file; the caller holds the file's lock, so no
+// view can be taken meanwhile
+unsigned int grtfs_file_pins( grtfs_ctx *ctx, unsigned int fd ){
+        unsigned int pins;
+        pthread_mutex_lock( &ctx->pin_lock );
+        pins = ctx->files[fd].pins;
+        pthread_mutex_unlock( &ctx->pin_lock );
+        return( pins );
+}
+
+// FNV-1a hash of length bytes, as grtfs_name_hash() hashes names
+uint32_t grtfs_checksum( const char *bytes, size_t length ){
+        uint32_t h = 2166136261u;
+        size_t i;
+        for( i = 0; i < length; i++ ) h = ( h ^ (unsigned char) bytes[i] ) * 16777619u;
+        return( h );
+}
+
+// commits the directory, the flagged file allocation table blocks and
+// the changed blocks of the directory file and of the name index of a
+// mounted image through its journal: stores the entries of the files in
+// memory and copies all of these as one transaction once no call is
+// changing them, writes the transaction to the journal and flushes it,
+// then writes the blocks in place and flushes them, and only then frees
+// the blocks of name index chains given up; a transaction the journal
+// cannot hold is written as several, the last holding the directory,
+// the FAT and as many blocks before them as fit, so that blocks of the
+// chains the commit adds are in place before what points to them; the
+// caller holds no lock
+unsigned int grtfs_write_journal( grtfs_ctx *ctx ){
+        struct superblock *sb = ctx->superblock;
+        unsigned int directory_blocks = sb->fat_block - sb->directory_block;
+        unsigned int b, i, n_meta, n_released = 0, count, first, end, capacity, result;
+        uint32_t *list, *released = NULL;
+        char *images;
+
+        pthread_mutex_lock( &ctx->change_lock );
+        ctx->change_paused = TRUE;
+        while( ctx->changes > 0 ) pthread_cond_wait( &ctx->change_done, &ctx->change_lock );
+        pthread_mutex_unlock( &ctx->change_lock );
+
+        result = grtfs_store_entries( ctx );
+        pthread_mutex_lock( &ctx->lock );
+        n_meta = grtfs_dirty_meta( ctx );
+        for( b = sb->fat_block, count = n_meta + directory_blocks; b < sb->journal_block; b++ )
+                count += ctx->meta_dirty[b];
+        images = malloc( (size_t) count * BLOCK_SIZE );
+        list = malloc( count * sizeof( uint32_t ) );
+        result = result && images && list && grtfs_copy_overlay( ctx, list, images, n_meta );
+        if( result ){
+                i = n_meta;
+                memcpy( images + (size_t) i * BLOCK_SIZE, ctx->image_directory, (size_t) directory_blocks * BLOCK_SIZE );
+                for( b = sb->directory_block; b < sb->fat_block; b++ ) list[i++] = b;
+                for( b = sb->fat_block; b < sb->journal_block; b++ ){
+                        if( !ctx->meta_dirty[b] ) continue;
+                        memcpy( images + (size_t) i * BLOCK_SIZE, ctx->storage + (size_t) b * BLOCK_SIZE, BLOCK_SIZE );
+                        ctx->meta_dirty[b] = FALSE;
+                        list[i++] = b;
+                }
+                released = ctx->released;
+                n_released = ctx->n_released;
+                ctx->released = NULL;
+                ctx->n_released = ctx->max_released = 0;
+        }
+        pthread_mutex_unlock( &ctx->lock );
+
+        pthread_mutex_lock( &ctx->change_lock );
+        ctx->change_paused = FALSE;
+        pthread_cond_broadcast( &ctx->change_done );
+        pthread_mutex_unlock( &ctx->change_lock );
+        if( !result ){
+                free( images );
+                free( list );
+                return( FALSE );
+        }
+
+        // the first transaction takes what the others, full ones, leave
+        capacity = grtfs_journal_capacity( sb );
+        for( first = 0; result && ( first < count ); first = end ){
+                end = first + ( first == 0 ? ( count - 1 ) % capacity + 1 : capacity );
+                result = grtfs_write_transaction( ctx, list + first, images + (size_t) first * BLOCK_SIZE, end - first );
+        }
+
+        // blocks not made durable are flagged again for the next commit,
+        // and the blocks given up stay out of use until one succeeds
+        pthread_mutex_lock( &ctx->lock );
+        if( result ){
+                grtfs_purge_overlay( ctx, FALSE );
+                grtfs_free_released( ctx, released, n_released );
+        }else{
+                grtfs_redirty_overlay( ctx, list, n_meta );
+                for( i = n_meta + directory_blocks; i < count; i++ ) ctx->meta_dirty[list[i]] = TRUE;
+                grtfs_keep_released( ctx, released, n_released );
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        free( images );
+        free( list );
+        free( released );
+        return( result );
+}
+
+// writes count blocks, list holding the home block of each, to the
+// journal of a mounted image as one transaction and flushes it, then
+// writes them in place, each run of consecutive blocks in one write, and
+// flushes them; the caller holds no lock
+unsigned int grtfs_write_transaction( grtfs_ctx *ctx, uint32_t *list, char *images, unsigned int count ){
+        struct journal_header *header;
+        unsigned int list_blocks = ( count * sizeof( uint32_t ) + BLOCK_SIZE - 1 ) / BLOCK_SIZE, first, i, result;
+        size_t bytes = (size_t) ( 1 + list_blocks + count ) * BLOCK_SIZE;
+        char *transaction;
+
+        transaction = calloc( bytes, 1 );
+        if( !transaction ) return( FALSE );
+        memcpy( transaction + BLOCK_SIZE, list, count * sizeof( uint32_t ) );
+        memcpy( transaction + (size_t) ( 1 + list_blocks ) * BLOCK_SIZE, images, (size_t) count * BLOCK_SIZE );
+        header = (struct journal_header *) transaction;
+        header->magic = GRTFS_JOURNAL_MAGIC;
+        header->sequence = ctx->journal_sequence++;
+        header->count = count;
+        header->checksum = grtfs_checksum( transaction, bytes );
+        result = ( pwrite( ctx->image_fd, transaction, bytes, (off_t) ctx->superblock->journal_block * BLOCK_SIZE ) ==
+                        (ssize_t) bytes ) && ( fdatasync( ctx->image_fd ) == 0 );
+        free( transaction );
+        for( first = 0; result && ( first < count ); first = i ){
+                for( i = first + 1; ( i < count ) && ( list[i] == list[i - 1] + 1 ); i++ );
+                result = grtfs_write_home( ctx, images + (size_t) first * BLOCK_SIZE, list[first], i - first );
+        }
+        return( result && ( fdatasync( ctx->image_fd ) == 0 ) );
+}
+
+// returns the most blocks a transaction in the journal of an image can
+// hold
+unsigned int grtfs_journal_capacity( struct superblock *sb ){
+        unsigned int count = sb->journal_blocks;
+        while( ( count > 0 ) &&
+                        ( 1 + ( count * sizeof( uint32_t ) + BLOCK_SIZE - 1 ) / BLOCK_SIZE + count > sb->journal_blocks ) )
+                count--;
+        return( count );
+}
+
+// writes in place the blocks of the transaction in the journal of an
+// image file that differ from it, when the transaction is whole, and
+// flushes them; a transaction already written in place, as after a
+// clean unmount, is left to be replayed again; sets *sequence to the
+// sequence number of the next transaction; returns FALSE when the
+// image file cannot be read or written
+unsigned int grtfs_replay_journal( int file, struct superblock *sb, uint32_t *sequence ){
+        struct journal_header header;
+        unsigned int max = grtfs_journal_capacity( sb ), list_blocks, i, valid, written = 0;
+        uint32_t *list, checksum;
+        char *transaction, *images, block[BLOCK_SIZE];
+        size_t bytes;
+
+        *sequence = 1;
+        if( pread( file, &header, sizeof( header ), (off_t) sb->journal_block * BLOCK_SIZE ) != sizeof( header ) )
+                return( FALSE );
+        if( ( header.magic != GRTFS_JOURNAL_MAGIC ) || ( header.count == 0 ) || ( header.count > max ) )
+                return( TRUE );
+        *sequence = header.sequence + 1;
+        list_blocks = ( header.count * sizeof( uint32_t ) + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+        bytes = (size_t) ( 1 + list_blocks + header.count ) * BLOCK_SIZE;
+        transaction = malloc( bytes );
+        if( !transaction ) return( FALSE );
+        if( pread( file, transaction, bytes, (off_t) sb->journal_block * BLOCK_SIZE ) != (ssize_t) bytes ){
+                free( transaction );
+                return( FALSE );
+        }
+        ( (struct journal_header *) transaction )->checksum = 0;
+        checksum = grtfs_checksum( transaction, bytes );
+        list = (uint32_t *) ( transaction + BLOCK_SIZE );
+        images = transaction + (size_t) ( 1 + list_blocks ) * BLOCK_SIZE;
+        valid = ( checksum == header.checksum );
+        for( i = 0; valid && ( i < header.count ); i++ )
+                valid = ( ( list[i] >= sb->directory_block ) && ( list[i] < sb->journal_block ) ) ||
+                        ( ( list[i] >= sb->first_data_block ) && ( list[i] < sb->n_blocks ) );
+
+        for( i = 0; valid && ( i < header.count ); i++ ){
+                if( pread( file, block, BLOCK_SIZE, (off_t) list[i] * BLOCK_SIZE ) != BLOCK_SIZE ) break;
+                if( memcmp( block, images + (size_t) i * BLOCK_SIZE, BLOCK_SIZE ) == 0 ) continue;
+                if( pwrite( file, images + (size_t) i * BLOCK_SIZE, BLOCK_SIZE,
+                                        (off_t) list[i] * BLOCK_SIZE ) != BLOCK_SIZE ) break;
+                written++;
+        }
+        free( transaction );
+        if( valid && ( i < header.count ) ) return( FALSE );
+        return( ( written == 0 ) || ( fdatasync( file ) == 0 ) );
+}
+
+// empties the journal of an image file, so that metadata written in
+// place without it is not overwritten by a replay
+unsigned int grtfs_clear_journal( int file, struct superblock *sb ){
+        char block[BLOCK_SIZE];
+        memset( block, 0, sizeof( block ) );
+        return( ( pwrite( file, block, BLOCK_SIZE, (off_t) sb->journal_block * BLOCK_SIZE ) == BLOCK_SIZE ) &&
+                        ( fdatasync( file ) == 0 ) );
+}
+
+// writes back the dirty cached blocks of a mounted image, then its
+// metadata, through the journal when journaling or else in place, and
+// flushes the image file
+unsigned int grtfs_commit( grtfs_ctx *ctx ){
+        unsigned int n_released, result;
+        uint32_t *released;
+        if( ctx->journaling ) return( grtfs_cache_flush( ctx ) && grtfs_write_journal( ctx ) );
+        result = grtfs_cache_flush( ctx ) && grtfs_store_entries( ctx );
+        pthread_mutex_lock( &ctx->lock );
+        if( !grtfs_flush_overlay( ctx ) || !grtfs_flush_directory( ctx ) || !grtfs_flush_fat( ctx ) ) result = FALSE;
+        released = ctx->released;
+        n_released = ctx->n_released;
+        ctx->released = NULL;
+        ctx->n_released = ctx->max_released = 0;
+        pthread_mutex_unlock( &ctx->lock );
+        result = result && ( fdatasync( ctx->image_fd ) == 0 );
+        pthread_mutex_lock( &ctx->lock );
+        if( result ){
+                grtfs_purge_overlay( ctx, FALSE );
+                grtfs_free_released( ctx, released, n_released );
+        }else grtfs_keep_released( ctx, released, n_released );
+        pthread_mutex_unlock( &ctx->lock );
+        free( released );
+        return( result );
+}
+
+// allocates an empty block cache of ctx->cache_bytes for a mounted image
+unsigned int grtfs_cache_init( grtfs_ctx *ctx ){
+        struct block_cache *cache = &ctx->cache;
+        unsigned int i, n_buckets = 1;
+        cache->n_pages = ctx->cache_bytes / CACHE_PAGE_BYTES;
+        if( cache->n_pages == 0 ) cache->n_pages = 1;
+        while( n_buckets < 2 * cache->n_pages ) n_buckets *= 2;
+        cache->bucket_mask = n_buckets - 1;
+        cache->pages = calloc( cache->n_pages, sizeof( struct cache_page ) );
+        cache->data = malloc( (size_t) cache->n_pages * CACHE_PAGE_BYTES );
+        cache->buckets = malloc( n_buckets * sizeof( int ) );
+        if( !cache->pages || !cache->data || !cache->buckets ) return( FALSE );
+        for( i = 0; i < n_buckets; i++ ) cache->buckets[i] = -1;
+        for( i = 0; i < cache->n_pages; i++ ){
+                cache->pages[i].hash_next = -1;
+                cache->pages[i].lru_prev = (int) i - 1;
+                cache->pages[i].lru_next = i + 1 < cache->n_pages ? (int) i + 1 : -1;
+        }
+        cache->lru_head = 0;
+        cache->lru_tail = cache->n_pages - 1;
+        return( TRUE );
+}
+
+void grtfs_cache_free( grtfs_ctx *ctx ){
+        free( ctx->cache.pages );
+        free( ctx->cache.data );
+        free( ctx->cache.buckets );
+        ctx->cache.pages = NULL;
+        ctx->cache.data = NULL;
+        ctx->cache.buckets = NULL;
+}
+
+// writes count cached pages, up to MAX_WRITE_PAGES, in order of page
+// number and each following the one before it, to the image file in one
+// write; the blocks of a page before first_data_block are left out, as
+// their cached copies are never updated and the metadata they hold is
+// written by the syncs alone; the caller holds the cache lock
+unsigned int grtfs_cache_write_pages( grtfs_ctx *ctx, int *pages, unsigned int count ){
+        struct block_cache *cache = &ctx->cache;
+        struct iovec iov[MAX_WRITE_PAGES];
+        off_t start = (off_t) cache->pages[pages[0]].page * CACHE_PAGE_BYTES;
+        off_t first = (off_t) ctx->superblock->first_data_block * BLOCK_SIZE;
+        size_t bytes = 0, length, skip = 0;
+        unsigned int i;
+        if( start < first ) skip = first - start;
+        for( i = 0; i < count; i++ ){
+                length = ctx->image_bytes - ( start + bytes );
+                if( length > CACHE_PAGE_BYTES ) length = CACHE_PAGE_BYTES;
+                iov[i].iov_base = cache->data + (size_t) pages[i] * CACHE_PAGE_BYTES;
+                iov[i].iov_len = length;
+                bytes += length;
+                cache->pages[pages[i]].dirty = FALSE;
+        }
+        iov[0].iov_base = (char *) iov[0].iov_base + skip;
+        iov[0].iov_len -= skip;
+        cache->writebacks += count;
+        return( pwritev( ctx->image_fd, iov, count, start + skip ) == (ssize_t) ( bytes - skip ) );
+}
+
+// moves a cached page to the front of the LRU list
+void grtfs_cache_touch( grtfs_ctx *ctx, int p ){
+        struct block_cache *cache = &ctx->cache;
+        struct cache_page *page = &cache->pages[p];
+        if( cache->lru_head == p ) return;
+        cache->pages[page->lru_prev].lru_next = page->lru_next;
+        if( page->lru_next >= 0 ) cache->pages[page->lru_next].lru_prev = page->lru_prev;
+        else cache->lru_tail = page->lru_prev;
+        page->lru_prev = -1;
+        page->lru_next = cache->lru_head;
+        cache->pages[cache->lru_head].lru_prev = p;
+        cache->lru_head = p;
+}
+
+// returns the cached page holding image page number, evicting the least
+// recently used page not pinned, after writing it back when dirty, on a
+// miss; the page is read from the image file unless the caller
+// overwrites all of it; returns -1 when the image file cannot be read
+// or written or every page is pinned; the caller holds the cache lock
+int grtfs_cache_page( grtfs_ctx *ctx, unsigned int number, unsigned int overwrite ){
+        struct block_cache *cache = &ctx->cache;
+        struct cache_page *page;
+        int p, *link;
+        ssize_t got;
+
+        for( p = cache->buckets[number & cache->bucket_mask]; p >= 0; p = cache->pages[p].hash_next ){
+                if( cache->pages[p].page == number ){
+                        cache->hits++;
+                        grtfs_cache_touch( ctx, p );
+                        return( p );
+                }
+        }
+        cache->misses++;
+
+        for( p = cache->lru_tail; ( p >= 0 ) && ( cache->pages[p].pins > 0 ); p = cache->pages[p].lru_prev );
+        if( p < 0 ) return( -1 );
+        page = &cache->pages[p];
+        if( page->valid ){
+                if( page->dirty && !grtfs_cache_write_pages( ctx, &p, 1 ) ) return( -1 );
+                for( link = &cache->buckets[page->page & cache->bucket_mask]; *link != p;
+                                link = &cache->pages[*link].hash_next );
+                *link = page->hash_next;
+                page->valid = FALSE;
+        }
+        if( !overwrite ){
+                got = pread( ctx->image_fd, cache->data + (size_t) p * CACHE_PAGE_BYTES,
+                                CACHE_PAGE_BYTES, (off_t) number * CACHE_PAGE_BYTES );
+                if( got < 0 ) return( -1 );
+                memset( cache->data + (size_t) p * CACHE_PAGE_BYTES + got, 0, CACHE_PAGE_BYTES - got );
+        }
+        page->page = number;
+        page->valid = TRUE;
+        page->dirty = FALSE;
+        page->hash_next = cache->buckets[number & cache->bucket_mask];
+        cache->buckets[number & cache->bucket_mask] = p;
+        grtfs_cache_touch( ctx, p );
+        return( p );
+}
+
+// copies length bytes between buffer and block b of a mounted image from
+// byte offset on, into the block when write is TRUE, in which case a NULL
+// buffer writes zeros; the bytes lie in one cache page, which is pinned
+// while they are copied so that the copy runs outside the cache lock,
+// and a page written is flagged dirty only once the copy is done, so a
+// flush meanwhile leaves it dirty; the blocks copied belong to a file
+// whose lock the caller holds, so no other copy changes them at once
+unsigned int grtfs_cache_copy( grtfs_ctx *ctx, unsigned int b, unsigned int offset,
+                char *buffer, unsigned int length, unsigned int write ){
+        struct block_cache *cache = &ctx->cache;
+        unsigned int in_page = ( b % CACHE_PAGE_BLOCKS ) * BLOCK_SIZE + offset;
+        unsigned int overwrite = write && ( in_page == 0 ) && ( length == CACHE_PAGE_BYTES );
+        char *bytes;
+        int p;
+        pthread_mutex_lock( &cache->lock );
+        // with every page pinned, copies under way give theirs back soon
+        while( ( ( p = grtfs_cache_page( ctx, b / CACHE_PAGE_BLOCKS, overwrite ) ) < 0 ) && ( cache->copies > 0 ) )
+                pthread_cond_wait( &cache->copied, &cache->lock );
+        if( p >= 0 ){
+                cache->pages[p].pins++;
+                cache->copies++;
+        }
+        pthread_mutex_unlock( &cache->lock );
+        if( p < 0 ) return( FALSE );
+        bytes = cache->data + (size_t) p * CACHE_PAGE_BYTES + in_page;
+        if( !write ) memcpy( buffer, bytes, length );
+        else if( buffer ) memcpy( bytes, buffer, length );
+        else memset( bytes, 0, length );
+        pthread_mutex_lock( &cache->lock );
+        cache->pages[p].pins--;
+        cache->copies--;
+        if( write ) cache->pages[p].dirty = TRUE;
+        pthread_cond_broadcast( &cache->copied );
+        pthread_mutex_unlock( &cache->lock );
+        return( TRUE );
+}
+
+// copies length bytes between buffer and the contiguous blocks from b on
+// from byte offset on, as grtfs_cache_copy() does but for either kind of
+// image and across cache pages; returns FALSE when the image file of a
+// mounted image cannot be read or written
+unsigned int grtfs_copy_blocks( grtfs_ctx *ctx, unsigned int b, unsigned int offset,
+                char *buffer, unsigned int length, unsigned int write ){
+        unsigned int span;
+        char *bytes;
+        b += offset / BLOCK_SIZE;
+        offset %= BLOCK_SIZE;
+        if( ctx->image_fd < 0 ){
+                bytes = ctx->blocks[b].bytes + offset;
+                if( !write ) memcpy( buffer, bytes, length );
+                else if( buffer ) memcpy( bytes, buffer, length );
+                else memset( bytes, 0, length );
+                return( TRUE );
+        }
+        while( length > 0 ){
+                span = CACHE_PAGE_BYTES - ( b % CACHE_PAGE_BLOCKS ) * BLOCK_SIZE - offset;
+                if( span > length ) span = length;
+                if( !grtfs_cache_copy( ctx, b, offset, buffer, span, write ) ) return( FALSE );
+                if( buffer ) buffer += span;
+                b += ( offset + span ) / BLOCK_SIZE;
+                offset = ( offset + span ) % BLOCK_SIZE;
+                length -= span;
+        }
+        return( TRUE );
+}
+
+int grtfs_compare_keys( const void *a, const void *b ){
+        unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+        return( ( x > y ) - ( x < y ) );
+}
+
+// writes all dirty cached pages back to the image file in order of page
+// number, each run of consecutive pages in one write
+unsigned int grtfs_cache_flush( grtfs_ctx *ctx ){
+        struct block_cache *cache = &ctx->cache;
+        unsigned int i, j, n = 0, run, result = TRUE;
+        unsigned long long *keys;
+        int pages[MAX_WRITE_PAGES];
+        pthread_mutex_lock( &cache->lock );
+        keys = malloc( cache->n_pages * sizeof( unsigned long long ) );
+        if( !keys ){
+                pthread_mutex_unlock( &cache->lock );
+                return( FALSE );
+        }
+        // sort the dirty pages by page number, keeping where each is cached
+        for( i = 0; i < cache->n_pages; i++ )
+                if( cache->pages[i].valid && cache->pages[i].dirty )
+                        keys[n++] = (unsigned long long) cache->pages[i].page << 32 | i;
+        qsort( keys, n, sizeof( unsigned long long ), grtfs_compare_keys );
+        for( i = 0; i < n; i += run ){
+                for( run = 1; ( i + run < n ) && ( run < MAX_WRITE_PAGES ) &&
+                                ( keys[i + run] >> 32 == ( keys[i] >> 32 ) + run ); run++ );
+                for( j = 0; j < run; j++ ) pages[j] = keys[i + j] & 0xffffffff;
+                if( !grtfs_cache_write_pages( ctx, pages, run ) ) result = FALSE;
+        }
+        free( keys );
+        pthread_mutex_unlock( &cache->lock );
+        return( result );
+}
+
+// writes back the dirty cached pages holding count blocks from b on, each
+// run of consecutive pages in one write; the caller holds the cache lock
+unsigned int grtfs_cache_flush_run( grtfs_ctx *ctx, unsigned int b, unsigned int count ){
+        struct block_cache *cache = &ctx->cache;
+        unsigned int number, last = ( b + count - 1 ) / CACHE_PAGE_BLOCKS, n = 0, result = TRUE;
+        int pages[MAX_WRITE_PAGES], p;
+        if( count == 0 ) return( TRUE );
+        for( number = b / CACHE_PAGE_BLOCKS; number <= last; number++ ){
+                for( p = cache->buckets[number & cache->bucket_mask]; ( p >= 0 ) && ( cache->pages[p].page != number );
+                                p = cache->pages[p].hash_next );
+                if( ( p >= 0 ) && cache->pages[p].dirty ) pages[n++] = p;
+                if( ( n > 0 ) && ( ( n == MAX_WRITE_PAGES ) || ( number == last ) || ( p < 0 ) || !cache->pages[p].dirty ) ){
+                        if( !grtfs_cache_write_pages( ctx, pages, n ) ) result = FALSE;
+                        n = 0;
+                }
+        }
+        return( result );
+}
+
+// writes back the dirty cached pages holding the blocks of the file at
+// entry fd, as its extent map or its groups list them, leaving the other
+// pages and the metadata to the next sync; the caller holds the file's
+// lock
+unsigned int grtfs_cache_flush_file( grtfs_ctx *ctx, unsigned int fd ){
+        struct file_state *file = &ctx->files[fd];
+        unsigned int i, result = TRUE;
+        if( ( ctx->image_fd < 0 ) || !file->map_valid ) return( TRUE );
+        pthread_mutex_lock( &ctx->cache.lock );
+        for( i = 0; i < file->n_extents; i++ )
+                if( !file->extents[i].hole && !grtfs_cache_flush_run( ctx, file->extents[i].block, file->extents[i].length ) )
+                        result = FALSE;
+        for( i = 0; i < file->n_groups; i++ )
+                if( !grtfs_cache_flush_run( ctx, file->groups[i].block, file->groups[i].length ) ) result = FALSE;
+        pthread_mutex_unlock( &ctx->cache.lock );
+        return( result );
+}
+
+
+/* implementation of public functions */
+
+/* tfs_ctx_new()
+ *
+ * creates a context holding no image; a context must be given an
+ *   image by tfs_init(), tfs_init_blocks() or tfs_mount() before
+ *   any other call, and until then the calls taking a name or a file
+ *   descriptor fail as for a file that does not exist
+ *
+ * several contexts can be used at once, and all calls on one context
+ *   can be made from several threads, except tfs_init(),
+ *   tfs_init_blocks(), tfs_mount(), tfs_unmount() and tfs_ctx_free(),
+ *   which must not overlap any other call on the same context
+ *
+ * no parameters
+ *
+ * return value is the new context or NULL when failure
+ */
+
+grtfs_ctx *grtfs_ctx_new(){
+        grtfs_ctx *ctx;
+        unsigned int a;
+        ctx = calloc( 1, sizeof( grtfs_ctx ) );
+        if( !ctx ) return( NULL );
+        ctx->image_fd = -1;
+        ctx->cache_bytes = DEFAULT_CACHE_BYTES;
+        ctx->journal = TRUE;
+        pthread_mutex_init( &ctx->lock, NULL );
+        pthread_mutex_init( &ctx->cache.lock, NULL );
+        pthread_cond_init( &ctx->cache.copied, NULL );
+        pthread_mutex_init( &ctx->change_lock, NULL );
+        pthread_cond_init( &ctx->change_done, NULL );
+        pthread_mutex_init( &ctx->commit_lock, NULL );
+        pthread_cond_init( &ctx->commit_done, NULL );
+        pthread_mutex_init( &ctx->pin_lock, NULL );
+        pthread_cond_init( &ctx->unpinned, NULL );
+        for( a = 0; a <= MAX_OPEN_FILES; a++ ){
+                pthread_rwlock_init( &ctx->files[a].lock, NULL );
+                pthread_mutex_init( &ctx->files[a].state_lock, NULL );
+        }
+        grtfs_reset_active( ctx );
+        return( ctx );
+}
+
+/* tfs_ctx_free()
+ *
+ * unmounts or drops the image of a context and frees the context
+ *
+ * input parameter is a context
+ *
+ * no return value
+ */
+
+void grtfs_ctx_free( grtfs_ctx *ctx ){
+        unsigned int a;
+        if( ctx->image_fd >= 0 ) grtfs_unmount( ctx );
+        grtfs_release_image( ctx );
+        pthread_mutex_destroy( &ctx->lock );
+        pthread_mutex_destroy( &ctx->cache.lock );
+        pthread_cond_destroy( &ctx->cache.copied );
+        pthread_mutex_destroy( &ctx->change_lock );
+        pthread_cond_destroy( &ctx->change_done );
+        pthread_mutex_destroy( &ctx->commit_lock );
+        pthread_cond_destroy( &ctx->commit_done );
+        pthread_mutex_destroy( &ctx->pin_lock );
+        pthread_cond_destroy( &ctx->unpinned );
+        for( a = 0; a <= MAX_OPEN_FILES; a++ ){
+                pthread_rwlock_destroy( &ctx->files[a].lock );
+                pthread_mutex_destroy( &ctx->files[a].state_lock );
+                free( ctx->files[a].extents );
+                free( ctx->files[a].groups );
+                free( ctx->files[a].group_data );
+                free( ctx->files[a].hashes );
+        }
+        free( ctx );
+}
+
+/* tfs_layout()
+ *
+ * computes where the directory, the file allocation table, the
+ *   journal and the first file block lie in an image of the given
+ *   number of blocks; the journal can hold a transaction of all of
+ *   the directory and the file allocation table and of
+ *   JOURNAL_SPARE_BLOCKS blocks of the directory file and the name
+ *   index, and an image without one has journal_blocks 0 and
+ *   journal_block first_data_block
+ *
+ * input parameters are the superblock to fill in, the number of
+ *   blocks in the image and whether it has a journal
+ *
+ * return value is TRUE when the image can hold at least one file
+ *   block or FALSE when failure
+ */
+
+unsigned int grtfs_layout( struct superblock *sb, unsigned int n_blocks, unsigned int journal ){
+        unsigned int directory_bytes, fat_bytes, metadata_blocks;
+        if( n_blocks > MAX_BLOCKS ) return( FALSE );
+        directory_bytes = N_DIRECTORY_ENTRIES * sizeof( struct directory_entry );
+        fat_bytes = n_blocks * sizeof( uint32_t );
+        sb->magic = GRTFS_MAGIC;
+        sb->version = GRTFS_VERSION;
+        sb->block_size = BLOCK_SIZE;
+        sb->n_blocks = n_blocks;
+        sb->n_directory_entries = N_DIRECTORY_ENTRIES;
+        sb->directory_block = 1;
+        sb->fat_block = sb->directory_block +
+                ( directory_bytes + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+        sb->journal_block = sb->fat_block +
+                ( fat_bytes + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+        metadata_blocks = sb->journal_block - sb->directory_block + JOURNAL_SPARE_BLOCKS;
+        sb->journal_blocks = journal ? 1 + ( metadata_blocks * sizeof( uint32_t ) + BLOCK_SIZE - 1 ) / BLOCK_SIZE +
+                metadata_blocks : 0;
+        sb->first_data_block = sb->journal_block + sb->journal_blocks;
+        return( sb->first_data_block < n_blocks );
+}
+
+/* tfs_init()
+ *
+ * initializes an image of N_BLOCKS blocks with the directory empty
+ *   and the file allocation table and free block bitmap having all
+ *   blocks free; only the blocks before the file blocks are cleared,
+ *   a file block is written or zeroed before a read can return its
+ *   bytes
+ *
+ * input parameter is a context
+ *
+ * no return value
+ */
+
+void grtfs_init( grtfs_ctx *ctx ){
+        grtfs_init_blocks( ctx, N_BLOCKS );
+}
+
+/* tfs_init_blocks()
+ *
+ * same as tfs_init() for an image of n_blocks blocks, replacing any
+ *   image the context currently holds in memory
+ *
+ * input parameters are a context and the number of blocks in the
+ *   image
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_init_blocks( grtfs_ctx *ctx, unsigned int n_blocks ){
+        struct superblock sb;
+        char *image;
+        if( !grtfs_layout( &sb, n_blocks, FALSE ) ) return( FALSE );
+        image = malloc( (size_t) n_blocks * BLOCK_SIZE );
+        if( !image ) return( FALSE );
+        memset( image, 0, (size_t) sb.first_data_block * BLOCK_SIZE );
+        memcpy( image, &sb, sizeof( sb ) );
+
+        if( ctx->image_fd >= 0 ) grtfs_unmount( ctx );
+        grtfs_release_image( ctx );
+        ctx->image_bytes = (size_t) n_blocks * BLOCK_SIZE;
+        return( grtfs_attach_image( ctx, image ) );
+}
+
+/* tfs_format()
+ *
+ * creates an image file of n_blocks blocks holding an empty file
+ *   system, replacing any file at that path; the file is extended
+ *   rather than written, so only the superblock is stored
+ *
+ * input parameters are the path of the image file and the number
+ *   of blocks in the image
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_format( char *path, unsigned int n_blocks ){
+        struct superblock sb;
+        int fd;
+        if( !grtfs_layout( &sb, n_blocks, TRUE ) ) return( FALSE );
+        fd = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+        if( fd < 0 ){
+                GRTFS_DIAG( "*** cannot create image %s\n", path );
+                return( FALSE );
+        }
+        if( ( ftruncate( fd, (off_t) n_blocks * BLOCK_SIZE ) != 0 ) ||
+                        ( pwrite( fd, &sb, sizeof( sb ), 0 ) != sizeof( sb ) ) ||
+                        ( fsync( fd ) != 0 ) ){
+                GRTFS_DIAG( "*** cannot write image %s\n", path );
+                close( fd );
+                return( FALSE );
+        }
+        close( fd );
+        return( TRUE );
+}
+
+/* tfs_mount()
+ *
+ * opens an image file created by tfs_format() and makes it the
+ *   context's image, replacing any image it currently holds
+ *
+ * only the superblock, the directory and the file allocation table
+ *   are read, each block when first touched, and they stay in
+ *   memory, so mounting takes the same time for any number of files;
+ *   the blocks of the directory file and of the name index are read
+ *   as names and fds are looked up, and file blocks are read and
+ *   written, through a block cache of the size set by
+ *   tfs_set_cache_size(), so the image can be larger than memory;
+ *   only an image whose files share blocks with clones has its
+ *   directory file read in full, to count the files sharing each
+ *   block; entries left open by a previous run read as closed
+ *
+ * a whole transaction left in the journal is first written in place
+ *   where it differs, finishing a sync cut short by a crash; the
+ *   journal is emptied when tfs_set_journal() has turned it off
+ *
+ * input parameters are a context and the path of the image file
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_mount( grtfs_ctx *ctx, char *path ){
+        struct superblock sb, expected;
+        struct stat st;
+        char *image, *meta_dirty;
+        size_t meta_bytes;
+        uint32_t sequence = 1;
+        int file;
+
+        file = open( path, O_RDWR );
+        if( file < 0 ){
+                GRTFS_DIAG( "*** cannot open image %s\n", path );
+                return( FALSE );
+        }
+        if( ( pread( file, &sb, sizeof( sb ), 0 ) != sizeof( sb ) ) ||
+                        ( fstat( file, &st ) != 0 ) ||
+                        ( sb.magic != GRTFS_MAGIC ) || ( sb.version != GRTFS_VERSION ) ||
+                        !grtfs_layout( &expected, sb.n_blocks, sb.journal_blocks > 0 ) ||
+                        ( memcmp( &sb, &expected, sizeof( sb ) ) != 0 ) ||
+                        ( st.st_size < (off_t) sb.n_blocks * BLOCK_SIZE ) ){
+                GRTFS_DIAG( "*** %s is not a version %d image\n", path, GRTFS_VERSION );
+                close( file );
+                return( FALSE );
+        }
+        if( ( sb.journal_blocks > 0 ) && ( !grtfs_replay_journal( file, &sb, &sequence ) ||
+                                ( !ctx->journal && ( sequence > 1 ) && !grtfs_clear_journal( file, &sb ) ) ) ){
+                GRTFS_DIAG( "*** cannot replay the journal of %s\n", path );
+                close( file );
+                return( FALSE );
+        }
+        meta_bytes = (size_t) sb.first_data_block * BLOCK_SIZE;
+        image = mmap( NULL, meta_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0 );
+        meta_dirty = calloc( sb.first_data_block, 1 );
+        if( ( image == MAP_FAILED ) || !meta_dirty ){
+                GRTFS_DIAG( "*** cannot read image %s\n", path );
+                if( image != MAP_FAILED ) munmap( image, meta_bytes );
+                free( meta_dirty );
+                close( file );
+                return( FALSE );
+        }
+
+        if( ctx->image_fd >= 0 ) grtfs_unmount( ctx );
+        grtfs_release_image( ctx );
+        ctx->image_fd = file;
+        ctx->image_bytes = (size_t) sb.n_blocks * BLOCK_SIZE;
+        ctx->meta_dirty = meta_dirty;
+        ctx->journaling = ( sb.journal_blocks > 0 ) && ctx->journal;
+        ctx->journal_sequence = sequence;
+        if( !grtfs_cache_init( ctx ) || !grtfs_attach_image( ctx, image ) ){
+                grtfs_release_image( ctx );
+                return( FALSE );
+        }
+        return( TRUE );
+}
+
+/* tfs_sync()
+ *
+ * makes all changes to a mounted image durable in the image file:
+ *   writes back the dirty cached blocks and the changed metadata,
+ *   merging consecutive blocks into single writes, then flushes the
+ *   image file
+ *
+ * the metadata is written to the journal and flushed before it is
+ *   written in place, unless tfs_set_journal() turned it off; a sync
+ *   that comes while another is being written waits for the next
+ *   one, which serves all syncs that came meanwhile with one flush
+ *
+ * input parameter is a context
+ *
+ * return value is TRUE when successful or FALSE when failure; an
+ *   image held in memory has nothing to sync
+ */
+
+unsigned int grtfs_sync( grtfs_ctx *ctx ){
+        unsigned long ticket, served;
+        unsigned int result;
+        if( ctx->image_fd < 0 ) return( TRUE );
+        pthread_mutex_lock( &ctx->commit_lock );
+        ticket = ++ctx->syncs;
+        // a commit under way may have copied the metadata before this
+        // call's changes, so it only serves the syncs that came first
+        while( ctx->synced < ticket ){
+                if( ctx->committing ){
+                        pthread_cond_wait( &ctx->commit_done, &ctx->commit_lock );
+                        continue;
+                }
+                ctx->committing = TRUE;
+                served = ctx->syncs;
+                pthread_mutex_unlock( &ctx->commit_lock );
+                result = grtfs_commit( ctx );
+                pthread_mutex_lock( &ctx->commit_lock );
+                ctx->committing = FALSE;
+                ctx->synced = served;
+                ctx->commits++;
+                ctx->commit_result = result;
+                pthread_cond_broadcast( &ctx->commit_done );
+        }
+        result = ctx->commit_result;
+        pthread_mutex_unlock( &ctx->commit_lock );
+        return( result );
+}
+
+/* tfs_unmount()
+ *
+ * syncs and closes a mounted image; afterwards the context holds no
+ *   image until the next tfs_init() or tfs_mount()
+ *
+ * input parameter is a context
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_unmount( grtfs_ctx *ctx ){
+        unsigned int result;
+        if( ctx->image_fd < 0 ) return( FALSE );
+        result = grtfs_sync( ctx );
+        grtfs_release_image( ctx );
+        return( result );
+}
+
+/* tfs_set_cache_size()
+ *
+ * sets the memory the block cache of images mounted from now on may
+ *   use; at least one cache page is always used
+ *
+ * input parameters are a context and the cache size in bytes
+ *
+ * no return value
+ */
+
+void grtfs_set_cache_size( grtfs_ctx *ctx, size_t bytes ){
+        ctx->cache_bytes = bytes;
+}
+
+/* tfs_set_journal()
+ *
+ * sets whether images mounted from now on sync their metadata
+ *   through their journal, which is the default; without it a sync
+ *   writes the metadata in place only, flushing once instead of twice,
+ *   and a crash during a sync can leave the image inconsistent
+ *
+ * input parameters are a context and TRUE or FALSE
+ *
+ * no return value
+ */
+
+void grtfs_set_journal( grtfs_ctx *ctx, unsigned int on ){
+        ctx->journal = on;
+}
+
+/* tfs_set_dedup()
+ *
+ * sets whether files closed from now on share blocks with other files
+ *   holding the same bytes; off by default
+ *
+ * a file being closed is compared, from its last block back, with the
+ *   blocks files had when they were closed before it, found by the
+ *   hash of their bytes: as each FAT entry leads on to the rest of the
+ *   chain, a block can only be shared along with the blocks after it,
+ *   so the file gives back the longest run of last blocks that another
+ *   file's chain ends with too and takes that chain in its place,
+ *   both entries getting SHARED_BLOCKS as for tfs_clone(); a shared
+ *   block is copied again when either file changes it and is free
+ *   once no chain passes through it
+ *
+ * a file's blocks are hashed when it is closed after they were written
+ *   and their hashes kept with the file, so a close reads only the
+ *   blocks written since the one before
+ *
+ * files with holes, compressed files and files with views are not
+ *   shared
+ *
+ * input parameters are a context and TRUE or FALSE
+ *
+ * no return value
+ */
+
+void grtfs_set_dedup( grtfs_ctx *ctx, unsigned int on ){
+        pthread_mutex_lock( &ctx->lock );
+        ctx->dedup = on;
+        pthread_mutex_unlock( &ctx->lock );
+}
+
+/* tfs_list_blocks()
+ *
+ * list file blocks that are being used and next block values
+ *   from the file allocation table; the listing is not synchronized
+ *   with reads and writes in progress
+ *
+ * input parameter is a context
+ *
+ * no return value
+ */
+
+void grtfs_list_blocks( grtfs_ctx *ctx ){
+        unsigned int b;
+        pthread_mutex_lock( &ctx->lock );
+        printf( "-- file alllocation table listing of used blocks --\n" );
+        for( b = ctx->superblock->first_data_block; b < ctx->superblock->n_blocks; b++ ){
+                if( ctx->file_allocation_table[b] & HOLE_FLAG ){
+                        printf( "  block %3u is a hole record and points to %3u\n",
+                                        b, ctx->file_allocation_table[b] & ~HOLE_FLAG );
+                }else if( ctx->file_allocation_table[b] != FREE ){
+                        printf( "  block %3u is used and points to %3u\n",
+                                        b, ctx->file_allocation_table[b] );
+                }
+        }
+        printf( "-- end --\n" );
+        pthread_mutex_unlock( &ctx->lock );
+}
+
+/* tfs_list_directory()
+ *
+ * list all directory entries, then the slots of the directory file
+ *   in use, with their fds; the listing is not synchronized with reads
+ *   and writes in progress
+ *
+ * input parameter is a context
+ *
+ * no return value
+ */
+
+void grtfs_list_directory( grtfs_ctx *ctx ){
+        struct directory_entry buffer, *entry;
+        unsigned int fd, end;
+        pthread_mutex_lock( &ctx->lock );
+        printf( "-- directory listing --\n" );
+        end = ctx->storage ? N_DIRECTORY_ENTRIES + grtfs_directory_header( ctx )->used_slots : FIRST_VALID_FD;
+        for( fd = FIRST_VALID_FD; fd < end; fd++ ){
+                entry = grtfs_read_entry( ctx, fd, &buffer );
+                if( ( fd >= N_DIRECTORY_ENTRIES ) && entry && ( entry->status == UNUSED ) ) continue;
+                printf( "  fd = %2d: ", fd );
+                if( entry ) grtfs_list_entry( ctx, entry );
+                else printf( "*** cannot be read\n" );
+        }
+        printf( "-- end --\n" );
+        pthread_mutex_unlock( &ctx->lock );
+}
+
+// prints a line of tfs_list_directory() for an entry, and one listing
+// its FAT chain when it is active
+void grtfs_list_entry( grtfs_ctx *ctx, struct directory_entry *entry ){
+        unsigned int b;
+        if( entry->status == UNUSED ){
+                printf( "unused\n" );
+        }else if( entry->status == CLOSED ){
+                printf( "%s, currently closed, %u bytes in size\n", entry->name, entry->size );
+        }else if( entry->status == OPEN ){
+                printf( "%s, currently open, %u bytes in size\n", entry->name, entry->size );
+        }else{
+                printf( "*** status error\n" );
+        }
+        if( ( entry->status == CLOSED ) || ( entry->status == OPEN ) ){
+                printf( "           FAT:" );
+                if( entry->first_block == 0 ){
+                        printf( " no blocks in use" );
+                }else{
+                        b = entry->first_block;
+                        while( b != LAST_BLOCK ){
+                                if( ctx->file_allocation_table[b] & HOLE_FLAG ) printf( " %u(hole)", b );
+                                else printf( " %u", b );
+                                b = ctx->file_allocation_table[b] & ~HOLE_FLAG;
+                        }
+                }
+                if( entry->flags & INLINE_DATA ) printf( ", %u bytes inline", entry->size % BLOCK_SIZE );
+                if( entry->flags & COMPRESSED ) printf( ", compressed" );
+                printf( "\n" );
+        }
+}
+
+/* tfs_exists()
+ *
+ * return TRUE if a file name is associated with an active
+ *   directory entry
+ *
+ * preconditions:
+ *   (1) the name is valid
+ *   (2) the name is associated with an active directory entry
+ *
+ * postconditions:
+ *   there are no changes to the file data structures
+ *
+ * input parameters are a context and a file name
+ *
+ * return value is TRUE or FALSE
+ */
+
+unsigned int grtfs_exists( grtfs_ctx *ctx, char *name ){
+        unsigned int file_descriptor;
+        pthread_mutex_lock( &ctx->lock );
+        file_descriptor = grtfs_map_name_to_fd( ctx, name );
+        pthread_mutex_unlock( &ctx->lock );
+        if( file_descriptor == 0 ) return( FALSE );
+        return( TRUE );
+}
+
+/* tfs_create()
+ *
+ * create a new directory entry with the given file name and
+ *   set the status to open, the first_block to invalid, the
+ *   size to 0 and the byte offset to 0
+ *
+ * preconditions:
+ *   (1) the name is valid
+ *   (2) the name is not already associated with any active
+ *         directory entry
+ *   (3) an unused directory entry or slot of the directory file is
+ *         available, or the directory file can grow
+ *   (4) fewer than MAX_OPEN_FILES files are open, viewed or busy,
+ *         so that the entry can be kept in memory
+ *
+ * postconditions:
+ *   (1) a new directory entry overwrites an unused entry
+ *   (2) the new entry is appropriately initialized
+ *
+ * input parameters are a context and a file name
+ *
+ * return value is the file descriptor of a directory entry
+ *   when successful or 0 when failure
+ */
+
+unsigned int grtfs_create( grtfs_ctx *ctx, char *name ){
+        unsigned int file_descriptor = 0, a = 0;
+        if( !grtfs_check_valid_name( ctx, name ) ) return( 0 );
+        grtfs_begin_change( ctx );
+        pthread_mutex_lock( &ctx->lock );
+        if( ( grtfs_lookup_name( ctx, name ) == 0 ) && grtfs_reserve_name( ctx ) ) a = grtfs_new_file( ctx, name );
+        if( a != 0 ){
+                file_descriptor = ctx->files[a].home;
+                pthread_rwlock_unlock( &ctx->files[a].lock );
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        grtfs_end_change( ctx );
+        grtfs_limit_overlay( ctx );
+        return( file_descriptor );
+}
+
+/* tfs_create_many()
+ *
+ * creates a directory entry for each of count file names as
+ *   tfs_create() does, validating all names first and then
+ *   taking the directory once for the whole batch
+ *
+ * preconditions:
+ *   as for tfs_create(), for each name on its own; a name that
+ *     repeats an earlier name of the batch fails
+ *
+ * postconditions:
+ *   (1) each name that met the preconditions has a new, open
+ *         directory entry
+ *   (2) file_descriptors[i] is the file descriptor created for
+ *         names[i], or 0 when that name failed
+ *
+ * input parameters are a context, an array of count file names,
+ *   the count and an array of count file descriptors to fill
+ *
+ * return value is the number of files created
+ */
+
+unsigned int grtfs_create_many( grtfs_ctx *ctx, char **names, unsigned int count,
+                unsigned int *file_descriptors ){
+        unsigned int i, a, created = 0;
+        for( i = 0; i < count; i++ ){
+                file_descriptors[i] = grtfs_check_valid_name( ctx, names[i] );
+        }
+        grtfs_begin_change( ctx );
+        pthread_mutex_lock( &ctx->lock );
+        for( i = 0; i < count; i++ ){
+                if( !file_descriptors[i] ) continue;
+                file_descriptors[i] = 0;
+                if( ( grtfs_lookup_name( ctx, names[i] ) != 0 ) || !grtfs_reserve_name( ctx ) ) continue;
+                a = grtfs_new_file( ctx, names[i] );
+                if( a == 0 ) break;
+                file_descriptors[i] = ctx->files[a].home;
+                pthread_rwlock_unlock( &ctx->files[a].lock );
+                created++;
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        grtfs_end_change( ctx );
+        grtfs_limit_overlay( ctx );
+        for( ; i < count; i++ ) file_descriptors[i] = 0;
+        return( created );
+}
+
+/* tfs_clone()
+ *
+ * creates a directory entry holding the same bytes as an active
+ *   entry, sharing its blocks: the new entry's FAT chain is the whole
+ *   chain of the other, so cloning takes time in proportion to the
+ *   number of blocks and copies none of them
+ *
+ * a block the two files share is copied when either of them changes
+ *   it, together with the shared blocks before it in the chain, which
+ *   have to lead on to the copy; the blocks after it stay shared
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range and its entry is active
+ *   (2) the file is not compressed
+ *   (3) as for tfs_create(), for the name
+ *
+ * postconditions:
+ *   (1) a new, open directory entry named name has the size and
+ *         access bits of the other and shares its blocks
+ *   (2) blocks preallocated past the end of the other file are
+ *         given back first
+ *
+ * input parameters are a context, the file descriptor of the file to
+ *   clone and the name of the clone
+ *
+ * return value is the file descriptor of the clone or 0 when failure
+ */
+
+unsigned int grtfs_clone( grtfs_ctx *ctx, unsigned int file_descriptor, char *name ){
+        struct directory_header *header;
+        struct directory_entry *source, *entry;
+        struct file_state *file;
+        unsigned int a, c = 0, clone = 0, b;
+        grtfs_begin_change( ctx );
+        a = grtfs_lock_file( ctx, file_descriptor, TRUE );
+        if( ( a == 0 ) || !grtfs_check_valid_name( ctx, name ) ){
+                if( a != 0 ) pthread_rwlock_unlock( &ctx->files[a].lock );
+                grtfs_end_change( ctx );
+                return( 0 );
+        }
+        source = &ctx->directory[a];
+        file = &ctx->files[a];
+        if( file->map_valid )
+                grtfs_trim_file( ctx, a, ( source->size + BLOCK_SIZE - 1 ) / BLOCK_SIZE );
+
+        pthread_mutex_lock( &ctx->lock );
+        header = grtfs_directory_header( ctx );
+        if( !ctx->refs ) ctx->refs = calloc( ctx->superblock->n_blocks, sizeof( uint32_t ) );
+        if( !( source->flags & COMPRESSED ) && ctx->refs &&
+                        ( grtfs_lookup_name( ctx, name ) == 0 ) && grtfs_reserve_name( ctx ) )
+                c = grtfs_new_file( ctx, name );
+        if( c != 0 ){
+                // a count of 0 stands for the one file a block belongs to
+                for( b = source->first_block; ( b != FREE ) && ( b != LAST_BLOCK );
+                                b = ctx->file_allocation_table[b] & ~HOLE_FLAG )
+                        ctx->refs[b] = ( ctx->refs[b] ? ctx->refs[b] : 1 ) + 1;
+                if( !( source->flags & SHARED_BLOCKS ) ) header->shared_files++;
+                source->flags |= SHARED_BLOCKS;
+                file->unshared = 0;
+                entry = &ctx->directory[c];
+                entry->access = source->access;
+                entry->flags = SHARED_BLOCKS | ( source->flags & INLINE_DATA );
+                entry->first_block = source->first_block;
+                entry->size = source->size;
+                memcpy( entry->data, source->data, INLINE_BYTES );
+                header->shared_files++;
+                clone = ctx->files[c].home;
+                pthread_rwlock_unlock( &ctx->files[c].lock );
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        pthread_rwlock_unlock( &file->lock );
+        grtfs_end_change( ctx );
+        grtfs_limit_overlay( ctx );
+        return( clone );
+}
+
+/* tfs_open()
+ *
+ * opens the directory entry having the given file name and
+ *   sets the status to open and the byte offset to 0; the fd returned
+ *   is the one the file was given when created
+ *
+ * preconditions:
+ *   (1) the name is valid
+ *   (2) the name is associated with an active directory entry
+ *   (3) the directory entry is not already open
+ *   (4) fewer than MAX_OPEN_FILES files are open, viewed or busy,
+ *         so that the entry can be kept in memory
+ *
+ * postconditions:
+ *   (1) the status of the directory entry is set to open
+ *   (2) the byte offset of the directory entry is set to 0
+ *
+ * input parameters are a context and a file name
+ *
+ * return value is the file descriptor of a directory entry
+ *   when successful or 0 when failure
+ */
+
+unsigned int grtfs_open( grtfs_ctx *ctx, char *name ){
+        struct directory_entry *entry;
+        unsigned int file_descriptor, a;
+        grtfs_begin_change( ctx );
+        for( ;; ){
+                pthread_mutex_lock( &ctx->lock );
+                file_descriptor = grtfs_map_name_to_fd( ctx, name );
+                if( file_descriptor == 0 ){
+                        pthread_mutex_unlock( &ctx->lock );
+                        break;
+                }
+                a = grtfs_lock_fd( ctx, file_descriptor, TRUE );
+                if( a == 0 ){
+                        file_descriptor = 0;
+                        break;
+                }
+                // the file may have been renamed since the lookup, and
+                // another one given the name meanwhile
+                entry = &ctx->directory[a];
+                if( strcmp( entry->name, name ) != 0 ){
+                        pthread_rwlock_unlock( &ctx->files[a].lock );
+                        continue;
+                }
+                if( entry->status == CLOSED ){
+                        entry->status = OPEN;
+                        entry->byte_offset = 0;
+                }else file_descriptor = 0;
+                pthread_rwlock_unlock( &ctx->files[a].lock );
+                break;
+        }
+        grtfs_end_change( ctx );
+        grtfs_limit_overlay( ctx );
+        return( file_descriptor );
+}
+
+/* tfs_close()
+ *
+ * closes the directory entry having the given file descriptor
+ *   (sets the status to closed and the byte offset to 0); the
+ *   function fails if (1) the file descriptor is out of range,
+ *   (2) the file descriptor is within range but the directory
+ *   entry is not open
+ *
+ * on a mounted image, the file's dirty cached blocks are written back
+ *   to the image file, but neither flushed nor committed with the
+ *   metadata; the file is durable after the next tfs_sync()
+ *
+ * once closed, the file's entry may leave memory for its home in the
+ *   directory or the directory file when another file needs the room;
+ *   its fd stays valid and the entry is read back when next used
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is open
+ *
+ * postconditions:
+ *   (1) the status of the directory entry is set to closed
+ *   (2) the byte offset of the directory entry is set to 0
+ *
+ * input parameters are a context and a file descriptor
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_close( grtfs_ctx *ctx, unsigned int file_descriptor ){
+        struct file_state *file;
+        unsigned int a, result;
+        grtfs_begin_change( ctx );
+        a = grtfs_lock_file( ctx, file_descriptor, TRUE );
+        if( ( a == 0 ) || !grtfs_check_file_is_open( ctx, a ) ){
+                if( a != 0 ) pthread_rwlock_unlock( &ctx->files[a].lock );
+                grtfs_end_change( ctx );
+                return( FALSE );
+        }
+        file = &ctx->files[a];
+        ctx->directory[a].status = CLOSED;
+        ctx->directory[a].byte_offset = 0;
+        if( file->map_valid ){
+                grtfs_trim_file( ctx, a,
+                                ( ctx->directory[a].size + BLOCK_SIZE - 1 ) / BLOCK_SIZE );
+                grtfs_pack_tail( ctx, a );
+                grtfs_dedup_file( ctx, a );
+        }
+        result = grtfs_cache_flush_file( ctx, a );
+        pthread_mutex_lock( &ctx->lock );
+        grtfs_lru_append( ctx, a );
+        pthread_mutex_unlock( &ctx->lock );
+        pthread_rwlock_unlock( &file->lock );
+        grtfs_end_change( ctx );
+        return( result );
+}
+
+/* tfs_size()
+ *
+ * returns the file size for an active directory entry
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is active
+ *
+ * postconditions:
+ *   there are no changes to the file data structures
+ *
+ * input parameters are a context and a file descriptor
+ *
+ * return value is the file size when successful or MAX_FILE_SIZE+1
+ *   when failure
+ */
+
+unsigned int grtfs_size( grtfs_ctx *ctx, unsigned int file_descriptor ){
+        unsigned int a = grtfs_lock_file( ctx, file_descriptor, FALSE ), size;
+        if( a == 0 ) return( MAX_FILE_SIZE + 1 );
+        size = ctx->directory[a].size;
+        pthread_rwlock_unlock( &ctx->files[a].lock );
+        return( size );
+}
+
+/* tfs_seek()
+ *
+ * sets the byte offset in a directory entry; the offset may lie
+ *   past the end of the file, where a read returns nothing and a
+ *   write leaves a hole between the end of the file and itself
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is open
+ *   (3) the specified offset is less than MAX_FILE_SIZE
+ *
+ * postconditions:
+ *   the byte offset of the directory entry is set to the
+ *     specified offset
+ *
+ * input parameters are a context, a file descriptor and a byte
+ *   offset
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_seek( grtfs_ctx *ctx, unsigned int file_descriptor, unsigned int offset ){
+        unsigned int a = grtfs_lock_file( ctx, file_descriptor, TRUE ), result = FALSE;
+        if( a == 0 ) return( FALSE );
+        if( grtfs_check_file_is_open( ctx, a ) && ( offset < MAX_FILE_SIZE ) ){
+                ctx->directory[a].byte_offset = offset;
+                result = TRUE;
+        }
+        pthread_rwlock_unlock( &ctx->files[a].lock );
+        return( result );
+}
+
+
+/* tfs_rename()
+ *
+ * changes the name of an active directory entry
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is active
+ *   (3) the new name is valid
+ *   (4) the new name is not already associated with any active
+ *         directory entry
+ *
+ * postconditions:
+ *   the directory entry carries the new name and can be found
+ *     by it
+ *
+ * input parameters are a context, a file descriptor and the new
+ *   file name
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_rename( grtfs_ctx *ctx, unsigned int file_descriptor, char *name ){
+        struct directory_entry *entry;
+        char old[FILENAME_LENGTH + 1];
+        unsigned int a, fd, result = FALSE;
+        grtfs_begin_change( ctx );
+        a = grtfs_lock_file( ctx, file_descriptor, TRUE );
+        if( ( a == 0 ) || !grtfs_check_valid_name( ctx, name ) ){
+                if( a != 0 ) pthread_rwlock_unlock( &ctx->files[a].lock );
+                grtfs_end_change( ctx );
+                return( FALSE );
+        }
+        entry = &ctx->directory[a];
+        fd = ctx->files[a].home;
+        pthread_mutex_lock( &ctx->lock );
+        if( ( grtfs_lookup_name( ctx, name ) == 0 ) && grtfs_reserve_name( ctx ) ){
+                strcpy( old, entry->name );
+                strcpy( entry->name, name );
+                result = grtfs_index_name( ctx, fd, name );
+                if( result ) grtfs_unindex_name( ctx, fd, old );
+                else strcpy( entry->name, old );
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        pthread_rwlock_unlock( &ctx->files[a].lock );
+        grtfs_end_change( ctx );
+        grtfs_limit_overlay( ctx );
+        return( result );
+}
+
+/* implementation of assigned functions */
+
+
+/* you are welcome to use helper functions of your own */
+
+
+
+/* tfs_delete()
+ *
+ * deletes a closed directory entry having the given file descriptor
+ *   (changes the status of the entry to unused) and releases all
+ *   allocated file blocks
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is closed
+ *
+ * postconditions:
+ *   (1) the status of the directory entry is set to unused
+ *   (2) all file blocks have been set to free
+ *
+ * input parameters are a context and a file descriptor
+ *
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_delete( grtfs_ctx *ctx, unsigned int file_descriptor ){
+        unsigned int a;
+        grtfs_begin_change( ctx );
+        a = grtfs_lock_file( ctx, file_descriptor, TRUE );
+        if( ( a == 0 ) || ( ctx->directory[a].status != CLOSED ) || grtfs_file_pins( ctx, a ) ){
+                if( a != 0 ) pthread_rwlock_unlock( &ctx->files[a].lock );
+                grtfs_end_change( ctx );
+                return( FALSE );
+        }
+
+        pthread_mutex_lock( &ctx->lock );
+        grtfs_release_directory_entry( ctx, a );
+        pthread_mutex_unlock( &ctx->lock );
+        pthread_rwlock_unlock( &ctx->files[a].lock );
+        grtfs_end_change( ctx );
+        grtfs_limit_overlay( ctx );
+        return( TRUE );
+}
+
+int grtfs_compare_fds( const void *a, const void *b ){
+        unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+        return( ( x > y ) - ( x < y ) );
+}
+
+/* tfs_delete_many()
+ *
+ * deletes each of count closed directory entries as tfs_delete()
+ *   does, in ascending order of file descriptor, taking the file
+ *   locks of up to DELETE_BATCH of them at once and freeing their
+ *   block chains under a single hold of the allocator
+ *
+ * preconditions:
+ *   as for tfs_delete(), for each file descriptor on its own; a
+ *     file descriptor that repeats an earlier one of the batch
+ *     fails
+ *
+ * postconditions:
+ *   (1) each entry that met the preconditions is unused and its
+ *         blocks are free
+ *   (2) results[i] is TRUE when file_descriptors[i] was deleted
+ *         or FALSE otherwise
+ *
+ * input parameters are a context, an array of count file
+ *   descriptors, the count and an array of count results to fill
+ *
+ * return value is the number of files deleted, or 0 when there is no
+ *   memory to sort the file descriptors
+ */
+
+unsigned int grtfs_delete_many( grtfs_ctx *ctx, unsigned int *file_descriptors, unsigned int count,
+                unsigned int *results ){
+        unsigned int batch[DELETE_BATCH], *sorted, i, j, k, n, low, high, deleted = 0;
+        unsigned char *done;
+        for( i = 0; i < count; i++ ) results[i] = FALSE;
+        sorted = malloc( ( count + 1 ) * sizeof( unsigned int ) );
+        done = calloc( count + 1, 1 );
+        if( !sorted || !done ){
+                free( sorted );
+                free( done );
+                return( 0 );
+        }
+        memcpy( sorted, file_descriptors, count * sizeof( unsigned int ) );
+        qsort( sorted, count, sizeof( unsigned int ), grtfs_compare_fds );
+        for( i = n = 0; i < count; i++ )
+                if( ( n == 0 ) || ( sorted[i] != sorted[n - 1] ) ) sorted[n++] = sorted[i];
+
+        // ascending order keeps concurrent batches from deadlocking
+        for( i = 0; i < n; i += k ){
+                k = n - i < DELETE_BATCH ? n - i : DELETE_BATCH;
+                grtfs_begin_change( ctx );
+                for( j = 0; j < k; j++ ){
+                        batch[j] = grtfs_lock_file( ctx, sorted[i + j], TRUE );
+                        if( ( batch[j] != 0 ) && ( ( ctx->directory[batch[j]].status != CLOSED ) ||
+                                                grtfs_file_pins( ctx, batch[j] ) ) ){
+                                pthread_rwlock_unlock( &ctx->files[batch[j]].lock );
+                                batch[j] = 0;
+                        }
+                }
+                pthread_mutex_lock( &ctx->lock );
+                for( j = 0; j < k; j++ ){
+                        if( batch[j] ) grtfs_release_directory_entry( ctx, batch[j] );
+                }
+                pthread_mutex_unlock( &ctx->lock );
+                for( j = 0; j < k; j++ ){
+                        if( batch[j] ) pthread_rwlock_unlock( &ctx->files[batch[j]].lock );
+                        done[i + j] = ( batch[j] != 0 );
+                }
+                grtfs_end_change( ctx );
+                grtfs_limit_overlay( ctx );
+        }
+
+        // only the first occurrence of a deleted fd counts
+        for( i = 0; i < count; i++ ){
+                for( low = 0, high = n; high - low > 1; ){
+                        j = ( low + high ) / 2;
+                        if( sorted[j] <= file_descriptors[i] ) low = j;
+                        else high = j;
+                }
+                if( ( n > 0 ) && ( sorted[low] == file_descriptors[i] ) && done[low] ){
+                        results[i] = TRUE;
+                        done[low] = FALSE;
+                        deleted++;
+                }
+        }
+        free( sorted );
+        free( done );
+        return( deleted );
+}
+
+
+/* tfs_read()
+ *
+ * reads a specified number of bytes from a file starting
+ *   at the byte offset in the directory into the specified
+ *   buffer; the byte offset in the directory entry is
+ *   incremented by the number of bytes transferred
+ *
+ * depending on the starting byte offset and the specified
+ *   number of bytes to transfer, the transfer may cross two
+ *   or more file blocks
+ *
+ * the function will read fewer bytes than specified if the
+ *   end of the file is encountered before the specified number
+ *   of bytes have been transferred
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is open
+ *   (3) the file has allocated file blocks
+ *   (4) file is readable
+ *
+ * postconditions:
+ *   (1) the buffer contains bytes transferred from file blocks
+ *   (2) the specified number of bytes has been transferred
+ *         except in the case that end of file was encountered
+ *         before the transfer was complete
+ *
+ * input parameters are a context, a file descriptor, the address
+ *   of a buffer of bytes to transfer, and the count of bytes to
+ *   transfer
+ *
+ * return value is the number of bytes transferred
+ */
+
+// returns the total length of the buffers of iov, capped at MAX_FILE_SIZE
+unsigned int grtfs_iov_bytes( const struct iovec *iov, unsigned int iovcnt ){
+        size_t total = 0;
+        unsigned int i;
+        for( i = 0; i < iovcnt; i++ ){
+                total += iov[i].iov_len;
+                if( total >= MAX_FILE_SIZE ) return( MAX_FILE_SIZE );
+        }
+        return( total );
+}
+
+// copies byte_count bytes between the file from byte_offset on and the
+// buffers of iov in turn, into the file when write is TRUE; each copy
+// spans as much of an extent and of a buffer as it can, so a transfer
+// within one extent is one copy per buffer; holes and the blocks past
+// the mapped ones read as zeros, apart from a tail kept in the directory
+// entry, and a write stops at the first of them, so the caller fills the
+// holes it writes to first; the caller holds the file's lock, for
+// writing when write is TRUE; returns the number of bytes copied, which
+// is less than byte_count only when the image file of a mounted image
+// cannot be read or written or a write meets a hole
+unsigned int grtfs_copy_file( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int byte_offset,
+                unsigned int byte_count,
+                unsigned int write ){
+        struct directory_entry *entry = &ctx->directory[file_descriptor];
+        struct file_state *file = &ctx->files[file_descriptor];
+        struct extent *extent = file->extents, *last = file->extents + file->n_extents;
+        unsigned int position = byte_offset, end, block, span, limit, tail;
+        unsigned int v = 0, v_offset = 0;
+        char *buffer;
+
+        tail = ( entry->flags & INLINE_DATA ) ? entry->size - entry->size % BLOCK_SIZE : MAX_FILE_SIZE;
+
+        if( file->n_extents > 0 ) extent += grtfs_find_extent( ctx, file_descriptor, byte_offset / BLOCK_SIZE );
+        while( position < byte_offset + byte_count ){
+                while( v_offset == iov[v].iov_len ){
+                        v++;
+                        v_offset = 0;
+                }
+                while( ( extent < last ) && ( position >= ( extent->logical + extent->length ) * BLOCK_SIZE ) )
+                        extent++;
+                end = ( extent < last ) ? ( extent->logical + extent->length ) * BLOCK_SIZE :
+                        byte_offset + byte_count;
+                span = end - position;
+                if( span > byte_offset + byte_count - position ) span = byte_offset + byte_count - position;
+                if( span > iov[v].iov_len - v_offset ) span = iov[v].iov_len - v_offset;
+
+                buffer = (char *) iov[v].iov_base + v_offset;
+                if( ( extent == last ) && ( position >= tail ) ){
+                        // the tail kept in the directory entry
+                        if( write ) break;
+                        memcpy( buffer, entry->data + position - tail, span );
+                }else if( ( extent == last ) || extent->hole ){
+                        if( write ) break;
+                        if( ( extent == last ) && ( span > tail - position ) ) span = tail - position;
+                        memset( buffer, 0, span );
+                }else{
+                        block = extent->block + position / BLOCK_SIZE - extent->logical;
+                        if( ctx->image_fd >= 0 ){
+                                // a cached copy ends at the end of its cache page
+                                limit = CACHE_PAGE_BYTES - ( block % CACHE_PAGE_BLOCKS ) * BLOCK_SIZE -
+                                        position % BLOCK_SIZE;
+                                if( span > limit ) span = limit;
+                        }
+                        if( !grtfs_copy_blocks( ctx, block, position % BLOCK_SIZE, buffer, span, write ) )
+                                break;
+                }
+                position += span;
+                v_offset += span;
+        }
+        __atomic_store_n( &file->extent_hint, ( extent < last ) ? extent - file->extents : 0, __ATOMIC_RELAXED );
+        return( position - byte_offset );
+}
+
+// maps the groups of a compressed file from its FAT chain, reading the
+// length at the start of each to find where the next one starts
+unsigned int grtfs_map_groups( grtfs_ctx *ctx, unsigned int fd ){
+        struct file_state *file = &ctx->files[fd];
+        unsigned int b = ctx->directory[fd].first_block, n, i;
+        uint32_t header;
+        file->n_groups = 0;
+        file->cached_group = -1;
+        while( b != FREE && b != LAST_BLOCK ){
+                if( !grtfs_copy_blocks( ctx, b, 0, (char *) &header, sizeof( header ), FALSE ) ) return( FALSE );
+                n = ( sizeof( header ) + ( header & ~RAW_GROUP ) + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+                if( ( n > MAX_GROUP_BLOCKS ) || !grtfs_add_group( ctx, fd, b, n ) ) return( FALSE );
+                // the blocks of a group are contiguous
+                for( i = 0; i < n - 1; i++ ){
+                        if( ctx->file_allocation_table[b + i] != b + i + 1 ) return( FALSE );
+                }
+                b = ctx->file_allocation_table[b + n - 1];
+                file->fat_hops++;
+        }
+        __atomic_store_n( &file->map_valid, TRUE, __ATOMIC_RELEASE );
+        return( TRUE );
+}
+
+// appends a group of length blocks from block on to the group map of a
+// compressed file
+unsigned int grtfs_add_group( grtfs_ctx *ctx, unsigned int fd, unsigned int block, unsigned int length ){
+        struct file_state *file = &ctx->files[fd];
+        struct group *groups;
+        if( file->n_groups == file->max_groups ){
+                groups = realloc( file->groups, ( file->max_groups * 2 + 4 ) * sizeof( struct group ) );
+                if( !groups ) return( FALSE );
+                file->groups = groups;
+                file->max_groups = file->max_groups * 2 + 4;
+        }
+        file->groups[file->n_groups].block = block;
+        file->groups[file->n_groups].length = length;
+        file->n_groups++;
+        return( TRUE );
+}
+
+// compresses the length bytes of source into at most capacity bytes of
+// destination as a sequence of literal runs and copies of earlier bytes:
+// a token byte holds the length of the literals in its high 4 bits and
+// the length of the copy less LZ_MIN_MATCH in its low 4, a 15 being
+// extended by the bytes after it up to the first below 255; the literals
+// follow, then the 2 byte distance back to the copied bytes and the
+// extension of the copy length; the last sequence has literals only;
+// returns the number of bytes written, or 0 when they do not fit
+unsigned int grtfs_compress( const char *source, unsigned int length, char *destination, unsigned int capacity ){
+        uint16_t table[1 << LZ_HASH_BITS];
+        unsigned int in = 0, anchor = 0, out = 0, candidate, match, literals, h;
+        uint32_t word, earlier;
+
+        memset( table, 0, sizeof( table ) );
+        while( in + LZ_MIN_MATCH <= length ){
+                memcpy( &word, source + in, sizeof( word ) );
+                h = ( word * 2654435761u ) >> ( 32 - LZ_HASH_BITS );
+                candidate = table[h];
+                table[h] = in;
+                memcpy( &earlier, source + candidate, sizeof( earlier ) );
+                if( ( candidate >= in ) || ( in - candidate > 0xFFFF ) || ( earlier != word ) ){
+                        in++;
+                        continue;
+                }
+                for( match = LZ_MIN_MATCH; ( in + match < length ) && ( source[candidate + match] == source[in + match] );
+                                match++ );
+                literals = in - anchor;
+                if( !grtfs_emit_sequence( source + anchor, literals, in - candidate, match, destination,
+                                        capacity, &out ) ) return( 0 );
+                in += match;
+                anchor = in;
+        }
+        if( !grtfs_emit_sequence( source + anchor, length - anchor, 0, 0, destination, capacity, &out ) ) return( 0 );
+        return( out );
+}
+
+// writes one sequence of grtfs_compress() at *out, a literal run only
+// when match is 0; returns FALSE when it does not fit in capacity bytes
+unsigned int grtfs_emit_sequence( const char *literals, unsigned int n_literals, unsigned int distance,
+                unsigned int match, char *destination, unsigned int capacity, unsigned int *out ){
+        unsigned int o = *out, token, rest;
+        // a token, the extra length bytes, the literals and the distance
+        if( o + 1 + n_literals / 255 + 1 + n_literals + 2 + ( match / 255 + 1 ) > capacity ) return( FALSE );
+        token = ( n_literals < 15 ? n_literals : 15 ) << 4;
+        if( match ) token |= ( match - LZ_MIN_MATCH < 15 ) ? match - LZ_MIN_MATCH : 15;
+        destination[o++] = token;
+        if( n_literals >= 15 ){
+                for( rest = n_literals - 15; rest >= 255; rest -= 255 ) destination[o++] = (char) 255;
+                destination[o++] = rest;
+        }
+        memcpy( destination + o, literals, n_literals );
+        o += n_literals;
+        if( match ){
+                destination[o++] = distance & 0xFF;
+                destination[o++] = distance >> 8;
+                if( match - LZ_MIN_MATCH >= 15 ){
+                        for( rest = match - LZ_MIN_MATCH - 15; rest >= 255; rest -= 255 ) destination[o++] = (char) 255;
+                        destination[o++] = rest;
+                }
+        }
+        *out = o;
+        return( TRUE );
+}
+
+// reads one length of grtfs_compress(), nibble and then any bytes going
+// on from it, from source at *in, short of end; returns -1 when the bytes
+// run out
+int grtfs_read_length( const unsigned char *source, unsigned int end, unsigned int *in, unsigned int nibble ){
+        unsigned int length = nibble, byte;
+        if( nibble < 15 ) return( length );
+        do{
+                if( *in >= end ) return( -1 );
+                byte = source[( *in )++];
+                length += byte;
+        }while( byte == 255 );
+        return( length );
+}
+
+// expands the length bytes grtfs_compress() made of at most capacity
+// bytes; returns the number of bytes expanded, or -1 when the bytes are
+// not what it makes
+int grtfs_decompress( const char *source, unsigned int length, char *destination, unsigned int capacity ){
+        const unsigned char *in_bytes = (const unsigned char *) source;
+        unsigned int in = 0, out = 0, token, distance, span;
+        int literals, match;
+
+        while( in < length ){
+                token = in_bytes[in++];
+                literals = grtfs_read_length( in_bytes, length, &in, token >> 4 );
+                if( ( literals < 0 ) || ( (unsigned int) literals > length - in ) ||
+                                ( (unsigned int) literals > capacity - out ) ) return( -1 );
+                memcpy( destination + out, source + in, literals );
+                in += literals;
+                out += literals;
+                if( in == length ) break;
+                if( length - in < 2 ) return( -1 );
+                distance = in_bytes[in] | ( in_bytes[in + 1] << 8 );
+                in += 2;
+                match = grtfs_read_length( in_bytes, length, &in, token & 15 );
+                if( ( match < 0 ) || ( distance == 0 ) || ( distance > out ) ||
+                                ( (unsigned int) match + LZ_MIN_MATCH > capacity - out ) ) return( -1 );
+                // a copy closer than its length repeats the bytes it
+                // copies, distance bytes at a time
+                for( match += LZ_MIN_MATCH; match > 0; match -= span ){
+                        span = (unsigned int) match < distance ? (unsigned int) match : distance;
+                        memcpy( destination + out, destination + out - distance, span );
+                        out += span;
+                }
+        }
+        return( out );
+}
+
+// makes the group data of a compressed file hold the bytes of group g,
+// decompressing it unless it is held already; bytes past those the group
+// holds, and the groups past the file's last one, read as zeros; returns
+// FALSE when the group cannot be read; the caller holds the file's lock
+// for writing, or for reading and its state_lock
+unsigned int grtfs_load_group( grtfs_ctx *ctx, unsigned int fd, unsigned int g ){
+        struct file_state *file = &ctx->files[fd];
+        char packed[MAX_GROUP_BLOCKS * BLOCK_SIZE];
+        uint32_t header, stored;
+        int n = 0;
+
+        if( file->cached_group == (int) g ) return( TRUE );
+        if( !file->group_data ) file->group_data = malloc( GROUP_BYTES );
+        if( !file->group_data ) return( FALSE );
+        file->cached_group = -1;
+        if( g < file->n_groups ){
+                if( !grtfs_copy_blocks( ctx, file->groups[g].block, 0, packed,
+                                        file->groups[g].length * BLOCK_SIZE, FALSE ) ) return( FALSE );
+                memcpy( &header, packed, sizeof( header ) );
+                stored = header & ~RAW_GROUP;
+                if( stored > file->groups[g].length * BLOCK_SIZE - sizeof( header ) ) return( FALSE );
+                if( header & RAW_GROUP ){
+                        if( stored > GROUP_BYTES ) return( FALSE );
+                        memcpy( file->group_data, packed + sizeof( header ), stored );
+                        n = stored;
+                }else{
+                        n = grtfs_decompress( packed + sizeof( header ), stored, file->group_data, GROUP_BYTES );
+                        if( n < 0 ) return( FALSE );
+                }
+        }
+        memset( file->group_data + n, 0, GROUP_BYTES - n );
+        file->cached_group = g;
+        return( TRUE );
+}
+
+// compresses the first length bytes of data as group g of a compressed
+// file, the group after its last one or one it has, into a new run of
+// contiguous blocks, links the run into the FAT chain in place of the
+// group's blocks and gives those back; returns FALSE, leaving the group
+// as it was, when no run is long enough; the caller holds the file's
+// lock for writing
+unsigned int grtfs_store_group( grtfs_ctx *ctx, unsigned int fd, unsigned int g, const char *data,
+                unsigned int length ){
+        struct file_state *file = &ctx->files[fd];
+        char packed[MAX_GROUP_BLOCKS * BLOCK_SIZE];
+        uint32_t header;
+        unsigned int stored, n, start, got, i, next, appended, goal = 0;
+
+        // bytes that do not get shorter are stored as they are
+        stored = length ? grtfs_compress( data, length, packed + sizeof( header ), length - 1 ) : 0;
+        header = stored;
+        if( ( stored == 0 ) && ( length > 0 ) ){
+                memcpy( packed + sizeof( header ), data, length );
+                stored = length;
+                header = RAW_GROUP | length;
+        }
+        memcpy( packed, &header, sizeof( header ) );
+        n = ( sizeof( header ) + stored + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+        // a group after the last one starts out holding no blocks
+        appended = ( g == file->n_groups );
+        if( appended && !grtfs_add_group( ctx, fd, 0, 0 ) ) return( FALSE );
+
+        pthread_mutex_lock( &ctx->lock );
+        if( g > 0 ) goal = file->groups[g - 1].block + file->groups[g - 1].length;
+        start = grtfs_new_run( ctx, goal, n, &got );
+        if( ( start != 0 ) && ( got < n ) ){
+                for( i = 0; i < got; i++ ) grtfs_free_block( ctx, start + i );
+                start = grtfs_find_run( ctx, n, ctx->superblock->n_blocks, &got );
+                if( got < n ) start = 0;
+                else{
+                        grtfs_mark_used( ctx, start, n );
+                        ctx->blocks_allocated += n;
+                }
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        if( ( start == 0 ) || !grtfs_copy_blocks( ctx, start, 0, packed, sizeof( header ) + stored, TRUE ) ){
+                pthread_mutex_lock( &ctx->lock );
+                for( i = 0; ( start != 0 ) && ( i < n ); i++ ) grtfs_free_block( ctx, start + i );
+                pthread_mutex_unlock( &ctx->lock );
+                if( appended ) file->n_groups--;
+                return( FALSE );
+        }
+
+        pthread_mutex_lock( &ctx->lock );
+        for( i = 0; i < n - 1; i++ ) grtfs_set_fat( ctx, start + i, start + i + 1 );
+        next = ( g + 1 < file->n_groups ) ? file->groups[g + 1].block : LAST_BLOCK;
+        grtfs_set_fat( ctx, start + n - 1, next );
+        if( g == 0 ) ctx->directory[fd].first_block = start;
+        else grtfs_set_fat( ctx, file->groups[g - 1].block + file->groups[g - 1].length - 1, start );
+        for( i = 0; i < file->groups[g].length; i++ ) grtfs_free_block( ctx, file->groups[g].block + i );
+        file->groups[g].block = start;
+        file->groups[g].length = n;
+        ctx->bytes_compressed += length;
+        ctx->blocks_compressed += n;
+        pthread_mutex_unlock( &ctx->lock );
+        return( TRUE );
+}
+
+// copies byte_count bytes between a compressed file from byte_offset on
+// and the buffers of iov in turn, into the file when write is TRUE, one
+// group at a time: a group read is decompressed once for the calls that
+// go on reading it, and a write compresses each group it changes again;
+// a write past the file's last group first gives the file empty groups
+// up to it; returns the number of bytes copied, which is less than
+// byte_count only when the image is full or the image file of a mounted
+// image cannot be read or written; the caller holds the file's lock for
+// writing, or for reading and its state_lock when write is FALSE
+unsigned int grtfs_copy_groups( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int byte_offset,
+                unsigned int byte_count,
+                unsigned int write ){
+        struct directory_entry *entry = &ctx->directory[file_descriptor];
+        struct file_state *file = &ctx->files[file_descriptor];
+        unsigned int position = byte_offset, end = byte_offset + byte_count, g, stop, moved, span, length;
+        unsigned int v = 0, v_offset = 0;
+        char *buffer, *data;
+
+        for( g = file->n_groups; write && ( g < byte_offset / GROUP_BYTES ); g++ ){
+                if( !grtfs_store_group( ctx, file_descriptor, g, NULL, 0 ) ) return( 0 );
+        }
+        while( position < end ){
+                g = position / GROUP_BYTES;
+                if( !grtfs_load_group( ctx, file_descriptor, g ) ) break;
+                stop = ( g + 1 ) * GROUP_BYTES < end ? ( g + 1 ) * GROUP_BYTES : end;
+                for( moved = position; moved < stop; moved += span ){
+                        while( v_offset == iov[v].iov_len ){
+                                v++;
+                                v_offset = 0;
+                        }
+                        span = stop - moved;
+                        if( span > iov[v].iov_len - v_offset ) span = iov[v].iov_len - v_offset;
+                        buffer = (char *) iov[v].iov_base + v_offset;
+                        data = file->group_data + moved - g * GROUP_BYTES;
+                        if( write ) memcpy( data, buffer, span );
+                        else memcpy( buffer, data, span );
+                        v_offset += span;
+                }
+                if( write ){
+                        length = ( entry->size > stop ? entry->size : stop ) - g * GROUP_BYTES;
+                        if( length > GROUP_BYTES ) length = GROUP_BYTES;
+                        if( !grtfs_store_group( ctx, file_descriptor, g, file->group_data, length ) ){
+                                file->cached_group = -1;
+                                break;
+                        }
+                }
+                position = stop;
+        }
+        return( position - byte_offset );
+}
+
+// sets the size of a compressed file, giving back the groups past it and
+// compressing the group it then ends in again without the bytes past it;
+// returns FALSE when the image is full; the caller holds the file's lock
+// for writing
+unsigned int grtfs_truncate_groups( grtfs_ctx *ctx, unsigned int fd, unsigned int size ){
+        struct directory_entry *entry = &ctx->directory[fd];
+        struct file_state *file = &ctx->files[fd];
+        unsigned int keep = ( size + GROUP_BYTES - 1 ) / GROUP_BYTES, g = size / GROUP_BYTES, i;
+
+        if( size >= entry->size ){
+                entry->size = size;
+                return( TRUE );
+        }
+        if( ( size % GROUP_BYTES != 0 ) && ( g < file->n_groups ) ){
+                if( !grtfs_load_group( ctx, fd, g ) ) return( FALSE );
+                memset( file->group_data + size % GROUP_BYTES, 0, GROUP_BYTES - size % GROUP_BYTES );
+                if( !grtfs_store_group( ctx, fd, g, file->group_data, size % GROUP_BYTES ) ){
+                        file->cached_group = -1;
+                        return( FALSE );
+                }
+        }
+        if( keep < file->n_groups ){
+                pthread_mutex_lock( &ctx->lock );
+                for( g = keep; g < file->n_groups; g++ ){
+                        for( i = 0; i < file->groups[g].length; i++ ) grtfs_free_block( ctx, file->groups[g].block + i );
+                }
+                if( keep == 0 ) entry->first_block = FREE;
+                else grtfs_set_fat( ctx, file->groups[keep - 1].block + file->groups[keep - 1].length - 1, LAST_BLOCK );
+                pthread_mutex_unlock( &ctx->lock );
+                file->n_groups = keep;
+                if( file->cached_group >= (int) keep ) file->cached_group = -1;
+        }
+        entry->size = size;
+        return( TRUE );
+}
+
+// reads from byte_offset, or from the stream position when advance is
+// TRUE, into the buffers of iov in turn; a stream read claims its bytes
+// by moving the stream position past them before copying them, so
+// stream reads running at once read bytes one after the other; the
+// caller holds the file's lock for reading
+unsigned int grtfs_read_file( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int iovcnt,
+                unsigned int byte_offset,
+                unsigned int advance ){
+        struct directory_entry *entry = &ctx->directory[file_descriptor];
+        struct file_state *file = &ctx->files[file_descriptor];
+        unsigned int byte_count, copied, size;
+
+        if( !grtfs_check_file_is_open( ctx, file_descriptor ) ) return( 0 );
+        if( !( entry->access & READ_ACCESS ) ){
+                GRTFS_DIAG( "*** Read access denied\n" );
+                grtfs_check_failed( ctx, CHECK_ACCESS );
+                return( FALSE );
+        }
+        if( !grtfs_map_shared( ctx, file_descriptor ) ) return( 0 );
+
+        // never read past end of file
+        size = entry->size;
+        if( advance ){
+                pthread_mutex_lock( &file->state_lock );
+                byte_offset = entry->byte_offset;
+        }
+        byte_count = byte_offset < size ? grtfs_iov_bytes( iov, iovcnt ) : 0;
+        if( byte_count > size - byte_offset ) byte_count = size - byte_offset;
+        if( advance ){
+                entry->byte_offset = byte_offset + byte_count;
+                pthread_mutex_unlock( &file->state_lock );
+        }
+        if( byte_count == 0 ) return( 0 );
+
+        if( entry->flags & COMPRESSED ){
+                pthread_mutex_lock( &file->state_lock );
+                copied = grtfs_copy_groups( ctx, file_descriptor, iov, byte_offset, byte_count, FALSE );
+                pthread_mutex_unlock( &file->state_lock );
+        }else copied = grtfs_copy_file( ctx, file_descriptor, iov, byte_offset, byte_count, FALSE );
+        if( advance && ( copied < byte_count ) ){
+                // a read cut short gives back the bytes it did not read,
+                // unless a stream read has claimed bytes after them
+                pthread_mutex_lock( &file->state_lock );
+                if( entry->byte_offset == byte_offset + byte_count ) entry->byte_offset = byte_offset + copied;
+                pthread_mutex_unlock( &file->state_lock );
+        }
+        __atomic_fetch_add( &file->bytes_read, copied, __ATOMIC_RELAXED );
+        return( copied );
+}
+
+// reads or writes iov at offset, or at the stream position when
+// advance is TRUE, in which case the stream position moves past the
+// bytes transferred
+unsigned int grtfs_transfer( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int iovcnt,
+                unsigned int offset,
+                unsigned int advance,
+                unsigned int write ){
+        struct directory_entry *entry;
+        unsigned int a, count;
+        a = write ? grtfs_lock_unpinned( ctx, file_descriptor ) : grtfs_lock_file( ctx, file_descriptor, FALSE );
+        if( a == 0 ) return( 0 );
+        entry = &ctx->directory[a];
+        if( write ){
+                if( advance ) offset = entry->byte_offset;
+                count = grtfs_write_file( ctx, a, iov, iovcnt, offset );
+                if( advance ) entry->byte_offset = offset + count;
+        }else count = grtfs_read_file( ctx, a, iov, iovcnt, offset, advance );
+        pthread_rwlock_unlock( &ctx->files[a].lock );
+        if( write ) grtfs_end_change( ctx );
+        return( count );
+}
+
+unsigned int grtfs_read( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                char *buffer,
+                unsigned int byte_count ){
+        struct iovec iov = { buffer, byte_count };
+        return( grtfs_transfer( ctx, file_descriptor, &iov, 1, 0, TRUE, FALSE ) );
+}
+
+/* tfs_pread()
+ *
+ * same as tfs_read(), but reads starting at the given offset and
+ *   leaves the byte offset in the directory entry unchanged
+ *
+ * input parameters are a context, a file descriptor, the address
+ *   of a buffer of bytes to transfer, the count of bytes to
+ *   transfer and the offset of the first byte
+ *
+ * return value is the number of bytes transferred
+ */
+
+unsigned int grtfs_pread( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                char *buffer,
+                unsigned int byte_count,
+                unsigned int offset ){
+        struct iovec iov = { buffer, byte_count };
+        return( grtfs_transfer( ctx, file_descriptor, &iov, 1, offset, FALSE, FALSE ) );
+}
+
+/* tfs_readv()
+ *
+ * same as tfs_read(), but fills the iovcnt buffers of iov in turn,
+ *   each with as many bytes as its length; the file blocks are
+ *   found once for the whole transfer rather than once per buffer
+ *
+ * input parameters are a context, a file descriptor, an array of
+ *   buffers and the number of buffers in it
+ *
+ * return value is the number of bytes transferred
+ */
+
+unsigned int grtfs_readv( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int iovcnt ){
+        return( grtfs_transfer( ctx, file_descriptor, iov, iovcnt, 0, TRUE, FALSE ) );
+}
+
+/* tfs_view()
+ *
+ * fills spans with pointers to the bytes of a file from offset on, as
+ *   tfs_pread() would read them, without copying them: into the image
+ *   of a context made by tfs_init() or tfs_init_blocks(), or into the
+ *   block cache of a mounted image, where a span ends at the end of
+ *   a cache page; bytes that read as zeros are covered by spans of
+ *   a shared zero buffer, and bytes kept in the directory entry by a
+ *   span of the entry
+ *
+ * a view that has spans pins the file until tfs_unview() releases it:
+ *   writes and truncations of the file wait for its views to be
+ *   released, deletes and tfs_defrag() pass it by, and the cache
+ *   pages of the spans are not evicted; the bytes of the spans must
+ *   not be changed, and a thread holding a view must not write or
+ *   truncate the same file, which would wait for itself
+ *
+ * preconditions:
+ *   (1) as for tfs_pread()
+ *   (2) the file is not compressed, its bytes being stored nowhere
+ *         as they read
+ *
+ * postconditions:
+ *   (1) spans[0 .. *n_spans - 1] cover the bytes viewed, in order
+ *   (2) fewer than byte_count bytes are viewed when the end of the
+ *         file comes first or max_spans spans are used up
+ *
+ * input parameters are a context, a file descriptor, the offset of
+ *   the first byte, the count of bytes to view, an array of max_spans
+ *   spans to fill, max_spans, and where to put the number of spans
+ *
+ * return value is the number of bytes viewed
+ */
+
+unsigned int grtfs_view( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                unsigned int offset,
+                unsigned int byte_count,
+                struct iovec *spans,
+                unsigned int max_spans,
+                unsigned int *n_spans ){
+        struct directory_entry *entry;
+        struct file_state *file;
+        struct extent *extent, *last;
+        unsigned int fd, position = offset, end, block, span, limit, tail, n = 0;
+        char *bytes;
+        int p;
+
+        *n_spans = 0;
+        fd = grtfs_lock_file( ctx, file_descriptor, FALSE );
+        if( fd == 0 ) return( 0 );
+        entry = &ctx->directory[fd];
+        file = &ctx->files[fd];
+        if( !grtfs_check_file_is_open( ctx, fd ) ||
+                        ( entry->flags & COMPRESSED ) || !grtfs_map_shared( ctx, fd ) ){
+                pthread_rwlock_unlock( &file->lock );
+                return( 0 );
+        }
+        if( !( entry->access & READ_ACCESS ) ){
+                GRTFS_DIAG( "*** Read access denied\n" );
+                grtfs_check_failed( ctx, CHECK_ACCESS );
+                pthread_rwlock_unlock( &file->lock );
+                return( 0 );
+        }
+
+        // never view past end of file
+        if( offset >= entry->size ) byte_count = 0;
+        else if( byte_count > entry->size - offset ) byte_count = entry->size - offset;
+        extent = file->extents;
+        last = file->extents + file->n_extents;
+        if( file->n_extents > 0 ) extent += grtfs_find_extent( ctx, fd, offset / BLOCK_SIZE );
+        tail = ( entry->flags & INLINE_DATA ) ? entry->size - entry->size % BLOCK_SIZE : MAX_FILE_SIZE;
+        while( ( position < offset + byte_count ) && ( n < max_spans ) ){
+                while( ( extent < last ) && ( position >= ( extent->logical + extent->length ) * BLOCK_SIZE ) )
+                        extent++;
+                end = ( extent < last ) ? ( extent->logical + extent->length ) * BLOCK_SIZE :
+                        offset + byte_count;
+                span = end - position;
+                if( span > offset + byte_count - position ) span = offset + byte_count - position;
+
+                if( ( extent == last ) && ( position >= tail ) ){
+                        bytes = entry->data + position - tail;
+                }else if( ( extent == last ) || extent->hole ){
+                        if( ( extent == last ) && ( span > tail - position ) ) span = tail - position;
+                        if( span > ZERO_SPAN_BYTES ) span = ZERO_SPAN_BYTES;
+                        bytes = zero_span;
+                }else if( ctx->image_fd < 0 ){
+                        block = extent->block + position / BLOCK_SIZE - extent->logical;
+                        bytes = ctx->blocks[block].bytes + position % BLOCK_SIZE;
+                }else{
+                        block = extent->block + position / BLOCK_SIZE - extent->logical;
+                        limit = CACHE_PAGE_BYTES - ( block % CACHE_PAGE_BLOCKS ) * BLOCK_SIZE -
+                                position % BLOCK_SIZE;
+                        if( span > limit ) span = limit;
+                        pthread_mutex_lock( &ctx->cache.lock );
+                        p = grtfs_cache_page( ctx, block / CACHE_PAGE_BLOCKS, FALSE );
+                        if( p >= 0 ) ctx->cache.pages[p].pins++;
+                        pthread_mutex_unlock( &ctx->cache.lock );
+                        if( p < 0 ) break;
+                        bytes = ctx->cache.data + (size_t) p * CACHE_PAGE_BYTES +
+                                ( block % CACHE_PAGE_BLOCKS ) * BLOCK_SIZE + position % BLOCK_SIZE;
+                }
+                spans[n].iov_base = bytes;
+                spans[n].iov_len = span;
+                n++;
+                position += span;
+        }
+        __atomic_store_n( &file->extent_hint, ( extent < last ) ? extent - file->extents : 0, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &file->bytes_read, position - offset, __ATOMIC_RELAXED );
+        if( n > 0 ){
+                pthread_mutex_lock( &ctx->pin_lock );
+                file->pins++;
+                pthread_mutex_unlock( &ctx->pin_lock );
+        }
+        pthread_rwlock_unlock( &file->lock );
+        *n_spans = n;
+        return( position - offset );
+}
+
+/* tfs_unview()
+ *
+ * releases a view taken by tfs_view(), unpinning its file and the
+ *   cache pages of its spans; a view of no spans needs no release
+ *
+ * input parameters are a context, the file descriptor, the spans and
+ *   the number of spans of the view
+ *
+ * no return value
+ */
+
+void grtfs_unview( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *spans,
+                unsigned int n_spans ){
+        struct block_cache *cache = &ctx->cache;
+        struct file_state *file;
+        char *bytes;
+        unsigned int a = 0, i;
+        // a pinned file keeps its index in memory
+        if( n_spans == 0 ) return;
+        pthread_mutex_lock( &ctx->lock );
+        if( grtfs_check_fd_in_range( ctx, file_descriptor ) ) a = grtfs_find_active( ctx, file_descriptor );
+        pthread_mutex_unlock( &ctx->lock );
+        if( a == 0 ) return;
+        file = &ctx->files[a];
+        if( ctx->image_fd >= 0 ){
+                pthread_mutex_lock( &cache->lock );
+                for( i = 0; i < n_spans; i++ ){
+                        bytes = spans[i].iov_base;
+                        if( ( bytes >= cache->data ) &&
+                                        ( bytes < cache->data + (size_t) cache->n_pages * CACHE_PAGE_BYTES ) )
+                                cache->pages[( bytes - cache->data ) / CACHE_PAGE_BYTES].pins--;
+                }
+                pthread_mutex_unlock( &cache->lock );
+        }
+        pthread_mutex_lock( &ctx->pin_lock );
+        if( ( file->pins > 0 ) && ( --file->pins == 0 ) ) pthread_cond_broadcast( &ctx->unpinned );
+        pthread_mutex_unlock( &ctx->pin_lock );
+}
+
+/* tfs_write()
+ *
+ * writes a specified number of bytes from a specified buffer
+ *   into a file starting at the byte offset in the directory;
+ *   the byte offset in the directory entry is incremented by
+ *   the number of bytes transferred
+ *
+ * depending on the starting byte offset and the specified
+ *   number of bytes to transfer, the transfer may cross two
+ *   or more file blocks
+ *
+ * furthermore, depending on the starting byte offset and the
+ *   specified number of bytes to transfer, additional file
+ *   blocks, if available, will be added to the file as needed;
+ *   in this case, the size of the file will be adjusted
+ *   based on the number of bytes transferred beyond the
+ *   original size of the file
+ *
+ * a write that starts past the end of the file leaves a hole
+ *   from the end of the file to the byte offset; a hole takes
+ *   no file blocks and reads as zeros, and a later write into
+ *   it allocates blocks for the part written only
+ *
+ * the function will read fewer bytes than specified if file
+ *   blocks are not available
+ *
+ * preconditions:
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is open
+ *   (3) file is writable
+ *
+ * postconditions:
+ *   (1) the file contains bytes transferred from the buffer
+ *   (2) the specified number of bytes has been transferred
+ *         except in the case that file blocks needed to
+ *         complete the transfer were not available
+ *   (3) the size of the file is increased as appropriate
+ *         when transferred bytes extend beyond the previous
+ *         end of the file
+ *
+ * input parameters are a context, a file descriptor, the address
+ *   of a buffer of bytes to transfer, and the count of bytes to
+ *   transfer
+ *
+ * return value is the number of bytes transferred
+ */
+
+// adds length blocks from block on, or a hole of length blocks with its
+// record at block when hole is TRUE, as the file's next logical blocks to
+// its extent map, merging blocks into the last extent when they follow it
+unsigned int grtfs_map_append( grtfs_ctx *ctx, unsigned int fd, unsigned int block, unsigned int length,
+                unsigned int hole ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *last, *extents;
+        if( ( file->n_extents > 0 ) && !hole ){
+                last = &file->extents[file->n_extents - 1];
+                if( !last->hole && ( last->block + last->length == block ) ){
+                        last->length += length;
+                        file->mapped += length;
+                        return( TRUE );
+                }
+        }
+        if( file->n_extents == file->max_extents ){
+                extents = realloc( file->extents, ( file->max_extents * 2 + 4 ) * sizeof( struct extent ) );
+                if( !extents ) return( FALSE );
+                file->extents = extents;
+                file->max_extents = file->max_extents * 2 + 4;
+        }
+        file->extents[file->n_extents].logical = file->mapped;
+        file->extents[file->n_extents].block = block;
+        file->extents[file->n_extents].length = length;
+        file->extents[file->n_extents].hole = hole;
+        file->n_extents++;
+        file->mapped += length;
+        return( TRUE );
+}
+
+// makes room for n extents in place of extent e of a file's extent map,
+// moving the extents after e; the caller fills in the n extents
+unsigned int grtfs_map_splice( grtfs_ctx *ctx, unsigned int fd, unsigned int e, unsigned int n ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *extents;
+        if( file->n_extents + n - 1 > file->max_extents ){
+                extents = realloc( file->extents, ( file->max_extents * 2 + n ) * sizeof( struct extent ) );
+                if( !extents ) return( FALSE );
+                file->extents = extents;
+                file->max_extents = file->max_extents * 2 + n;
+        }
+        memmove( &file->extents[e + n], &file->extents[e + 1],
+                        ( file->n_extents - e - 1 ) * sizeof( struct extent ) );
+        file->n_extents += n - 1;
+        return( TRUE );
+}
+
+// builds the extent map of a file by walking its FAT chain once, reading
+// the length of each hole from its record; the caller holds the file's
+// lock for writing, or for reading and its state_lock
+unsigned int grtfs_map_file( grtfs_ctx *ctx, unsigned int fd ){
+        struct file_state *file = &ctx->files[fd];
+        unsigned int block_index = ctx->directory[fd].first_block, next;
+        uint32_t length;
+        file->n_extents = 0;
+        file->mapped = 0;
+        file->extent_hint = 0;
+        if( ctx->directory[fd].flags & COMPRESSED ) return( grtfs_map_groups( ctx, fd ) );
+        if( block_index != FREE ){
+                while( TRUE ){
+                        next = ctx->file_allocation_table[block_index];
+                        if( next & HOLE_FLAG ){
+                                if( !grtfs_copy_blocks( ctx, block_index, 0, (char *) &length, sizeof( length ), FALSE ) ||
+                                                ( length == 0 ) || ( length > MAX_BLOCKS - file->mapped ) ||
+                                                !grtfs_map_append( ctx, fd, block_index, length, TRUE ) ) return( FALSE );
+                                next &= ~HOLE_FLAG;
+                        }else if( !grtfs_map_append( ctx, fd, block_index, 1, FALSE ) ){
+                                return( FALSE );
+                        }
+                        if( next == LAST_BLOCK ) break;
+                        block_index = next;
+                        file->fat_hops++;
+                }
+        }
+        __atomic_store_n( &file->map_valid, TRUE, __ATOMIC_RELEASE );
+        return( TRUE );
+}
+
+// builds the extent map of a file being read, whose lock is held only
+// for reading, under the file's state_lock unless it is built already
+unsigned int grtfs_map_shared( grtfs_ctx *ctx, unsigned int fd ){
+        struct file_state *file = &ctx->files[fd];
+        unsigned int result = TRUE;
+        if( __atomic_load_n( &file->map_valid, __ATOMIC_ACQUIRE ) ) return( TRUE );
+        pthread_mutex_lock( &file->state_lock );
+        if( !file->map_valid ) result = grtfs_map_file( ctx, fd );
+        pthread_mutex_unlock( &file->state_lock );
+        return( result );
+}
+
+// returns the index of the extent holding a mapped logical block,
+// trying the extent used last and the one after it before searching
+unsigned int grtfs_find_extent( grtfs_ctx *ctx, unsigned int fd, unsigned int logical ){
+        struct file_state *file = &ctx->files[fd];
+        unsigned int low = 0, high = file->n_extents - 1, mid;
+        unsigned int e = __atomic_load_n( &file->extent_hint, __ATOMIC_RELAXED );
+        if( e < file->n_extents && logical >= file->extents[e].logical ){
+                if( logical < file->extents[e].logical + file->extents[e].length ) return( e );
+                if( ( e + 1 < file->n_extents ) && ( logical < file->extents[e + 1].logical +
+                                        file->extents[e + 1].length ) ) return( e + 1 );
+        }
+        while( low < high ){
+                mid = ( low + high + 1 ) / 2;
+                if( file->extents[mid].logical <= logical ) low = mid;
+                else high = mid - 1;
+        }
+        return( low );
+}
+
+// makes the blocks of a mapped file's chain its own before the file
+// changes them: each block holding logical blocks below last that
+// another file's chain passes through is copied, as the block before it
+// in the chain has to point at the copy, and so is each block holding
+// logical blocks from first to last that a snapshot holds; held blocks
+// next to each other in an extent are copied as a run; the map is built
+// again when anything was copied; returns FALSE when the image is full;
+// the caller holds the file's lock for writing
+unsigned int grtfs_unshare( grtfs_ctx *ctx, unsigned int fd, unsigned int first, unsigned int last ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *extent;
+        char buffer[UNSHARE_COPY_BLOCKS * BLOCK_SIZE];
+        unsigned int shared = ctx->directory[fd].flags & SHARED_BLOCKS;
+        unsigned int e, i, k, b, n, end, records, start, copy, prev, length, goal = 0, copied = FALSE, result = TRUE;
+
+        if( !shared && !ctx->snapshots ) return( TRUE );
+        if( last > file->mapped ) last = file->mapped;
+        // blocks below unshared can only be held by snapshots
+        start = shared && ( file->unshared < first ) ? file->unshared : first;
+        if( start >= last ) return( TRUE );
+        e = grtfs_find_extent( ctx, fd, start );
+        extent = &file->extents[e];
+        i = extent->hole ? 0 : start - extent->logical;
+        if( i > 0 ) prev = extent->block + i - 1;
+        else if( e == 0 ) prev = FREE;
+        else if( file->extents[e - 1].hole ) prev = file->extents[e - 1].block;
+        else prev = file->extents[e - 1].block + file->extents[e - 1].length - 1;
+
+        for( ; result && ( e < file->n_extents ) && ( file->extents[e].logical < last ); e++, i = 0 ){
+                extent = &file->extents[e];
+                // a hole is one block in the chain, its record
+                records = extent->hole ? 1 : extent->length;
+                while( result && ( i < records ) && ( extent->logical + i < last ) ){
+                        b = extent->block + i;
+                        length = 0;
+                        pthread_mutex_lock( &ctx->lock );
+                        for( n = 0; ( i + n < records ) && ( extent->logical + i + n < last ) &&
+                                        ( n < UNSHARE_COPY_BLOCKS ); n++ ){
+                                end = extent->hole ? extent->logical + extent->length : extent->logical + i + n + 1;
+                                if( !( shared && ctx->refs && ( ctx->refs[b + n] > 1 ) ) &&
+                                                !( ctx->frozen && ctx->frozen[b + n] && ( end > first ) ) ) break;
+                        }
+                        copy = ( n > 0 ) ? grtfs_new_run( ctx, goal, n, &length ) : 0;
+                        pthread_mutex_unlock( &ctx->lock );
+                        if( n == 0 ){
+                                prev = b;
+                                i++;
+                                continue;
+                        }
+                        result = ( copy != 0 ) && grtfs_copy_blocks( ctx, b, 0, buffer, length * BLOCK_SIZE, FALSE ) &&
+                                grtfs_copy_blocks( ctx, copy, 0, buffer, length * BLOCK_SIZE, TRUE );
+
+                        pthread_mutex_lock( &ctx->lock );
+                        if( result ){
+                                for( k = 0; k < length - 1; k++ ) grtfs_set_fat( ctx, copy + k, copy + k + 1 );
+                                grtfs_set_fat( ctx, copy + length - 1, ctx->file_allocation_table[b + length - 1] );
+                                if( prev == FREE ) ctx->directory[fd].first_block = copy;
+                                else grtfs_set_fat( ctx, prev, ( ctx->file_allocation_table[prev] & HOLE_FLAG ) | copy );
+                                for( k = 0; k < length; k++ ) grtfs_free_block( ctx, b + k );
+                                ctx->blocks_copied += length;
+                                prev = copy + length - 1;
+                                goal = copy + length;
+                                copied = TRUE;
+                        }else{
+                                for( k = 0; k < length; k++ ) grtfs_free_block( ctx, copy + k );
+                        }
+                        pthread_mutex_unlock( &ctx->lock );
+                        i += length;
+                }
+        }
+        if( result && shared && ( last > file->unshared ) ) file->unshared = last;
+        if( copied ) grtfs_forget_hashes( ctx, fd, start );
+        if( copied && !grtfs_map_file( ctx, fd ) ) result = FALSE;
+        return( result );
+}
+
+// grows a mapped file to n_blocks blocks, allocating each missing run in
+// one piece where possible and continuing the file's last block where
+// that is free, and chains the new blocks in the FAT; returns the
+// number of blocks the file has afterwards, which is less than n_blocks
+// when the image is full; the caller holds the file's lock for writing
+unsigned int grtfs_extend_file( grtfs_ctx *ctx, unsigned int fd, unsigned int n_blocks ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *last;
+        unsigned int start, length, i, prev, goal = 1;
+
+        if( file->n_extents > 0 ){
+                last = &file->extents[file->n_extents - 1];
+                goal = last->hole ? last->block + 1 : last->block + last->length;
+        }
+        while( file->mapped < n_blocks ){
+                pthread_mutex_lock( &ctx->lock );
+                prev = file->n_extents;
+                start = grtfs_new_run( ctx, goal, n_blocks - file->mapped, &length );
+                if( ( start != 0 ) && !grtfs_map_append( ctx, fd, start, length, FALSE ) ){
+                        for( i = 0; i < length; i++ ) grtfs_free_block( ctx, start + i );
+                        start = 0;
+                }
+                if( start != 0 ){
+                        for( i = 0; i < length - 1; i++ ) grtfs_set_fat( ctx, start + i, start + i + 1 );
+                        grtfs_set_fat( ctx, start + length - 1, LAST_BLOCK );
+                        // a run merged into the last extent follows its last block
+                        if( prev == 0 ) ctx->directory[fd].first_block = start;
+                        else if( file->n_extents == prev ) grtfs_set_fat( ctx, start - 1, start );
+                        else grtfs_link_extent( ctx, fd, prev - 1, start );
+                        goal = start + length;
+                }
+                pthread_mutex_unlock( &ctx->lock );
+                if( start == 0 ) break;
+        }
+        return( file->mapped );
+}
+
+// gives back the blocks of a mapped file beyond its first n_blocks and
+// any hole it then ends with, and ends its FAT chain there; the caller
+// holds the file's lock for writing
+void grtfs_trim_file( grtfs_ctx *ctx, unsigned int fd, unsigned int n_blocks ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *last;
+        unsigned int drop, i;
+        if( ( file->mapped <= n_blocks ) &&
+                        ( ( file->n_extents == 0 ) || !file->extents[file->n_extents - 1].hole ) ) return;
+        // the blocks kept are relinked, and a file whose blocks cannot
+        // be made its own keeps the rest, which read past its size
+        if( !grtfs_unshare( ctx, fd, n_blocks, n_blocks ) ) return;
+        grtfs_forget_hashes( ctx, fd, n_blocks );
+
+        pthread_mutex_lock( &ctx->lock );
+        while( file->n_extents > 0 ){
+                last = &file->extents[file->n_extents - 1];
+                if( last->hole ) drop = last->length;
+                else if( file->mapped > n_blocks ) drop = file->mapped - n_blocks;
+                else break;
+                if( drop > last->length ) drop = last->length;
+                if( last->hole ) grtfs_free_block( ctx, last->block );
+                else for( i = last->length - drop; i < last->length; i++ )
+                        grtfs_free_block( ctx, last->block + i );
+                last->length -= drop;
+                file->mapped -= drop;
+                if( last->length == 0 ) file->n_extents--;
+        }
+        if( file->n_extents == 0 ) ctx->directory[fd].first_block = FREE;
+        else grtfs_link_extent( ctx, fd, file->n_extents - 1, LAST_BLOCK );
+        pthread_mutex_unlock( &ctx->lock );
+        file->extent_hint = 0;
+}
+
+// points the FAT chain out of extent e of a file, from its last block or
+// from its record when it is a hole, at next; the caller holds ctx->lock
+void grtfs_link_extent( grtfs_ctx *ctx, unsigned int fd, unsigned int e, unsigned int next ){
+        struct extent *extent = &ctx->files[fd].extents[e];
+        if( extent->hole ) grtfs_set_fat( ctx, extent->block, HOLE_FLAG | next );
+        else grtfs_set_fat( ctx, extent->block + extent->length - 1, next );
+}
+
+// grows a mapped file to n_blocks blocks with a hole, taking one block
+// for its record; returns FALSE when the image is full; the caller holds
+// the file's lock for writing
+unsigned int grtfs_append_hole( grtfs_ctx *ctx, unsigned int fd, unsigned int n_blocks ){
+        struct file_state *file = &ctx->files[fd];
+        unsigned int record, prev = file->n_extents;
+        uint32_t length = n_blocks - file->mapped;
+
+        pthread_mutex_lock( &ctx->lock );
+        record = grtfs_new_block( ctx );
+        if( ( record != 0 ) && !grtfs_map_append( ctx, fd, record, length, TRUE ) ){
+                grtfs_free_block( ctx, record );
+                record = 0;
+        }
+        if( record != 0 ){
+                grtfs_set_fat( ctx, record, HOLE_FLAG | LAST_BLOCK );
+                if( prev == 0 ) ctx->directory[fd].first_block = record;
+                else grtfs_link_extent( ctx, fd, prev - 1, record );
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        return( ( record != 0 ) &&
+                        grtfs_copy_blocks( ctx, record, 0, (char *) &length, sizeof( length ), TRUE ) );
+}
+
+// gives logical blocks logical to logical + want of hole extent e of a
+// mapped file a run of new data blocks, keeping the rest of the hole on
+// either side of them as holes, and relinks the FAT chain through them;
+// returns the length of the run, which is less than want or 0 when the
+// image is full, and sets *run to the run's extent; the caller holds the
+// file's lock for writing
+unsigned int grtfs_split_hole( grtfs_ctx *ctx, unsigned int fd, unsigned int e,
+                unsigned int logical, unsigned int want, unsigned int *run ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent hole = file->extents[e], *extent;
+        unsigned int start, length = 0, i, n, next, record = 0, goal = hole.block + 1;
+        uint32_t left = logical - hole.logical, right;
+
+        if( ( e > 0 ) && !file->extents[e - 1].hole )
+                goal = file->extents[e - 1].block + file->extents[e - 1].length;
+        pthread_mutex_lock( &ctx->lock );
+        start = grtfs_new_run( ctx, goal, want, &length );
+        right = hole.length - left - length;
+
+        // the record stays with one side, so a hole left on both sides
+        // takes a second record
+        n = ( left > 0 ) + 1 + ( right > 0 );
+        if( ( start != 0 ) && ( left > 0 ) && ( right > 0 ) ) record = grtfs_new_block( ctx );
+        if( ( start != 0 ) && ( ( ( n == 3 ) && ( record == 0 ) ) || !grtfs_map_splice( ctx, fd, e, n ) ) ){
+                for( i = 0; i < length; i++ ) grtfs_free_block( ctx, start + i );
+                if( record != 0 ) grtfs_free_block( ctx, record );
+                start = 0;
+        }
+        if( start == 0 ){
+                pthread_mutex_unlock( &ctx->lock );
+                return( 0 );
+        }
+
+        extent = &file->extents[e];
+        if( left > 0 ){
+                extent->length = left;
+                extent++;
+        }
+        *run = extent - file->extents;
+        extent->logical = logical;
+        extent->block = start;
+        extent->length = length;
+        extent->hole = FALSE;
+        if( right > 0 ){
+                extent++;
+                extent->logical = logical + length;
+                extent->block = ( left > 0 ) ? record : hole.block;
+                extent->length = right;
+                extent->hole = TRUE;
+        }
+        if( n == 1 ) grtfs_free_block( ctx, hole.block );
+
+        for( i = 0; i < length - 1; i++ ) grtfs_set_fat( ctx, start + i, start + i + 1 );
+        next = ( e + n < file->n_extents ) ? file->extents[e + n].block : LAST_BLOCK;
+        for( i = e + n; i-- > e; ){
+                grtfs_link_extent( ctx, fd, i, next );
+                next = file->extents[i].block;
+        }
+        if( e == 0 ) ctx->directory[fd].first_block = next;
+        else grtfs_link_extent( ctx, fd, e - 1, next );
+        pthread_mutex_unlock( &ctx->lock );
+
+        if( left > 0 ) grtfs_copy_blocks( ctx, hole.block, 0, (char *) &left, sizeof( left ), TRUE );
+        if( right > 0 ) grtfs_copy_blocks( ctx, extent->block, 0, (char *) &right, sizeof( right ), TRUE );
+        return( length );
+}
+
+// gives the holes of a mapped file between byte offsets from and to data
+// blocks, zeroing the bytes of the new blocks outside from to to;
+// returns the offset up to which the file from from on has data blocks,
+// which is less than to when the image is full; the blocks up to to are
+// mapped, and the caller holds the file's lock for writing
+unsigned int grtfs_fill_holes( grtfs_ctx *ctx, unsigned int fd, unsigned int from, unsigned int to ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *extent;
+        unsigned int e, run, logical, end, length, skip;
+
+        for( e = grtfs_find_extent( ctx, fd, from / BLOCK_SIZE ); e < file->n_extents; e++ ){
+                extent = &file->extents[e];
+                if( extent->logical * BLOCK_SIZE >= to ) break;
+                if( !extent->hole ) continue;
+                logical = ( from / BLOCK_SIZE > extent->logical ) ? from / BLOCK_SIZE : extent->logical;
+                end = ( to + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+                if( end > extent->logical + extent->length ) end = extent->logical + extent->length;
+                while( logical < end ){
+                        length = grtfs_split_hole( ctx, fd, e, logical, end - logical, &run );
+                        if( length == 0 ) return( ( logical * BLOCK_SIZE > from ) ? logical * BLOCK_SIZE : from );
+                        extent = &file->extents[run];
+                        if( logical * BLOCK_SIZE < from )
+                                grtfs_copy_blocks( ctx, extent->block, 0, NULL, from - logical * BLOCK_SIZE, TRUE );
+                        if( ( logical + length ) * BLOCK_SIZE > to ){
+                                skip = to - logical * BLOCK_SIZE;
+                                grtfs_copy_blocks( ctx, extent->block, skip, NULL, length * BLOCK_SIZE - skip, TRUE );
+                        }
+                        logical += length;
+                        e = run + 1;
+                }
+                e = run;
+        }
+        return( to );
+}
+
+// writes zeros over the data blocks of a mapped file between byte
+// offsets from and to; holes and blocks past the mapped ones read as
+// zeros already
+unsigned int grtfs_zero_file( grtfs_ctx *ctx, unsigned int fd, unsigned int from, unsigned int to ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *extent;
+        unsigned int e, start, end;
+        if( to > file->mapped * BLOCK_SIZE ) to = file->mapped * BLOCK_SIZE;
+        if( from >= to ) return( TRUE );
+        grtfs_forget_hashes( ctx, fd, from / BLOCK_SIZE );
+        for( e = grtfs_find_extent( ctx, fd, from / BLOCK_SIZE ); e < file->n_extents; e++ ){
+                extent = &file->extents[e];
+                start = extent->logical * BLOCK_SIZE;
+                end = ( extent->logical + extent->length ) * BLOCK_SIZE;
+                if( start >= to ) break;
+                if( start < from ) start = from;
+                if( end > to ) end = to;
+                if( !extent->hole && !grtfs_copy_blocks( ctx, extent->block, start - extent->logical * BLOCK_SIZE,
+                                        NULL, end - start, TRUE ) ) return( FALSE );
+        }
+        return( TRUE );
+}
+
+// moves the first n blocks of data extent e of a mapped file to the
+// free blocks from start on, copying their bytes and relinking the FAT
+// chain through the new blocks before the old ones are given back; the
+// moved blocks join extent e - 1 when they follow it; returns FALSE
+// when the blocks at start are no longer free; the caller holds the
+// file's lock for writing
+unsigned int grtfs_move_blocks( grtfs_ctx *ctx, unsigned int fd, unsigned int e, unsigned int start,
+                unsigned int n ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *extent = &file->extents[e], *prev = e > 0 ? &file->extents[e - 1] : NULL;
+        char buffer[DEFRAG_COPY_BLOCKS * BLOCK_SIZE];
+        unsigned int old = extent->block, length = extent->length, logical = extent->logical;
+        unsigned int i, chunk, next, merge, result = TRUE;
+
+        grtfs_forget_hashes( ctx, fd, logical );
+        pthread_mutex_lock( &ctx->lock );
+        if( grtfs_run_length( ctx, start, n ) < n ){
+                pthread_mutex_unlock( &ctx->lock );
+                return( FALSE );
+        }
+        grtfs_mark_used( ctx, start, n );
+        ctx->blocks_allocated += n;
+        pthread_mutex_unlock( &ctx->lock );
+
+        for( i = 0; result && ( i < n ); i += chunk ){
+                chunk = n - i < DEFRAG_COPY_BLOCKS ? n - i : DEFRAG_COPY_BLOCKS;
+                result = grtfs_copy_blocks( ctx, old + i, 0, buffer, chunk * BLOCK_SIZE, FALSE ) &&
+                        grtfs_copy_blocks( ctx, start + i, 0, buffer, chunk * BLOCK_SIZE, TRUE );
+        }
+        merge = prev && !prev->hole && ( prev->block + prev->length == start );
+        if( result && !merge && ( n < length ) ){
+                result = grtfs_map_splice( ctx, fd, e, 2 );
+                extent = &file->extents[e];
+                prev = e > 0 ? &file->extents[e - 1] : NULL;
+        }
+        if( !result ){
+                pthread_mutex_lock( &ctx->lock );
+                for( i = 0; i < n; i++ ) grtfs_free_block( ctx, start + i );
+                pthread_mutex_unlock( &ctx->lock );
+                return( FALSE );
+        }
+
+        pthread_mutex_lock( &ctx->lock );
+        next = n < length ? old + n : ctx->file_allocation_table[old + length - 1];
+        for( i = 0; i < n - 1; i++ ) grtfs_set_fat( ctx, start + i, start + i + 1 );
+        grtfs_set_fat( ctx, start + n - 1, next );
+        if( e == 0 ) ctx->directory[fd].first_block = start;
+        else grtfs_link_extent( ctx, fd, e - 1, start );
+        for( i = 0; i < n; i++ ) grtfs_free_block( ctx, old + i );
+        pthread_mutex_unlock( &ctx->lock );
+
+        if( merge ){
+                prev->length += n;
+                extent->block += n;
+                extent->logical += n;
+                extent->length -= n;
+                if( extent->length == 0 ) grtfs_map_splice( ctx, fd, e, 0 );
+        }else if( n == length ){
+                extent->block = start;
+        }else{
+                file->extents[e].block = start;
+                file->extents[e].length = n;
+                file->extents[e + 1].logical = logical + n;
+                file->extents[e + 1].block = old + n;
+                file->extents[e + 1].length = length - n;
+                file->extents[e + 1].hole = FALSE;
+        }
+        file->extent_hint = 0;
+        return( TRUE );
+}
+
+// moves up to budget blocks of a mapped file so that the data extents
+// between its holes each become one run: an extent moves right after
+// the one before it when the blocks there are free, otherwise the first
+// extent of its stretch moves to a free run that can hold the whole
+// stretch, searching all of them, and the stretch is left as it is
+// when there is none; returns
+// the number of blocks moved; the caller holds the file's lock for
+// writing
+unsigned int grtfs_defrag_file( grtfs_ctx *ctx, unsigned int fd, unsigned int budget ){
+        struct file_state *file = &ctx->files[fd];
+        struct extent *extent, *prev;
+        unsigned int e = 1, first, end, total, start, length, n, moved = 0;
+        while( ( e < file->n_extents ) && ( moved < budget ) ){
+                extent = &file->extents[e];
+                prev = &file->extents[e - 1];
+                if( extent->hole || prev->hole || ( prev->block + prev->length == extent->block ) ){
+                        e++;
+                        continue;
+                }
+                n = extent->length < budget - moved ? extent->length : budget - moved;
+                if( grtfs_move_blocks( ctx, fd, e, prev->block + prev->length, n ) ){
+                        moved += n;
+                        continue;
+                }
+
+                for( first = e - 1; ( first > 0 ) && !file->extents[first - 1].hole; first-- );
+                for( end = first, total = 0; ( end < file->n_extents ) && !file->extents[end].hole; end++ )
+                        total += file->extents[end].length;
+                pthread_mutex_lock( &ctx->lock );
+                start = grtfs_find_run( ctx, total, ctx->superblock->n_blocks, &length );
+                pthread_mutex_unlock( &ctx->lock );
+                n = file->extents[first].length < budget - moved ? file->extents[first].length : budget - moved;
+                if( ( length < total ) || !grtfs_move_blocks( ctx, fd, first, start, n ) ){
+                        e = end + 1;
+                        continue;
+                }
+                moved += n;
+                e = first + 1;
+        }
+        return( moved );
+}
+
+// writes the buffers of iov in turn from byte_offset, into the directory
+// entry when the file fits there and into its blocks otherwise, giving a
+// tail kept in the entry a block again first; the caller holds the
+// file's lock for writing
+unsigned int grtfs_write_file( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int iovcnt,
+                unsigned int byte_offset ){
+        struct directory_entry *entry = &ctx->directory[file_descriptor];
+        struct file_state *file = &ctx->files[file_descriptor];
+        unsigned int byte_count;
+
+        if( !grtfs_check_file_is_open( ctx, file_descriptor ) ) return( 0 );
+        if( !grtfs_check_file_is_writable( ctx, file_descriptor ) ) return( 0 );
+        if( !file->map_valid && !grtfs_map_file( ctx, file_descriptor ) ) return( 0 );
+
+        if( byte_offset >= MAX_FILE_SIZE ) return( 0 );
+        byte_count = grtfs_iov_bytes( iov, iovcnt );
+        if( byte_count > MAX_FILE_SIZE - byte_offset ) byte_count = MAX_FILE_SIZE - byte_offset;
+        if( byte_count == 0 ) return( 0 );
+
+        if( entry->flags & COMPRESSED ){
+                byte_count = grtfs_copy_groups( ctx, file_descriptor, iov, byte_offset, byte_count, TRUE );
+                if( ( byte_count > 0 ) && ( byte_offset + byte_count > entry->size ) )
+                        entry->size = byte_offset + byte_count;
+        }else if( !grtfs_write_inline( ctx, file_descriptor, iov, byte_offset, byte_count ) ){
+                if( ( entry->flags & INLINE_DATA ) && !grtfs_unpack_tail( ctx, file_descriptor ) ) return( 0 );
+                byte_count = grtfs_write_blocks( ctx, file_descriptor, iov, byte_offset, byte_count );
+        }
+        file->bytes_written += byte_count;
+        return( byte_count );
+}
+
+// writes byte_count bytes of the buffers of iov in turn into a file's
+// blocks from byte_offset, first growing the file by as many blocks as
+// the write needs, leaving a hole between the mapped blocks and a write
+// that starts past them, and giving the holes it writes to blocks of
+// their own; returns the number of bytes written; the file keeps no tail
+// in its directory entry, and the caller holds the file's lock for
+// writing
+unsigned int grtfs_write_blocks( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int byte_offset,
+                unsigned int byte_count ){
+        struct directory_entry *entry = &ctx->directory[file_descriptor];
+        struct file_state *file = &ctx->files[file_descriptor];
+        unsigned int n_blocks, capacity, first, last, mapped;
+
+        // allocate the blocks the write extends the file by, and write
+        // only as far as they reach when the image is full
+        first = byte_offset / BLOCK_SIZE;
+        grtfs_forget_hashes( ctx, file_descriptor, first );
+        n_blocks = ( byte_offset + byte_count + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+        // the blocks written, zeroed or relinked become the file's own,
+        // all of them up to the end when the write grows the file
+        last = ( n_blocks <= file->mapped ) && ( byte_offset <= entry->size ) ? n_blocks : file->mapped;
+        if( !grtfs_unshare( ctx, file_descriptor,
+                                ( byte_offset < entry->size ? byte_offset : entry->size ) / BLOCK_SIZE, last ) )
+                return( 0 );
+        // a write past the end of the file leaves a hole up to it, in
+        // place of any blocks preallocated past the end
+        if( first > ( entry->size + BLOCK_SIZE - 1 ) / BLOCK_SIZE )
+                grtfs_trim_file( ctx, file_descriptor, ( entry->size + BLOCK_SIZE - 1 ) / BLOCK_SIZE );
+        if( ( first > file->mapped ) && !grtfs_append_hole( ctx, file_descriptor, first ) ) return( 0 );
+        mapped = file->mapped;
+        if( n_blocks > mapped ){
+                capacity = grtfs_extend_file( ctx, file_descriptor, n_blocks + PREALLOC_BLOCKS ) * BLOCK_SIZE;
+                // new blocks inside the size of a file grown by
+                // tfs_truncate() read as zeros
+                if( ( entry->size > mapped * BLOCK_SIZE ) &&
+                                !grtfs_zero_file( ctx, file_descriptor, mapped * BLOCK_SIZE, entry->size ) ) return( 0 );
+                if( byte_offset >= capacity ) return( 0 );
+                if( byte_count > capacity - byte_offset ) byte_count = capacity - byte_offset;
+        }
+        capacity = grtfs_fill_holes( ctx, file_descriptor, byte_offset, byte_offset + byte_count );
+        if( byte_offset >= capacity ) return( 0 );
+        byte_count = capacity - byte_offset;
+
+        // bytes left in the file's blocks past its old end read as zeros
+        // once a write past that end takes them into the file
+        if( ( byte_offset > entry->size ) &&
+                        !grtfs_zero_file( ctx, file_descriptor, entry->size, byte_offset ) ) return( 0 );
+
+        byte_count = grtfs_copy_file( ctx, file_descriptor, iov, byte_offset, byte_count, TRUE );
+        if( byte_offset + byte_count > entry->size )
+                entry->size = byte_offset + byte_count;
+        return( byte_count );
+}
+
+// writes byte_count bytes of the buffers of iov in turn from byte_offset
+// into the directory entry of a file that has no blocks, when the file
+// then still fits there; returns FALSE, writing nothing, otherwise; the
+// caller holds the file's lock for writing
+unsigned int grtfs_write_inline( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int byte_offset,
+                unsigned int byte_count ){
+        struct directory_entry *entry = &ctx->directory[file_descriptor];
+        unsigned int position, span, v;
+
+        if( ( ctx->files[file_descriptor].mapped > 0 ) || ( entry->size > INLINE_BYTES ) ||
+                        ( byte_offset > INLINE_BYTES ) || ( byte_count > INLINE_BYTES - byte_offset ) )
+                return( FALSE );
+        // the bytes of the entry past the size are zeros, so a write past
+        // it leaves zeros in between
+        for( v = 0, position = byte_offset; position < byte_offset + byte_count; v++ ){
+                span = byte_offset + byte_count - position;
+                if( span > iov[v].iov_len ) span = iov[v].iov_len;
+                memcpy( entry->data + position, iov[v].iov_base, span );
+                position += span;
+        }
+        if( byte_offset + byte_count > entry->size ) entry->size = byte_offset + byte_count;
+        entry->flags |= INLINE_DATA;
+        return( TRUE );
+}
+
+// gives the tail a file keeps in its directory entry a block again, so
+// the file keeps all its bytes in blocks; returns FALSE, leaving the
+// tail in the entry, when the image is full; the caller holds the file's
+// lock for writing
+unsigned int grtfs_unpack_tail( grtfs_ctx *ctx, unsigned int fd ){
+        struct directory_entry *entry = &ctx->directory[fd];
+        unsigned int length = entry->size % BLOCK_SIZE, start = entry->size - length;
+        char tail[INLINE_BYTES];
+        struct iovec iov = { tail, length };
+
+        memcpy( tail, entry->data, length );
+        memset( entry->data, 0, length );
+        entry->flags &= ~INLINE_DATA;
+        entry->size = start;
+        if( grtfs_write_blocks( ctx, fd, &iov, start, length ) == length ) return( TRUE );
+
+        // a write cut short leaves the blocks it took
+        grtfs_trim_file( ctx, fd, start / BLOCK_SIZE );
+        memcpy( entry->data, tail, length );
+        entry->flags |= INLINE_DATA;
+        entry->size = start + length;
+        return( FALSE );
+}
+
+// moves the last bytes of a closed file into its directory entry and
+// gives back the block that held them, when they are fewer than
+// INLINE_BYTES and the block is the file's own and not viewed; the
+// caller holds the file's lock for writing
+void grtfs_pack_tail( grtfs_ctx *ctx, unsigned int fd ){
+        struct directory_entry *entry = &ctx->directory[fd];
+        unsigned int length = entry->size % BLOCK_SIZE, start = entry->size - length;
+        struct iovec iov = { entry->data, length };
+
+        // a file sharing blocks with a clone would copy them all to give
+        // back its last one
+        if( ( length == 0 ) || ( length > INLINE_BYTES ) ||
+                        ( entry->flags & ( INLINE_DATA | SHARED_BLOCKS | COMPRESSED ) ) ||
+                        !ctx->files[fd].map_valid || ( grtfs_file_pins( ctx, fd ) > 0 ) )
+                return;
+        if( grtfs_copy_file( ctx, fd, &iov, start, length, FALSE ) != length ){
+                memset( entry->data, 0, length );
+                return;
+        }
+        grtfs_trim_file( ctx, fd, start / BLOCK_SIZE );
+        entry->flags |= INLINE_DATA;
+}
+
+// returns the hash a block of the dedup index is found by, of its bytes
+// and the FAT entry after it, taking the bytes 8 at a time
+uint32_t grtfs_dedup_hash( const char *bytes, uint32_t next ){
+        uint64_t h = next, word;
+        unsigned int i;
+        for( i = 0; i < BLOCK_SIZE; i += sizeof( word ) ){
+                memcpy( &word, bytes + i, sizeof( word ) );
+                h = ( h ^ word ) * 0x9E3779B97F4A7C15ull;
+                h ^= h >> 29;
+        }
+        return( (uint32_t) ( h >> 32 ) );
+}
+
+// remembers block b of the file at fd under hash in the dedup index, in
+// place of the first slot examined when they are all taken; the caller
+// holds ctx->lock
+void grtfs_dedup_insert( grtfs_ctx *ctx, uint32_t hash, unsigned int b, unsigned int fd ){
+        struct dedup_slot *slot = NULL;
+        unsigned int i, k;
+        for( i = 0; i < DEDUP_PROBES; i++ ){
+                k = ( hash + i ) & ( ctx->dedup_slots - 1 );
+                if( ( ctx->dedup_index[k].fd == 0 ) || ( ctx->dedup_index[k].block == b ) ){
+                        slot = &ctx->dedup_index[k];
+                        break;
+                }
+        }
+        if( !slot ) slot = &ctx->dedup_index[hash & ( ctx->dedup_slots - 1 )];
+        slot->hash = hash;
+        slot->block = b;
+        slot->fd = fd;
+}
+
+// returns TRUE when block c holds bytes and is followed by next in the
+// chain of the file at owner, whose lock the caller holds for writing
+unsigned int grtfs_dedup_match( grtfs_ctx *ctx, unsigned int owner, unsigned int c, const char *bytes,
+                uint32_t next ){
+        struct file_state *file = &ctx->files[owner];
+        char other[BLOCK_SIZE];
+        unsigned int e, found = FALSE;
+        for( e = 0; ( e < file->n_extents ) && !found; e++ ){
+                found = !file->extents[e].hole && ( c >= file->extents[e].block ) &&
+                        ( c < file->extents[e].block + file->extents[e].length );
+        }
+        return( found && ( ctx->file_allocation_table[c] == next ) &&
+                        grtfs_copy_blocks( ctx, c, 0, other, BLOCK_SIZE, FALSE ) &&
+                        ( memcmp( other, bytes, BLOCK_SIZE ) == 0 ) );
+}
+
+// marks the dedup hashes of a file's logical blocks from logical on as
+// stale, as their bytes or blocks are about to change, and that of the
+// block before them, whose next in the chain may change with them; the
+// caller holds the file's lock for writing
+void grtfs_forget_hashes( grtfs_ctx *ctx, unsigned int fd, unsigned int logical ){
+        if( logical > 0 ) logical--;
+        if( ctx->files[fd].hashed > logical ) ctx->files[fd].hashed = logical;
+}
+
+// shares the last blocks of a file being closed with another file when
+// dedup is set, as tfs_set_dedup() describes, and remembers the
+// blocks the file keeps in the dedup index; only the blocks written since
+// the file's last close, and those whose place in the chain changed, are
+// read and hashed again; the caller holds the file's lock for writing
+void grtfs_dedup_file( grtfs_ctx *ctx, unsigned int fd ){
+        struct directory_entry *entry = &ctx->directory[fd];
+        struct file_state *file = &ctx->files[fd];
+        struct dedup_slot *slot;
+        struct block_hash *hashes;
+        char bytes[BLOCK_SIZE];
+        uint32_t hash, next = LAST_BLOCK;
+        unsigned int e, i, k, b, n, c, shared = LAST_BLOCK, matched = 0, owner = 0, matching = TRUE, keep, valid, done = FALSE;
+
+        if( !ctx->dedup || !file->map_valid || ( file->n_extents == 0 ) ||
+                        ( entry->flags & ( SHARED_BLOCKS | COMPRESSED ) ) || ( grtfs_file_pins( ctx, fd ) > 0 ) )
+                return;
+        for( e = 0; e < file->n_extents; e++ ) if( file->extents[e].hole ) return;
+        if( file->max_hashes < file->mapped ){
+                hashes = realloc( file->hashes, file->mapped * sizeof( struct block_hash ) );
+                if( !hashes ) return;
+                file->hashes = hashes;
+                file->max_hashes = file->mapped;
+        }
+        hashes = file->hashes;
+        pthread_mutex_lock( &ctx->lock );
+        if( !ctx->dedup_index ){
+                for( n = 1; ( n < ctx->superblock->n_blocks ) && ( n < MAX_DEDUP_SLOTS ); n *= 2 );
+                ctx->dedup_index = calloc( n, sizeof( struct dedup_slot ) );
+                ctx->dedup_slots = n;
+        }
+        if( !ctx->refs ) ctx->refs = calloc( ctx->superblock->n_blocks, sizeof( uint32_t ) );
+        pthread_mutex_unlock( &ctx->lock );
+        if( !ctx->dedup_index || !ctx->refs ) return;
+
+        // from the last block back, as far as another file's chain ends
+        // with the same blocks and then down to the blocks whose hashes
+        // are still valid; the blocks kept that were hashed again are
+        // remembered in the index
+        for( e = file->n_extents, n = file->mapped; !done && ( e-- > 0 ); ){
+                for( i = file->extents[e].length; !done && ( i-- > 0 ); ){
+                        b = file->extents[e].block + i;
+                        n--;
+                        valid = ( n < file->hashed ) && ( hashes[n].block == b ) && ( hashes[n].next == next );
+                        if( valid && !matching ){
+                                done = TRUE;
+                                break;
+                        }
+                        if( ( !valid || matching ) && !grtfs_copy_blocks( ctx, b, 0, bytes, BLOCK_SIZE, FALSE ) ){
+                                // a block not read is hashed again at the next close
+                                matching = valid = FALSE;
+                                b = 0;
+                        }
+                        hash = valid ? hashes[n].hash : grtfs_dedup_hash( bytes, next );
+                        for( k = 0, c = 0; matching && ( c == 0 ) && ( k < DEDUP_PROBES ); k++ ){
+                                pthread_mutex_lock( &ctx->lock );
+                                slot = &ctx->dedup_index[( hash + k ) & ( ctx->dedup_slots - 1 )];
+                                c = ( slot->hash == hash ) && ( slot->fd != file->home ) && ( slot->fd != 0 ) &&
+                                        ( !owner || ( slot->fd == ctx->files[owner].home ) ) ? slot->block : 0;
+                                // only a file whose entry is in memory is
+                                // shared with, and it is only tried, as its
+                                // lock comes after this one's
+                                if( c && !owner ){
+                                        owner = grtfs_find_active( ctx, slot->fd );
+                                        if( !owner || pthread_rwlock_trywrlock( &ctx->files[owner].lock ) ){
+                                                pthread_mutex_unlock( &ctx->lock );
+                                                c = owner = 0;
+                                                break;
+                                        }
+                                }
+                                pthread_mutex_unlock( &ctx->lock );
+                                if( c && !matched && ( ( ctx->directory[owner].status == UNUSED ) ||
+                                                        ( ctx->directory[owner].flags & COMPRESSED ) ||
+                                                        !( ctx->files[owner].map_valid ||
+                                                                grtfs_map_file( ctx, owner ) ) ) ){
+                                        pthread_rwlock_unlock( &ctx->files[owner].lock );
+                                        c = owner = 0;
+                                        break;
+                                }
+                                if( c && !grtfs_dedup_match( ctx, owner, c, bytes, next ) ){
+                                        if( !matched ){
+                                                pthread_rwlock_unlock( &ctx->files[owner].lock );
+                                                owner = 0;
+                                        }
+                                        c = 0;
+                                }
+                        }
+                        if( c ){
+                                matched++;
+                                next = shared = c;
+                                continue;
+                        }
+                        matching = FALSE;
+                        if( !valid && ( b != 0 ) ){
+                                pthread_mutex_lock( &ctx->lock );
+                                grtfs_dedup_insert( ctx, hash, b, file->home );
+                                pthread_mutex_unlock( &ctx->lock );
+                        }
+                        hashes[n].block = b;
+                        hashes[n].next = next;
+                        hashes[n].hash = hash;
+                        next = file->extents[e].block + i;
+                }
+        }
+
+        keep = file->mapped - matched;
+        file->hashed = keep;
+        if( matched > 0 ){
+                // the file's own last blocks go, and its chain goes on
+                // into the other file's
+                grtfs_trim_file( ctx, fd, keep );
+                pthread_mutex_lock( &ctx->lock );
+                for( b = shared; b != LAST_BLOCK; b = ctx->file_allocation_table[b] )
+                        ctx->refs[b] = ( ctx->refs[b] ? ctx->refs[b] : 1 ) + 1;
+                if( keep == 0 ) entry->first_block = shared;
+                else grtfs_link_extent( ctx, fd, file->n_extents - 1, shared );
+                ctx->blocks_deduplicated += matched;
+                if( !( entry->flags & SHARED_BLOCKS ) ) grtfs_directory_header( ctx )->shared_files++;
+                if( !( ctx->directory[owner].flags & SHARED_BLOCKS ) ) grtfs_directory_header( ctx )->shared_files++;
+                entry->flags |= SHARED_BLOCKS;
+                ctx->directory[owner].flags |= SHARED_BLOCKS;
+                pthread_mutex_unlock( &ctx->lock );
+                ctx->files[owner].unshared = 0;
+                pthread_rwlock_unlock( &ctx->files[owner].lock );
+                grtfs_reset_file_state( ctx, fd );
+        }
+}
+
+unsigned int grtfs_write( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                char *buffer,
+                unsigned int byte_count ){
+        struct iovec iov = { buffer, byte_count };
+        return( grtfs_transfer( ctx, file_descriptor, &iov, 1, 0, TRUE, TRUE ) );
+}
+
+/* tfs_pwrite()
  *
- * postconditions:
- *   there are no changes to the file data structures
+ * same as tfs_write(), but writes starting at the given offset and
+ *   leaves the byte offset in the directory entry unchanged
  *
- * input parameter is file name
+ * input parameters are a context, a file descriptor, the address
+ *   of a buffer of bytes to transfer, the count of bytes to
+ *   transfer and the offset of the first byte
  *
- * return value is TRUE or FALSE
+ * return value is the number of bytes transferred
  */
 
-unsigned int grtfs_exists( char *name ){
-        if( !grtfs_check_valid_name( name ) ) return( FALSE );
-        if( grtfs_map_name_to_fd( name ) == 0 ) return( FALSE );
-        return( TRUE );
+unsigned int grtfs_pwrite( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                char *buffer,
+                unsigned int byte_count,
+                unsigned int offset ){
+        struct iovec iov = { buffer, byte_count };
+        return( grtfs_transfer( ctx, file_descriptor, &iov, 1, offset, FALSE, TRUE ) );
 }
 
-/* tfs_create()
- *
- * create a new directory entry with the given file name and
- *   set the status to open, the first_block to invalid, the
- *   size to 0 and the byte offset to 0
- *
- * preconditions:
- *   (1) the name is valid
- *   (2) the name is not already associated with any active
- *         directory entry
- *   (3) an unused directory entry is available
+/* tfs_writev()
  *
- * postconditions:
- *   (1) a new directory entry overwrites an unused entry
- *   (2) the new entry is appropriately initialized
+ * same as tfs_write(), but writes the iovcnt buffers of iov in
+ *   turn, each for as many bytes as its length; the file blocks are
+ *   found once for the whole transfer rather than once per buffer
  *
- * input parameter is file name
+ * input parameters are a context, a file descriptor, an array of
+ *   buffers and the number of buffers in it
  *
- * return value is the file descriptor of a directory entry
- *   when successful or 0 when failure
+ * return value is the number of bytes transferred
  */
 
-unsigned int grtfs_create( char *name ){
-        unsigned int file_descriptor;
-        if( !grtfs_check_valid_name( name ) ) return( 0 );
-        if( grtfs_map_name_to_fd( name ) != 0 ) return( 0 );
-        file_descriptor = grtfs_new_directory_entry();
-        if( file_descriptor == 0 ) return( 0 );
-        directory[file_descriptor].status = OPEN;
-        directory[file_descriptor].first_block = 0;
-        directory[file_descriptor].size = 0;
-        directory[file_descriptor].byte_offset = 0;
-        strcpy( directory[file_descriptor].name, name );
-        directory[file_descriptor].access = 3; // 0011 : default readable and writable
-        return( file_descriptor );
+unsigned int grtfs_writev( grtfs_ctx *ctx,
+                unsigned int file_descriptor,
+                const struct iovec *iov,
+                unsigned int iovcnt ){
+        return( grtfs_transfer( ctx, file_descriptor, iov, iovcnt, 0, TRUE, TRUE ) );
 }
 
-/* tfs_open()
+/* tfs_truncate()
  *
- * opens the directory entry having the given file name and
- *   sets the status to open and the byte offset to 0
+ * sets the size of a file; a file cut short gives back its blocks
+ *   past the new size, including any reserved by tfs_fallocate()
+ *   or preallocated by tfs_write(), and a file made longer reads
+ *   as zeros from its old size to the new one without taking any
+ *   blocks for them; the byte offset is left unchanged
  *
  * preconditions:
- *   (1) the name is valid
- *   (2) the name is associated with an active directory entry
- *   (3) the directory entry is not already open
+ *   (1) the file descriptor is in range
+ *   (2) the directory entry is open
+ *   (3) the file is writable
+ *   (4) the size is less than MAX_FILE_SIZE
  *
  * postconditions:
- *   (1) the status of the directory entry is set to open
- *   (2) the byte offset of the directory entry is set to 0
+ *   (1) the size of the file is the given size
+ *   (2) the file has no blocks past the block holding its last
+ *         byte when it was cut short
  *
- * input parameter is file name
+ * input parameters are a context, a file descriptor and a size
  *
- * return value is the file descriptor of a directory entry
- *   when successful or 0 when failure
+ * return value is TRUE when successful or FALSE when failure
  */
 
-unsigned int grtfs_open( char *name ){
-        unsigned int file_descriptor;
-        if( !grtfs_check_valid_name( name ) ) return( 0 );
-        file_descriptor = grtfs_map_name_to_fd( name );
-        if( file_descriptor == 0 ) return( 0 );
-        if( grtfs_check_file_is_open( file_descriptor ) ) return( 0 );
-        directory[file_descriptor].status = OPEN;
-        directory[file_descriptor].byte_offset = 0;
-        return( file_descriptor );
+unsigned int grtfs_truncate( grtfs_ctx *ctx, unsigned int file_descriptor, unsigned int size ){
+        struct directory_entry *entry;
+        unsigned int fd, result = FALSE, tail;
+        fd = grtfs_lock_unpinned( ctx, file_descriptor );
+        if( fd == 0 ) return( FALSE );
+        entry = &ctx->directory[fd];
+        if( grtfs_check_file_is_open( ctx, fd ) &&
+                        grtfs_check_file_is_writable( ctx, fd ) && ( size < MAX_FILE_SIZE ) &&
+                        ( ctx->files[fd].map_valid || grtfs_map_file( ctx, fd ) ) ){
+                tail = entry->size - entry->size % BLOCK_SIZE;
+                if( entry->flags & COMPRESSED ){
+                        result = grtfs_truncate_groups( ctx, fd, size );
+                }else if( ( entry->flags & INLINE_DATA ) && ( size > tail ) && ( size - tail <= INLINE_BYTES ) ){
+                        // a tail kept in the directory entry stays there
+                        if( size < entry->size ) memset( entry->data + size - tail, 0, entry->size - size );
+                        entry->size = size;
+                        result = TRUE;
+                }else if( ( entry->flags & INLINE_DATA ) && ( size <= tail ) ){
+                        memset( entry->data, 0, entry->size - tail );
+                        entry->flags &= ~INLINE_DATA;
+                        entry->size = tail;
+                }else if( entry->flags & INLINE_DATA ){
+                        grtfs_unpack_tail( ctx, fd );
+                }
+                if( !result && !( entry->flags & ( INLINE_DATA | COMPRESSED ) ) ){
+                        if( size < entry->size )
+                                grtfs_trim_file( ctx, fd, ( size + BLOCK_SIZE - 1 ) / BLOCK_SIZE );
+                        else
+                                result = grtfs_unshare( ctx, fd, entry->size / BLOCK_SIZE,
+                                                        ( size + BLOCK_SIZE - 1 ) / BLOCK_SIZE ) &&
+                                        grtfs_zero_file( ctx, fd, entry->size, size );
+                        if( ( size < entry->size ) || result ){
+                                entry->size = size;
+                                result = TRUE;
+                        }
+                }
+        }
+        pthread_rwlock_unlock( &ctx->files[fd].lock );
+        grtfs_end_change( ctx );
+        return( result );
 }
 
-/* tfs_close()
+/* tfs_fallocate()
  *
- * closes the directory entry having the given file descriptor
- *   (sets the status to closed and the byte offset to 0); the
- *   function fails if (1) the file descriptor is out of range,
- *   (2) the file descriptor is within range but the directory
- *   entry is not open
+ * reserves the blocks a file needs to hold size bytes, in as few
+ *   runs of contiguous blocks as the free blocks allow, so that
+ *   writes up to that size take no blocks of their own; the size
+ *   of the file is unchanged, and blocks reserved past its end are
+ *   given back by tfs_truncate() or when the file is closed; holes
+ *   in the file stay holes
  *
  * preconditions:
  *   (1) the file descriptor is in range
  *   (2) the directory entry is open
+ *   (3) the file is writable
+ *   (4) the size is less than MAX_FILE_SIZE
+ *   (5) the file is not compressed, its blocks depending on the
+ *         bytes written
+ *   (6) enough blocks are free
  *
  * postconditions:
- *   (1) the status of the directory entry is set to closed
- *   (2) the byte offset of the directory entry is set to 0
+ *   the file has blocks for its first size bytes, apart from its
+ *     holes
  *
- * input parameter is a file descriptor
+ * input parameters are a context, a file descriptor and a size
  *
- * return value is TRUE when successful or FALSE when failure
+ * return value is TRUE when successful or FALSE when failure, in
+ *   which case the file keeps the blocks it had
  */
 
-unsigned int grtfs_close( unsigned int file_descriptor ){
-        if( !grtfs_check_fd_in_range( file_descriptor ) ) return( FALSE );
-        if( !grtfs_check_file_is_open( file_descriptor ) ) return( FALSE );
-        directory[file_descriptor].status = CLOSED;
-        directory[file_descriptor].byte_offset = 0;
-        return( TRUE );
+unsigned int grtfs_fallocate( grtfs_ctx *ctx, unsigned int file_descriptor, unsigned int size ){
+        struct directory_entry *entry;
+        struct file_state *file;
+        unsigned int fd, result = FALSE, mapped, n_blocks = ( size + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+        grtfs_begin_change( ctx );
+        fd = grtfs_lock_file( ctx, file_descriptor, TRUE );
+        if( fd == 0 ){
+                grtfs_end_change( ctx );
+                return( FALSE );
+        }
+        file = &ctx->files[fd];
+        entry = &ctx->directory[fd];
+        if( grtfs_check_file_is_open( ctx, fd ) &&
+                        grtfs_check_file_is_writable( ctx, fd ) && ( size < MAX_FILE_SIZE ) &&
+                        !( entry->flags & COMPRESSED ) &&
+                        ( file->map_valid || grtfs_map_file( ctx, fd ) ) ){
+                // the block reserved for a tail kept in the directory
+                // entry takes the tail back
+                result = !( entry->flags & INLINE_DATA ) || ( n_blocks <= file->mapped ) ||
+                        grtfs_unpack_tail( ctx, fd );
+                mapped = file->mapped;
+                result = result && ( ( n_blocks <= mapped ) || grtfs_unshare( ctx, fd, mapped, mapped ) );
+                if( result && ( n_blocks > mapped ) && ( grtfs_extend_file( ctx, fd, n_blocks ) < n_blocks ) ){
+                        grtfs_trim_file( ctx, fd, mapped );
+                        result = FALSE;
+                }
+                // as in tfs_write(), new blocks inside the size of a
+                // file grown by tfs_truncate() read as zeros
+                if( result && ( n_blocks > mapped ) )
+                        result = grtfs_zero_file( ctx, fd, mapped * BLOCK_SIZE, entry->size );
+        }
+        pthread_rwlock_unlock( &file->lock );
+        grtfs_end_change( ctx );
+        return( result );
 }
 
-/* tfs_size()
+/* tfs_set_compression()
  *
- * returns the file size for an active directory entry
+ * makes an empty file compressed, or not compressed again: a
+ *   compressed file keeps its bytes in groups of GROUP_BYTES bytes,
+ *   each compressed into a run of contiguous blocks of its own, so
+ *   a write compresses every group it changes again and a read
+ *   decompresses the groups it reads, keeping the last one read for
+ *   the reads that follow
+ *
+ * a compressed file cannot be cloned, viewed or given blocks by
+ *   tfs_fallocate(), and its bytes are never kept in its directory
+ *   entry
  *
  * preconditions:
  *   (1) the file descriptor is in range
- *   (2) the directory entry is active
+ *   (2) the directory entry is open
+ *   (3) the file is writable
+ *   (4) the file is empty and has no blocks
  *
  * postconditions:
- *   there are no changes to the file data structures
+ *   the file has COMPRESSED set in its flags when on is TRUE and
+ *     clear when it is FALSE
  *
- * input parameter is a file descriptor
+ * input parameters are a context, a file descriptor and whether the
+ *   file is to be compressed
  *
- * return value is the file size when successful or MAX_FILE_SIZE+1
- *   when failure
+ * return value is TRUE when successful or FALSE when failure
  */
 
-unsigned int grtfs_size( unsigned int file_descriptor ){
-        if( !grtfs_check_fd_in_range( file_descriptor ) ) return( MAX_FILE_SIZE + 1 );
-        if( directory[file_descriptor].status == UNUSED ) return( MAX_FILE_SIZE + 1 );
-        return( directory[file_descriptor].size );
+unsigned int grtfs_set_compression( grtfs_ctx *ctx, unsigned int file_descriptor, unsigned int on ){
+        struct directory_entry *entry;
+        unsigned int fd, result = FALSE;
+        grtfs_begin_change( ctx );
+        fd = grtfs_lock_file( ctx, file_descriptor, TRUE );
+        if( fd == 0 ){
+                grtfs_end_change( ctx );
+                return( FALSE );
+        }
+        entry = &ctx->directory[fd];
+        if( grtfs_check_file_is_open( ctx, fd ) && grtfs_check_file_is_writable( ctx, fd ) &&
+                        ( entry->size == 0 ) && ( entry->first_block == FREE ) &&
+                        !( entry->flags & ( INLINE_DATA | SHARED_BLOCKS ) ) ){
+                if( on ) entry->flags |= COMPRESSED;
+                else entry->flags &= ~COMPRESSED;
+                grtfs_reset_file_state( ctx, fd );
+                result = TRUE;
+        }
+        pthread_rwlock_unlock( &ctx->files[fd].lock );
+        grtfs_end_change( ctx );
+        return( result );
 }
 
-/* tfs_seek()
- *
- * sets the byte offset in a directory entry
+// returns whether the home of fd holds a file; the caller holds
+// ctx->lock and has checked that fd is in range
+unsigned int grtfs_home_used( grtfs_ctx *ctx, unsigned int fd ){
+        struct directory_entry buffer, *entry;
+        if( fd < N_DIRECTORY_ENTRIES ) return( ( ctx->fixed_used >> fd ) & 1 );
+        if( grtfs_find_active( ctx, fd ) != 0 ) return( TRUE );
+        entry = grtfs_home_entry( ctx, fd, &buffer );
+        return( entry && ( entry->status != UNUSED ) );
+}
+
+/* tfs_defrag()
  *
- * preconditions:
- *   (1) the file descriptor is in range
- *   (2) the directory entry is open
- *   (3) the specified offset is less than the file size
+ * moves file blocks so that the data of each file between its holes
+ *   lies in one run of blocks, copying at most budget blocks per call
+ *   and going on where the previous call stopped; files can be open
+ *   and in use meanwhile, each is locked only while its blocks move
  *
- * postconditions:
- *   the byte offset of the directory entry is set to the
- *     specified offset
+ * a file whose data cannot be made one run, because no free run is
+ *   long enough, is left as it is
  *
- * input parameters are a file descriptor and a byte offset
+ * input parameters are a context and the most blocks to move
  *
- * return value is TRUE when successful or FALSE when failure
+ * return value is the number of blocks moved, 0 when a whole pass
+ *   over the files found nothing to move
  */
 
-unsigned int grtfs_seek( unsigned int file_descriptor, unsigned int offset ){
-        if( !grtfs_check_fd_in_range( file_descriptor ) ) return( FALSE );
-        if( !grtfs_check_file_is_open( file_descriptor ) ) return( FALSE );
-        if( offset >= directory[file_descriptor].size ) return( FALSE );
-        directory[file_descriptor].byte_offset = offset;
-        return( TRUE );
+unsigned int grtfs_defrag( grtfs_ctx *ctx, unsigned int budget ){
+        unsigned int i, n, fd, a, moved = 0;
+        pthread_mutex_lock( &ctx->lock );
+        n = ctx->storage ? N_DIRECTORY_ENTRIES - FIRST_VALID_FD + grtfs_directory_header( ctx )->used_slots : 0;
+        fd = ( ctx->defrag_fd < FIRST_VALID_FD ) || ( ctx->defrag_fd >= FIRST_VALID_FD + n ) ?
+                FIRST_VALID_FD : ctx->defrag_fd;
+        pthread_mutex_unlock( &ctx->lock );
+        for( i = 0; ( i < n ) && ( moved < budget ); i++ ){
+                grtfs_begin_change( ctx );
+                pthread_mutex_lock( &ctx->lock );
+                // an unused home is passed over without taking an index
+                if( grtfs_home_used( ctx, fd ) ) a = grtfs_lock_fd( ctx, fd, TRUE );
+                else{
+                        pthread_mutex_unlock( &ctx->lock );
+                        a = 0;
+                }
+                // the blocks of a file with views or clones stay where
+                // they are
+                if( ( a != 0 ) && !grtfs_file_pins( ctx, a ) && !( ctx->directory[a].flags & SHARED_BLOCKS ) &&
+                                ( ctx->files[a].map_valid || grtfs_map_file( ctx, a ) ) )
+                        moved += grtfs_defrag_file( ctx, a, budget - moved );
+                if( a != 0 ) pthread_rwlock_unlock( &ctx->files[a].lock );
+                grtfs_end_change( ctx );
+                // a file the budget ran out on is where the next call starts
+                if( moved >= budget ) break;
+                fd = fd + 1 < FIRST_VALID_FD + n ? fd + 1 : FIRST_VALID_FD;
+        }
+        pthread_mutex_lock( &ctx->lock );
+        ctx->defrag_fd = fd;
+        pthread_mutex_unlock( &ctx->lock );
+        return( moved );
+}
+
+// counts the runs of contiguous blocks holding the data of a file,
+// walking its FAT chain, a hole record ending a run, and sets *joinable
+// when two of them have no hole between them; the caller holds
+// ctx->lock
+unsigned int grtfs_chain_fragments( grtfs_ctx *ctx, struct directory_entry *entry, unsigned int *joinable ){
+        unsigned int b = entry->first_block, next, previous = 0, fragments = 0, steps = 0;
+        unsigned int n_blocks = ctx->superblock->n_blocks;
+        *joinable = FALSE;
+        if( entry->status == UNUSED ) return( 0 );
+        while( ( b >= ctx->superblock->first_data_block ) && ( b < n_blocks ) && ( steps++ < n_blocks ) ){
+                next = ctx->file_allocation_table[b];
+                if( next & HOLE_FLAG ){
+                        previous = 0;
+                }else{
+                        if( ( previous != 0 ) && ( b != previous + 1 ) ) *joinable = TRUE;
+                        if( ( previous == 0 ) || ( b != previous + 1 ) ) fragments++;
+                        previous = b;
+                }
+                b = next & ~HOLE_FLAG;
+        }
+        return( fragments );
 }
 
+/* tfs_frag_report()
+ *
+ * counts the files, the runs of blocks holding their data and the
+ *   files whose data could lie in fewer runs, and finds the free
+ *   blocks and the longest run of them; the entries of the directory
+ *   file are read as they are reached, each under ctx->lock alone
+ *
+ * input parameters are a context and the report to fill in
+ *
+ * no return value
+ */
 
-/* implementation of assigned functions */
+void grtfs_frag_report( grtfs_ctx *ctx, struct grtfs_frag_report *report ){
+        struct directory_entry buffer, *entry;
+        unsigned int fd, end, joinable, b, run, n_blocks;
+        memset( report, 0, sizeof( *report ) );
+        pthread_mutex_lock( &ctx->lock );
+        end = ctx->storage ? N_DIRECTORY_ENTRIES + grtfs_directory_header( ctx )->used_slots : FIRST_VALID_FD;
+        pthread_mutex_unlock( &ctx->lock );
+        for( fd = FIRST_VALID_FD; fd < end; fd++ ){
+                pthread_mutex_lock( &ctx->lock );
+                entry = grtfs_read_entry( ctx, fd, &buffer );
+                if( entry && ( entry->status != UNUSED ) ){
+                        report->files++;
+                        report->fragments += grtfs_chain_fragments( ctx, entry, &joinable );
+                        report->fragmented_files += joinable;
+                }
+                pthread_mutex_unlock( &ctx->lock );
+        }
 
+        pthread_mutex_lock( &ctx->lock );
+        n_blocks = ctx->superblock->n_blocks;
+        for( b = grtfs_next_free( ctx, ctx->superblock->first_data_block ); b < n_blocks;
+                        b = grtfs_next_free( ctx, b + run ) ){
+                run = grtfs_run_length( ctx, b, n_blocks );
+                report->free_blocks += run;
+                if( run > report->largest_free_run ) report->largest_free_run = run;
+        }
+        pthread_mutex_unlock( &ctx->lock );
+}
 
-/* you are welcome to use helper functions of your own */
+/* tfs_fragments()
+ *
+ * counts the runs of blocks holding the data of one file, as
+ *   tfs_frag_report() does for all of them
+ *
+ * input parameters are a context and a file descriptor
+ *
+ * return value is the number of runs, 0 for a file without blocks
+ *   or when the file descriptor names no file
+ */
 
+unsigned int grtfs_fragments( grtfs_ctx *ctx, unsigned int file_descriptor ){
+        struct directory_entry buffer, *entry;
+        unsigned int joinable, fragments = 0;
+        pthread_mutex_lock( &ctx->lock );
+        if( grtfs_check_fd_in_range( ctx, file_descriptor ) ){
+                entry = grtfs_read_entry( ctx, file_descriptor, &buffer );
+                if( entry ) fragments = grtfs_chain_fragments( ctx, entry, &joinable );
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        return( fragments );
+}
 
 
-/* tfs_delete()
+/* tfs_snapshot_new()
  *
- * deletes a closed directory entry having the given file descriptor
- *   (changes the status of the entry to unused) and releases all
- *   allocated file blocks
+ * freezes the directory, the blocks of the directory file and of the
+ *   name index and the file allocation table of a context by copying
+ *   them, and holds the data blocks they use: until the snapshot is
+ *   freed, a block it holds is copied before a write changes it and
+ *   is not reused when a file gives it back, so taking a snapshot
+ *   costs only the copy of the metadata and a pass over the file
+ *   allocation table
  *
- * preconditions:
- *   (1) the file descriptor is in range
- *   (2) the directory entry is closed
+ * a snapshot lives in memory only; tfs_snapshot_save() writes it out
+ *   as an image file, and tfs_snapshot_restore() brings the context
+ *   back to it
  *
- * postconditions:
- *   (1) the status of the directory entry is set to unused
- *   (2) all file blocks have been set to free
+ * tfs_snapshot_new(), tfs_snapshot_restore() and tfs_snapshot_free()
+ *   must not overlap any other call on the same context, and the
+ *   snapshots of a context are freed before its image is replaced or
+ *   unmounted
  *
- * input parameter is a file descriptor
+ * input parameter is a context
  *
- * return value is TRUE when successful or FALSE when failure
+ * return value is the new snapshot or NULL when failure
  */
 
-unsigned int grtfs_delete( unsigned int file_descriptor ){
-        directory[file_descriptor].status = UNUSED;
-        if( directory[file_descriptor].first_block == 0 ) return( TRUE );
+grtfs_snapshot *grtfs_snapshot_new( grtfs_ctx *ctx ){
+        struct superblock *sb = ctx->superblock;
+        struct directory_header *header;
+        grtfs_snapshot *snapshot;
+        uint32_t *fat;
+        unsigned int b, i, n_slots, n_index, result;
+        char *bytes, *copy;
 
-        unsigned char block_index = directory[file_descriptor].first_block;
-        while( file_allocation_table[block_index] != LAST_BLOCK ){
-                unsigned char temp_index = block_index;
-                block_index = file_allocation_table[block_index];
-                file_allocation_table[temp_index] = FREE;
+        snapshot = calloc( 1, sizeof( grtfs_snapshot ) );
+        if( !snapshot ) return( NULL );
+        snapshot->ctx = ctx;
+        // the entries in memory are written to their homes, closed, so
+        // that the copies hold them
+        result = grtfs_store_entries( ctx );
+        pthread_mutex_lock( &ctx->lock );
+        header = grtfs_directory_header( ctx );
+        n_slots = ctx->image_directory[0].size / BLOCK_SIZE;
+        n_index = header->index_buckets / NAME_BUCKETS_PER_BLOCK;
+        snapshot->metadata = malloc( (size_t) sb->journal_block * BLOCK_SIZE );
+        snapshot->meta_blocks = malloc( ( n_slots + n_index + 1 ) * sizeof( uint32_t ) );
+        snapshot->meta_bytes = malloc( (size_t) ( n_slots + n_index + 1 ) * BLOCK_SIZE );
+        if( !ctx->frozen ) ctx->frozen = calloc( sb->n_blocks, sizeof( uint32_t ) );
+        result = result && snapshot->metadata && snapshot->meta_blocks && snapshot->meta_bytes && ctx->frozen;
+        for( i = 0; result && ( i < n_slots + n_index ); i++ ){
+                b = i < n_slots ? grtfs_chain_block( ctx, &ctx->dir_map, ctx->image_directory[0].first_block, i ) :
+                        grtfs_chain_block( ctx, &ctx->index_map, header->index_block, i - n_slots );
+                copy = snapshot->meta_bytes + (size_t) i * BLOCK_SIZE;
+                bytes = b ? grtfs_read_meta( ctx, b, copy ) : NULL;
+                if( bytes && ( bytes != copy ) ) memcpy( copy, bytes, BLOCK_SIZE );
+                snapshot->meta_blocks[i] = b;
+                result = ( bytes != NULL );
+        }
+        if( !result ){
+                pthread_mutex_unlock( &ctx->lock );
+                free( snapshot->metadata );
+                free( snapshot->meta_blocks );
+                free( snapshot->meta_bytes );
+                free( snapshot );
+                return( NULL );
         }
+        snapshot->n_meta = n_slots + n_index;
+        memcpy( snapshot->metadata, ctx->storage, (size_t) sb->journal_block * BLOCK_SIZE );
 
-        file_allocation_table[block_index] = FREE;
-        return( TRUE );
+        fat = (uint32_t *) ( snapshot->metadata + (size_t) sb->fat_block * BLOCK_SIZE );
+        // blocks freed while held cannot be told from free ones by the
+        // FAT, so the bitmap is built in full first
+        grtfs_scan_fat( ctx, ctx->summary_words - 1 );
+        for( b = sb->first_data_block; b < sb->n_blocks; b++ )
+                if( fat[b] != FREE ) ctx->frozen[b]++;
+        ctx->snapshots++;
+        pthread_mutex_unlock( &ctx->lock );
+        return( snapshot );
 }
 
-
-/* tfs_read()
+/* tfs_snapshot_save()
  *
- * reads a specified number of bytes from a file starting
- *   at the byte offset in the directory into the specified
- *   buffer; the byte offset in the directory entry is
- *   incremented by the number of bytes transferred
+ * writes the image a snapshot froze to a new image file, holding the
+ *   same files and the blocks they used, which can be given to
+ *   tfs_mount(); other calls on the context can go on meanwhile
  *
- * depending on the starting byte offset and the specified
- *   number of bytes to transfer, the transfer may cross two
- *   or more file blocks
+ * input parameters are a snapshot and the path of the image file
  *
- * the function will read fewer bytes than specified if the
- *   end of the file is encountered before the specified number
- *   of bytes have been transferred
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_snapshot_save( grtfs_snapshot *snapshot, char *path ){
+        struct superblock *sb = (struct superblock *) snapshot->metadata;
+        uint32_t *fat = (uint32_t *) ( snapshot->metadata + (size_t) sb->fat_block * BLOCK_SIZE );
+        size_t bytes = (size_t) sb->journal_block * BLOCK_SIZE;
+        unsigned int b, i, n, result;
+        char *buffer;
+        int file;
+
+        file = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if( file < 0 ){
+                GRTFS_DIAG( "*** cannot create image %s\n", path );
+                return( FALSE );
+        }
+        buffer = malloc( SAVE_COPY_BLOCKS * BLOCK_SIZE );
+        result = buffer && ( ftruncate( file, (off_t) sb->n_blocks * BLOCK_SIZE ) == 0 ) &&
+                ( pwrite( file, snapshot->metadata, bytes, 0 ) == (ssize_t) bytes );
+        // runs of held blocks are copied, the rest of the file is left
+        // a hole, as is the journal, which then holds no transaction
+        for( b = sb->first_data_block; result && ( b < sb->n_blocks ); b += n ){
+                for( n = 1; ( b + n < sb->n_blocks ) && ( n < SAVE_COPY_BLOCKS ) &&
+                                ( ( fat[b + n] == FREE ) == ( fat[b] == FREE ) ); n++ );
+                if( fat[b] == FREE ) continue;
+                result = grtfs_copy_blocks( snapshot->ctx, b, 0, buffer, n * BLOCK_SIZE, FALSE ) &&
+                        ( pwrite( file, buffer, n * BLOCK_SIZE, (off_t) b * BLOCK_SIZE ) == (ssize_t) n * BLOCK_SIZE );
+        }
+        // the blocks of the directory file and of the name index are
+        // written over from their copies, a run of them at a time
+        for( i = 0; result && ( i < snapshot->n_meta ); i += n ){
+                for( n = 1; ( i + n < snapshot->n_meta ) &&
+                                ( snapshot->meta_blocks[i + n] == snapshot->meta_blocks[i] + n ); n++ );
+                result = ( pwrite( file, snapshot->meta_bytes + (size_t) i * BLOCK_SIZE, n * BLOCK_SIZE,
+                                        (off_t) snapshot->meta_blocks[i] * BLOCK_SIZE ) == (ssize_t) n * BLOCK_SIZE );
+        }
+        if( result ) result = ( fdatasync( file ) == 0 );
+        if( close( file ) != 0 ) result = FALSE;
+        free( buffer );
+        if( !result ) GRTFS_DIAG( "*** cannot write image %s\n", path );
+        return( result );
+}
+
+/* tfs_snapshot_restore()
  *
- * preconditions:
- *   (1) the file descriptor is in range
- *   (2) the directory entry is open
- *   (3) the file has allocated file blocks
- *   (4) file is readable
+ * brings the directory, the directory file, the name index and the
+ *   file allocation table of a context back to those a snapshot
+ *   froze, which makes its files hold what they held then; blocks
+ *   used since are free again, open entries are closed, and the
+ *   snapshot stays valid
  *
- * postconditions:
- *   (1) the buffer contains bytes transferred from file blocks
- *   (2) the specified number of bytes has been transferred
- *         except in the case that end of file was encountered
- *         before the transfer was complete
+ * input parameter is a snapshot
  *
- * input parameters are a file descriptor, the address of a
- *   buffer of bytes to transfer, and the count of bytes to
- *   transfer
+ * return value is TRUE when successful or FALSE when failure
+ */
+
+unsigned int grtfs_snapshot_restore( grtfs_snapshot *snapshot ){
+        grtfs_ctx *ctx = snapshot->ctx;
+        struct superblock *sb = ctx->superblock;
+        size_t first = (size_t) sb->directory_block * BLOCK_SIZE;
+        unsigned long free_before = 0, free_after = 0;
+        unsigned int w, b, i, result = TRUE;
+        char *bytes;
+
+        memcpy( ctx->storage + first, snapshot->metadata + first, (size_t) sb->journal_block * BLOCK_SIZE - first );
+        if( ctx->meta_dirty ) memset( ctx->meta_dirty + sb->fat_block, TRUE, sb->journal_block - sb->fat_block );
+
+        pthread_mutex_lock( &ctx->lock );
+        for( w = 0; w < ctx->map_words; w++ ) free_before += __builtin_popcountll( ctx->free_map[w] );
+        // the bitmap is built from the restored FAT, leaving out the
+        // blocks other snapshots hold
+        memset( ctx->free_summary, 0, ctx->summary_words * sizeof( unsigned long long ) );
+        ctx->scanned_words = 0;
+        ctx->free_hint = 0;
+        grtfs_scan_fat( ctx, ctx->summary_words - 1 );
+        for( b = sb->first_data_block; b < sb->n_blocks; b++ )
+                if( ctx->frozen[b] && ( ctx->file_allocation_table[b] == FREE ) ) grtfs_mark_used( ctx, b, 1 );
+        for( w = 0; w < ctx->map_words; w++ ) free_after += __builtin_popcountll( ctx->free_map[w] );
+        if( free_after > free_before ) ctx->blocks_freed += free_after - free_before;
+        else ctx->blocks_allocated += free_before - free_after;
+        ctx->defrag_fd = 0;
+        // the changed copies and the blocks given up belong to the
+        // metadata left behind
+        grtfs_purge_overlay( ctx, TRUE );
+        ctx->n_released = 0;
+        for( i = 0; i < snapshot->n_meta; i++ ){
+                bytes = grtfs_change_meta( ctx, snapshot->meta_blocks[i], TRUE );
+                if( bytes ) memcpy( bytes, snapshot->meta_bytes + (size_t) i * BLOCK_SIZE, BLOCK_SIZE );
+                else result = FALSE;
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        return( grtfs_load_directory( ctx ) && result );
+}
+
+/* tfs_snapshot_free()
  *
- * return value is the number of bytes transferred
+ * frees a snapshot, giving back the blocks that only it held
+ *
+ * input parameter is a snapshot
+ *
+ * no return value
  */
 
-unsigned int grtfs_read( unsigned int file_descriptor,
-                char *buffer,
-                unsigned int byte_count ){
-        if( file_is_readable(directory[file_descriptor].name) == FALSE ){
-                printf("*** Read access denied\n");
-                return( FALSE );
+void grtfs_snapshot_free( grtfs_snapshot *snapshot ){
+        grtfs_ctx *ctx = snapshot->ctx;
+        struct superblock *sb = ctx->superblock;
+        uint32_t *fat = (uint32_t *) ( snapshot->metadata + (size_t) sb->fat_block * BLOCK_SIZE );
+        unsigned int b;
+
+        pthread_mutex_lock( &ctx->lock );
+        for( b = sb->first_data_block; b < sb->n_blocks; b++ ){
+                if( ( fat[b] == FREE ) || ( --ctx->frozen[b] > 0 ) ) continue;
+                if( ( ctx->file_allocation_table[b] == FREE ) &&
+                                !( ctx->free_map[b / 64] & ( 1ULL << ( b % 64 ) ) ) ){
+                        grtfs_mark_free( ctx, b );
+                        ctx->blocks_freed++;
+                }
         }
+        if( --ctx->snapshots == 0 ){
+                free( ctx->frozen );
+                ctx->frozen = NULL;
+        }
+        pthread_mutex_unlock( &ctx->lock );
+        free( snapshot->metadata );
+        free( snapshot->meta_blocks );
+        free( snapshot->meta_bytes );
+        free( snapshot );
+}
 
-        unsigned short byte_offset = directory[file_descriptor].byte_offset;
-        unsigned char  block_index = directory[file_descriptor].first_block;
-        unsigned int   bytes_read  = 0;
+// orders queued requests so that creates come first and deletes
+// last, with the reads and writes of a file between them by offset;
+// ties keep the order they were submitted in
+int grtfs_compare_requests( const void *a, const void *b ){
+        static const unsigned int class[] = { 1, 1, 0, 2 };
+        const struct grtfs_request *x = *(struct grtfs_request * const *) a;
+        const struct grtfs_request *y = *(struct grtfs_request * const *) b;
+        unsigned int cx = x->op <= GRTFS_OP_DELETE ? class[x->op] : 3;
+        unsigned int cy = y->op <= GRTFS_OP_DELETE ? class[y->op] : 3;
+        if( cx != cy ) return( cx < cy ? -1 : 1 );
+        if( cx == 1 ){
+                if( x->file_descriptor != y->file_descriptor )
+                        return( x->file_descriptor < y->file_descriptor ? -1 : 1 );
+                if( x->op != y->op ) return( x->op < y->op ? -1 : 1 );
+                if( x->offset != y->offset ) return( x->offset < y->offset ? -1 : 1 );
+        }
+        return( x < y ? -1 : x > y );
+}
 
-        // start at block according to given offset
-        for( int i = 0; i < (byte_offset / BLOCK_SIZE); i++ )
-                block_index = file_allocation_table[block_index];
+// runs a batch of n queued requests, putting the result of batch[i]
+// in results[i]: all creates as one tfs_create_many(), each run of
+// reads or writes of a file where every request starts at the byte
+// the one before ends as one transfer, and all deletes as one
+// tfs_delete_many()
+void grtfs_run_batch( grtfs_ctx *ctx, struct grtfs_request *batch, unsigned int *results, unsigned int n ){
+        struct grtfs_request *order[QUEUE_BATCH];
+        struct iovec iov[QUEUE_BATCH];
+        char *names[QUEUE_BATCH];
+        unsigned int fds[QUEUE_BATCH], done[QUEUE_BATCH];
+        unsigned int i, j, k, op, count, merged = 0;
+        unsigned long end;
+        for( i = 0; i < n; i++ ){
+                order[i] = &batch[i];
+                results[i] = 0;
+        }
+        qsort( order, n, sizeof( order[0] ), grtfs_compare_requests );
 
-        // read into buffer
-        for( unsigned int i = 0; i < byte_count; i++ ) {
-                unsigned short offset_index = (i + byte_offset) % BLOCK_SIZE;
-                buffer[i] = blocks[block_index].bytes[offset_index];
-                bytes_read++;
+        for( i = 0; ( i < n ) && ( order[i]->op == GRTFS_OP_CREATE ); i++ )
+                names[i] = order[i]->name;
+        if( i > 0 ){
+                grtfs_create_many( ctx, names, i, fds );
+                for( j = 0; j < i; j++ ) results[order[j] - batch] = fds[j];
+        }
 
-                if( (i + byte_offset) % BLOCK_SIZE == BLOCK_SIZE - 1 )
-                        block_index = file_allocation_table[block_index];
+        for( ; ( i < n ) && ( order[i]->op <= GRTFS_OP_WRITE ); i = j ){
+                op = order[i]->op;
+                end = (unsigned long) order[i]->offset + order[i]->byte_count;
+                for( j = i + 1; ( j < n ) && ( order[j]->op == op ) &&
+                                ( order[j]->file_descriptor == order[i]->file_descriptor ) &&
+                                ( order[j]->offset == end ); j++ )
+                        end += order[j]->byte_count;
+                for( k = i; k < j; k++ ){
+                        iov[k - i].iov_base = order[k]->buffer;
+                        iov[k - i].iov_len = order[k]->byte_count;
+                }
+                count = grtfs_transfer( ctx, order[i]->file_descriptor, iov, j - i,
+                                order[i]->offset, FALSE, op == GRTFS_OP_WRITE );
+                // a short transfer stops in the request it ran out in
+                for( k = i; k < j; k++ ){
+                        results[order[k] - batch] = count < order[k]->byte_count ? count : order[k]->byte_count;
+                        count -= results[order[k] - batch];
+                }
+                merged += j - i - 1;
+        }
 
-                if( block_index == LAST_BLOCK || block_index == FREE ) break;
+        for( j = i; ( j < n ) && ( order[j]->op == GRTFS_OP_DELETE ); j++ )
+                fds[j - i] = order[j]->file_descriptor;
+        if( j > i ){
+                grtfs_delete_many( ctx, fds, j - i, done );
+                for( k = i; k < j; k++ ) results[order[k] - batch] = done[k - i];
         }
 
-        directory[file_descriptor].byte_offset = byte_offset + bytes_read;
-        return( bytes_read );
+        __atomic_fetch_add( &ctx->requests, n, __ATOMIC_RELAXED );
+        __atomic_fetch_add( &ctx->requests_merged, merged, __ATOMIC_RELAXED );
 }
 
-/* tfs_write()
- *
- * writes a specified number of bytes from a specified buffer
- *   into a file starting at the byte offset in the directory;
- *   the byte offset in the directory entry is incremented by
- *   the number of bytes transferred
+// takes batches of submitted requests, runs them and queues their
+// completions until the queue is stopping and no request is left
+void *grtfs_queue_worker( void *arg ){
+        grtfs_queue *queue = arg;
+        struct grtfs_request batch[QUEUE_BATCH];
+        unsigned int results[QUEUE_BATCH];
+        unsigned int i, n, slot;
+        pthread_mutex_lock( &queue->lock );
+        for( ;; ){
+                while( ( queue->n_requests == 0 ) && !queue->stopping )
+                        pthread_cond_wait( &queue->work, &queue->lock );
+                if( queue->n_requests == 0 ) break;
+                n = queue->n_requests < QUEUE_BATCH ? queue->n_requests : QUEUE_BATCH;
+                for( i = 0; i < n; i++ )
+                        batch[i] = queue->requests[( queue->request_head + i ) % queue->depth];
+                queue->request_head = ( queue->request_head + n ) % queue->depth;
+                queue->n_requests -= n;
+                // requests left over go to another worker
+                if( queue->n_requests > 0 ) pthread_cond_signal( &queue->work );
+                pthread_mutex_unlock( &queue->lock );
+
+                grtfs_run_batch( queue->ctx, batch, results, n );
+
+                pthread_mutex_lock( &queue->lock );
+                for( i = 0; i < n; i++ ){
+                        slot = ( queue->completion_head + queue->n_completions++ ) % queue->depth;
+                        queue->completions[slot].user_data = batch[i].user_data;
+                        queue->completions[slot].op = batch[i].op;
+                        queue->completions[slot].result = results[i];
+                }
+                pthread_cond_broadcast( &queue->done );
+        }
+        pthread_mutex_unlock( &queue->lock );
+        return( NULL );
+}
+
+/* tfs_queue_new()
  *
- * depending on the starting byte offset and the specified
- *   number of bytes to transfer, the transfer may cross two
- *   or more file blocks
+ * creates a queue of requests on a context and n_workers threads
+ *   that run them; at most depth requests can be submitted and not
+ *   yet collected at once
  *
- * furthermore, depending on the starting byte offset and the
- *   specified number of bytes to transfer, additional file
- *   blocks, if available, will be added to the file as needed;
- *   in this case, the size of the file will be adjusted
- *   based on the number of bytes transferred beyond the
- *   original size of the file
+ * a worker takes all of the waiting requests, up to QUEUE_BATCH of
+ *   them, and runs them together: creates first, then reads and
+ *   writes, then deletes, and the reads or writes of a file that
+ *   follow on from each other's bytes as one transfer; requests that
+ *   are in the queue at the same time are therefore not ordered with
+ *   respect to each other, a request that must see the effect of
+ *   another is submitted after the other's completion is collected
  *
- * the function will read fewer bytes than specified if file
- *   blocks are not available
+ * input parameters are a context, the depth of the queue and the
+ *   number of worker threads, at most MAX_QUEUE_WORKERS
  *
- * preconditions:
- *   (1) the file descriptor is in range
- *   (2) the directory entry is open
- *   (3) file is writable
+ * return value is the new queue or NULL when failure
+ */
+
+grtfs_queue *grtfs_queue_new( grtfs_ctx *ctx, unsigned int depth, unsigned int n_workers ){
+        grtfs_queue *queue;
+        if( ( depth == 0 ) || ( n_workers == 0 ) || ( n_workers > MAX_QUEUE_WORKERS ) ) return( NULL );
+        queue = calloc( 1, sizeof( grtfs_queue ) );
+        if( !queue ) return( NULL );
+        queue->requests = malloc( depth * sizeof( struct grtfs_request ) );
+        queue->completions = malloc( depth * sizeof( struct grtfs_completion ) );
+        if( !queue->requests || !queue->completions ){
+                free( queue->requests );
+                free( queue->completions );
+                free( queue );
+                return( NULL );
+        }
+        queue->ctx = ctx;
+        queue->depth = depth;
+        pthread_mutex_init( &queue->lock, NULL );
+        pthread_cond_init( &queue->work, NULL );
+        pthread_cond_init( &queue->done, NULL );
+        for( ; queue->n_workers < n_workers; queue->n_workers++ ){
+                if( pthread_create( &queue->workers[queue->n_workers], NULL,
+                                grtfs_queue_worker, queue ) != 0 ) break;
+        }
+        if( queue->n_workers < n_workers ){
+                grtfs_queue_free( queue );
+                return( NULL );
+        }
+        return( queue );
+}
+
+/* tfs_queue_free()
  *
- * postconditions:
- *   (1) the file contains bytes transferred from the buffer
- *   (2) the specified number of bytes has been transferred
- *         except in the case that file blocks needed to
- *         complete the transfer were not available
- *   (3) the size of the file is increased as appropriate
- *         when transferred bytes extend beyond the previous
- *         end of the file
+ * runs the requests still waiting in a queue, stops its workers and
+ *   frees it; completions not collected are dropped
  *
- * input parameters are a file descriptor, the address of a
- *   buffer of bytes to transfer, and the count of bytes to
- *   transfer
+ * input parameter is a queue
  *
- * return value is the number of bytes transferred
+ * no return value
  */
 
-void append_block_at(unsigned char* block_index){
-        unsigned char next_index = file_allocation_table[*block_index];
-        if( next_index != FREE && next_index != LAST_BLOCK ){
-                *block_index = next_index;
-                return;
-        }
-
-        unsigned char temp_index = *block_index;
-        *block_index = grtfs_new_block();
-        file_allocation_table[temp_index] = *block_index;
-        file_allocation_table[*block_index] = LAST_BLOCK;
+void grtfs_queue_free( grtfs_queue *queue ){
+        unsigned int i;
+        pthread_mutex_lock( &queue->lock );
+        queue->stopping = TRUE;
+        pthread_cond_broadcast( &queue->work );
+        pthread_mutex_unlock( &queue->lock );
+        for( i = 0; i < queue->n_workers; i++ ) pthread_join( queue->workers[i], NULL );
+        pthread_mutex_destroy( &queue->lock );
+        pthread_cond_destroy( &queue->work );
+        pthread_cond_destroy( &queue->done );
+        free( queue->requests );
+        free( queue->completions );
+        free( queue );
 }
 
-unsigned int grtfs_write( unsigned int file_descriptor,
-                char *buffer,
-                unsigned int byte_count ){
-        if( file_is_writable(directory[file_descriptor].name) == FALSE ){
-                printf("*** Write access denied\n");
-                return( FALSE );
-        }
+/* tfs_submit()
+ *
+ * adds requests to a queue, in order, as long as fewer than its
+ *   depth are submitted and not yet collected; the buffer and name of
+ *   a request must stay valid until its completion is collected
+ *
+ * input parameters are a queue, an array of count requests and the
+ *   count
+ *
+ * return value is the number of requests added, from the first on
+ */
 
-        unsigned short byte_offset   = directory[file_descriptor].byte_offset;
-        unsigned char  block_index   = directory[file_descriptor].first_block;
-        unsigned int   bytes_written = 0;
+unsigned int grtfs_submit( grtfs_queue *queue, const struct grtfs_request *requests,
+                unsigned int count ){
+        unsigned int i, n;
+        pthread_mutex_lock( &queue->lock );
+        n = queue->depth - queue->in_flight;
+        if( count < n ) n = count;
+        for( i = 0; i < n; i++ )
+                queue->requests[( queue->request_head + queue->n_requests + i ) % queue->depth] = requests[i];
+        queue->n_requests += n;
+        queue->in_flight += n;
+        if( n > 0 ) pthread_cond_signal( &queue->work );
+        pthread_mutex_unlock( &queue->lock );
+        return( n );
+}
 
-        // intialize first block
-        if( block_index == FREE ){
-                block_index = grtfs_new_block();
-                directory[file_descriptor].first_block = block_index;
-                file_allocation_table[block_index] = LAST_BLOCK;
-        }
+/* tfs_complete()
+ *
+ * collects completions of requests of a queue, waiting until at
+ *   least min of them are done, or all of those submitted and not
+ *   yet collected when fewer; completions come in the order the
+ *   requests finished, which need not be the order of submission
+ *
+ * input parameters are a queue, an array of max completions to fill,
+ *   max and min
+ *
+ * return value is the number of completions collected
+ */
+
+unsigned int grtfs_complete( grtfs_queue *queue, struct grtfs_completion *completions,
+                unsigned int max, unsigned int min ){
+        unsigned int i, n;
+        pthread_mutex_lock( &queue->lock );
+        if( min > max ) min = max;
+        if( min > queue->in_flight ) min = queue->in_flight;
+        while( queue->n_completions < min ) pthread_cond_wait( &queue->done, &queue->lock );
+        n = queue->n_completions < max ? queue->n_completions : max;
+        for( i = 0; i < n; i++ )
+                completions[i] = queue->completions[( queue->completion_head + i ) % queue->depth];
+        queue->completion_head = ( queue->completion_head + n ) % queue->depth;
+        queue->n_completions -= n;
+        queue->in_flight -= n;
+        pthread_mutex_unlock( &queue->lock );
+        return( n );
+}
 
-        // move blocks to reach offset
-        for( int i = 0; i < (byte_offset / BLOCK_SIZE); i++ )
-                append_block_at(&block_index);
+/* tfs_stats()
+ *
+ * copies the counters a context has kept since it was created;
+ *   they are consistent per file and per kind, not across all of
+ *   them, when other threads are using the context
+ *
+ * input parameters are a context and the structure to fill in
+ *
+ * no return value
+ */
 
-        // write
-        for( unsigned int i = 0; i < byte_count; i++ ){
-                unsigned short offset_index = (i + byte_offset) % BLOCK_SIZE;
-                blocks[block_index].bytes[offset_index] = buffer[i];
-                bytes_written++;
+void grtfs_stats( grtfs_ctx *ctx, struct grtfs_stats *stats ){
+        unsigned int a, reason;
+        memset( stats, 0, sizeof( *stats ) );
+        for( a = 0; a <= MAX_OPEN_FILES; a++ ){
+                pthread_rwlock_rdlock( &ctx->files[a].lock );
+                stats->bytes_read += ctx->files[a].bytes_read;
+                stats->bytes_written += ctx->files[a].bytes_written;
+                stats->fat_hops += ctx->files[a].fat_hops;
+                pthread_rwlock_unlock( &ctx->files[a].lock );
+        }
+        pthread_mutex_lock( &ctx->lock );
+        stats->blocks_allocated = ctx->blocks_allocated;
+        stats->blocks_freed = ctx->blocks_freed;
+        stats->allocator_scans = ctx->allocator_scans;
+        stats->allocator_scan_words = ctx->allocator_scan_words;
+        stats->name_lookups = ctx->name_lookups;
+        stats->name_probes = ctx->name_probes;
+        stats->blocks_copied = ctx->blocks_copied;
+        stats->bytes_compressed = ctx->bytes_compressed;
+        stats->blocks_compressed = ctx->blocks_compressed;
+        stats->blocks_deduplicated = ctx->blocks_deduplicated;
+        pthread_mutex_unlock( &ctx->lock );
+        pthread_mutex_lock( &ctx->cache.lock );
+        stats->cache_hits = ctx->cache.hits;
+        stats->cache_misses = ctx->cache.misses;
+        stats->cache_writebacks = ctx->cache.writebacks;
+        pthread_mutex_unlock( &ctx->cache.lock );
+        pthread_mutex_lock( &ctx->commit_lock );
+        stats->syncs = ctx->syncs;
+        stats->commits = ctx->commits;
+        pthread_mutex_unlock( &ctx->commit_lock );
+        stats->requests = __atomic_load_n( &ctx->requests, __ATOMIC_RELAXED );
+        stats->requests_merged = __atomic_load_n( &ctx->requests_merged, __ATOMIC_RELAXED );
+        for( reason = 0; reason < N_CHECKS; reason++ )
+                stats->failed_checks[reason] =
+                        __atomic_load_n( &ctx->failed_checks[reason], __ATOMIC_RELAXED );
+}
 
-                if( i % BLOCK_SIZE == BLOCK_SIZE - 1 ) append_block_at(&block_index);
+// tests an access bit of the active entry having the given name
+unsigned int file_has_access( grtfs_ctx *ctx, char* filename, unsigned int access ){
+        unsigned int fd, a, result;
+        pthread_mutex_lock( &ctx->lock );
+        fd = grtfs_map_name_to_fd( ctx, filename );
+        if( fd == 0 ){
+                pthread_mutex_unlock( &ctx->lock );
+                return( FALSE );
         }
+        a = grtfs_lock_fd( ctx, fd, FALSE );
+        if( a == 0 ) return( FALSE );
+        result = ( strcmp( ctx->directory[a].name, filename ) == 0 ) && ( ctx->directory[a].access & access );
+        pthread_rwlock_unlock( &ctx->files[a].lock );
+        return( result ? TRUE : FALSE );
+}
 
-        directory[file_descriptor].byte_offset = byte_offset + bytes_written;
-        directory[file_descriptor].size += bytes_written;
-        return( bytes_written );
+// toggles an access bit of the active entry having the given name
+void toggle_access( grtfs_ctx *ctx, char* filename, unsigned int access ){
+        unsigned int fd, a = 0;
+        grtfs_begin_change( ctx );
+        pthread_mutex_lock( &ctx->lock );
+        fd = grtfs_map_name_to_fd( ctx, filename );
+        if( fd != 0 ) a = grtfs_lock_fd( ctx, fd, TRUE );
+        else pthread_mutex_unlock( &ctx->lock );
+        if( a != 0 ){
+                if( strcmp( ctx->directory[a].name, filename ) == 0 ) ctx->directory[a].access ^= access;
+                pthread_rwlock_unlock( &ctx->files[a].lock );
+        }
+        grtfs_end_change( ctx );
 }
 
-unsigned int file_is_readable(char* filename){
-        unsigned int fd = grtfs_map_name_to_fd(filename);
-        if( directory[fd].access & READ_ACCESS ) return( TRUE );
-        return( FALSE );
+unsigned int file_is_readable( grtfs_ctx *ctx, char* filename ){
+        return( file_has_access( ctx, filename, READ_ACCESS ) );
 }
 
-unsigned int file_is_writable(char* filename){
-        unsigned int fd = grtfs_map_name_to_fd(filename);
-        if( directory[fd].access & WRITE_ACCESS ) return( TRUE );
-        return( FALSE );
+unsigned int file_is_writable( grtfs_ctx *ctx, char* filename ){
+        return( file_has_access( ctx, filename, WRITE_ACCESS ) );
 }
 
 // toggles read access
-void make_readable(char* filename){
-        unsigned int fd = grtfs_map_name_to_fd(filename);
-        directory[fd].access ^= READ_ACCESS;
+void make_readable( grtfs_ctx *ctx, char* filename ){
+        toggle_access( ctx, filename, READ_ACCESS );
 }
 
 // toggles write access
-void make_writable(char* filename){
-        unsigned int fd = grtfs_map_name_to_fd(filename);
-        directory[fd].access ^= WRITE_ACCESS;
+void make_writable( grtfs_ctx *ctx, char* filename ){
+        toggle_access( ctx, filename, WRITE_ACCESS );
 }
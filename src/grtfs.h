@@ -7,41 +7,117 @@
  * - there is a small, fixed number of file blocks
  * - file blocks are mapped with a file allocation table
  *
- * - the directory occupies the first two file blocks
+ * - the first file block holds a superblock describing the layout
+ *     of the image; its version changes whenever that layout does
+ * - the directory follows the superblock
  * - the directory is single-level, unstructured table
- * - file names are up to 11 characters in length and can contain
+ * - file names are up to 16 characters in length and can contain
  *     alphanumeric characters, underscores, and periods; there
  *     is no additionally defined naming syntax
- * - file descriptors are used as indices into the directory
- * - a file descriptor has a valid range of 1-15 (in most cases
- *     a return value of 0 indicates an error, so a file
- *     descriptor of 0 is not used as a valid index)
+ * - a file descriptor names where a file's directory entry lives:
+ *     1-31 an entry of the directory (in most cases a return value
+ *     of 0 indicates an error, so a file descriptor of 0 is not
+ *     used), and N_DIRECTORY_ENTRIES plus s slot s of the directory
+ *     file; a file keeps its fd, open or closed, until it is
+ *     deleted, after which the fd names no file until a file created
+ *     later is given the same entry
+ * - the directory file holds the files beyond those the directory
+ *     holds, one entry per block; its chain and size in bytes are
+ *     kept in directory entry 0, whose inline data holds a
+ *     directory_header; its entries never move, an unused one is
+ *     taken before the file grows, and the file never shrinks
+ * - names are found through a name index, an open-addressed hash
+ *     table in a chain of blocks of its own, so neither the entries
+ *     of the directory file nor the index are read in full when an
+ *     image is loaded; up to MAX_OPEN_FILES entries are kept in
+ *     memory at once, every open file among them
  * - a starting block of zero means that no file blocks are
  *     allocated to the file
  *
- * - the file allocation table occupies the second two file blocks
- * - a file block number for a file has a valid range of 4-255
+ * - the file allocation table follows the directory, one 32-bit
+ *     entry per block
+ * - a file block number for a file has a valid range of
+ *     first_data_block to n_blocks-1
+ * - files are allocated in runs of contiguous blocks where possible;
+ *     in memory a file's blocks are kept as extents (start block and
+ *     length) derived from its FAT chain, so transfers copy whole runs
+ *     instead of following the FAT one block at a time
+ * - an image file made by tfs_format() has a journal after the file
+ *     allocation table: a sync first writes the changed blocks of
+ *     the directory file and of the name index, the directory and the
+ *     changed FAT blocks there as one checksummed transaction, or as
+ *     several when they do not fit, the last holding the directory
+ *     and the FAT, then in place, and tfs_mount() replays a
+ *     transaction that a crash may have left half written in place;
+ *     syncs that overlap are served by one commit
+ * - files can be sparse: a hole is a run of a file's blocks that
+ *     has no file blocks and reads as zeros; in the FAT chain it is
+ *     one hole record, a block whose entry has HOLE_FLAG set on the
+ *     next index and whose first 4 bytes hold the hole's length in
+ *     blocks
+ * - a clone made by tfs_clone() shares the FAT chain of the file it
+ *     was made from, and both entries have SHARED_BLOCKS set in their
+ *     flags; as each FAT entry leads on to the rest of the chain, two
+ *     chains can only share their ends, so a block of a shared end is
+ *     copied together with the shared blocks before it the first time
+ *     either file changes it; with tfs_set_dedup(), a file being
+ *     closed shares the same way the longest run of last blocks it
+ *     has in common with another file
+ * - a file of up to INLINE_BYTES bytes with no blocks keeps its
+ *     bytes in its directory entry and takes no blocks or FAT
+ *     entries; a closed file whose last block holds up to
+ *     INLINE_BYTES bytes keeps that tail in its directory entry in
+ *     place of the block, and gets a block for it again when
+ *     written; either way the entry has INLINE_DATA set in its flags
+ * - a file made compressed by tfs_set_compression() has COMPRESSED
+ *     set in its flags and keeps its bytes in groups of GROUP_BYTES
+ *     bytes, each a run of contiguous blocks in its FAT chain whose
+ *     first 4 bytes hold the length of the compressed bytes that
+ *     follow, with RAW_GROUP set when they are stored uncompressed
  * - a file size has a valid range of 0-MAX_SIZE (note that for
  *     tfs_size(), a return value > MAX_FILE_SIZE is used to
  *     indicate an error)
  *
  * - a file can only have one open at a time => the current byte
  *     offset (i.e., the file pointer) is placed in the directory
- *     entry instead of in the normal per-open data structure
+ *     entry instead of in the normal per-open data structure;
+ *     tfs_pread() and tfs_pwrite() take an offset instead and leave
+ *     it alone
+ *
+ * - everything about an image lives in a context that is passed to
+ *     every call, so several images can be used at once and one
+ *     image can be used from several threads (see tfs_ctx_new())
+ *
+ * - calls can also be queued, to be run by a pool of worker threads
+ *     that merges transfers to adjacent bytes of a file (see
+ *     tfs_queue_new())
+ *
+ * - bytes of a file can be looked at in place, without copying them,
+ *     through a view that pins them until released (see tfs_view())
  *
  * - there are no file permissions and no permission checking
  *
- * mapping of 256 x 128 byte file blocks:
- * 0 - 1:   directory, 16 entries x 16 bytes each, fd of 0 unused
- * 2 - 3:   file allocation table, 256 entries x 1 byte each,
- *            0-3 not used as valid blocks, 0 == free, 1 == end
- * 4 - 255: file blocks containing file data
+ * mapping of n_blocks x 128 byte file blocks (N_BLOCKS by default):
+ * 0:                  superblock
+ * directory_block:    directory, 32 entries x 128 bytes each, entry 0
+ *                       describing the directory file and the name
+ *                       index
+ * fat_block:          file allocation table, n_blocks entries x 4
+ *                       bytes each, 0 == free, 1 == end, HOLE_FLAG
+ *                       set on a hole record
+ * journal_block:      journal of an image file, journal_blocks
+ *                       blocks, JOURNAL_SPARE_BLOCKS more than the
+ *                       directory and FAT take, none in an image
+ *                       made by tfs_init()
+ * first_data_block -: file blocks containing file data
  *
- * a directory entry is 16 bytes (12 bytes for name string)
- * +--------+--------+--------+--------+--------------...--+
- * | status | first_ |  size  |  byte_ |      name         |
- * |        | block  |        | offset |                   |
- * +--------+--------+--------+--------+--------------...--+
+ * a directory entry is 128 bytes (20 bytes for name string, 92 for
+ *   inline data)
+ * +--------+--------+-------+--------+--------+--------+---...--+---...--+
+ * | status | access | flags | first_ |  size  |  byte_ |  name  |  data  |
+ * |        |        |       | block  |        | offset |        |        |
+ * +--------+--------+-------+--------+--------+--------+---...--+---...--+
+ *    1        1        2        4        4        4       20       92
  */
 #ifndef __GRTFS_H__
 #define __GRTFS_H__
@@ -49,19 +125,33 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 
 /* defined sizes and limits */
 
 #define N_DIRECTORY_ENTRIES 32
 #define N_BLOCKS 4096
+#define MAX_BLOCKS (1<<24)
 #define BLOCK_SIZE 128
 #define BLOCK_SIZE_AS_POWER_OF_2 7
 #define N_BYTES (N_BLOCKS*BLOCK_SIZE)
-#define MAX_FILE_SIZE ((N_BLOCKS-8)*BLOCK_SIZE)
+#define MAX_FILE_SIZE ((MAX_BLOCKS-1)*BLOCK_SIZE)
 #define FILENAME_LENGTH 16
+#define INLINE_BYTES 92
+#define GROUP_BLOCKS 32
+#define GROUP_BYTES (GROUP_BLOCKS*BLOCK_SIZE)
 #define FIRST_VALID_FD 1
-#define FIRST_VALID_BLOCK 8
+#define MAX_OPEN_FILES 1024
+
+
+/* on-image layout */
+
+#define GRTFS_MAGIC 0x53465447 /* "GTFS" */
+#define GRTFS_VERSION 9
+#define GRTFS_JOURNAL_MAGIC 0x4E4A5447 /* "GTJN" */
+#define JOURNAL_SPARE_BLOCKS 1024 /* journal blocks beyond the metadata, for blocks of the directory file and the name index */
 
 
 /* directory entry status */
@@ -75,6 +165,8 @@
 
 #define FREE 0
 #define LAST_BLOCK 1
+#define HOLE_FLAG 0x80000000u
+#define RAW_GROUP 0x80000000u
 
 
 /* logical values */
@@ -88,71 +180,471 @@
 #define READ_ACCESS 1
 #define WRITE_ACCESS 2
 
+
+/* directory entry flags */
+
+#define SHARED_BLOCKS 0x0001
+#define INLINE_DATA 0x0002
+#define COMPRESSED 0x0004
+
+/* reasons a check fails, indexing grtfs_stats.failed_checks */
+
+#define CHECK_FD_RANGE 0
+#define CHECK_BLOCK_RANGE 1
+#define CHECK_NOT_OPEN 2
+#define CHECK_NAME 3
+#define CHECK_ACCESS 4
+#define CHECK_STALE_FD 5
+#define N_CHECKS 6
+
+/* operations of a queued request */
+
+#define GRTFS_OP_READ 0
+#define GRTFS_OP_WRITE 1
+#define GRTFS_OP_CREATE 2
+#define GRTFS_OP_DELETE 3
+
 /* struct declarations and pointers */
 
 struct file_block{
   char bytes[BLOCK_SIZE];
 };
 
+struct superblock{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t n_blocks;
+  uint32_t n_directory_entries;
+  uint32_t directory_block;
+  uint32_t fat_block;
+  uint32_t first_data_block;
+  uint32_t journal_block;
+  uint32_t journal_blocks;
+};
+
+/* first block of the journal: a transaction of count blocks follows
+ *   it as the home block numbers of the count blocks, padded to a
+ *   whole block, and then their contents; checksum is that of the
+ *   header, taken as 0, and everything after it */
+
+struct journal_header{
+  uint32_t magic;
+  uint32_t sequence;
+  uint32_t count;
+  uint32_t checksum;
+};
+
+/* inline data of entry 0 of the directory: the name index is a chain
+ *   of index_buckets / NAME_BUCKETS_PER_BLOCK blocks from index_block
+ *   on holding index_buckets name_buckets, a power of 2, names of them
+ *   used; free_slot is the fd of the first unused entry of the
+ *   directory file whose block was used before, 0 when none, each
+ *   holding the fd of the next in its first_block; used_slots counts
+ *   the entries of the directory file ever used, and shared_files the
+ *   files having SHARED_BLOCKS set */
+
+struct directory_header{
+  uint32_t index_block;
+  uint32_t index_buckets;
+  uint32_t names;
+  uint32_t free_slot;
+  uint32_t used_slots;
+  uint32_t shared_files;
+};
+
+/* bucket of the name index: the file at fd, when fd is not 0, has a
+ *   name of hash hash */
+
+struct name_bucket{
+  uint32_t hash;
+  uint32_t fd;
+};
+
+#define NAME_BUCKETS_PER_BLOCK ( BLOCK_SIZE / sizeof( struct name_bucket ) )
+
 struct directory_entry{
-  unsigned char status;
-  unsigned char first_block;
-  unsigned short size;
-  unsigned short byte_offset;
-  char name[FILENAME_LENGTH + 1];
-  unsigned char access;
+  uint8_t status;
+  uint8_t access;
+  uint16_t flags;
+  uint32_t first_block;
+  uint32_t size;
+  uint32_t byte_offset;
+  char name[FILENAME_LENGTH + 4];
+  char data[INLINE_BYTES];
+};
+
+
+/* counters returned by grtfs_stats(); allocator_scan_words counts the
+ *   free block summary words examined by allocator_scans allocation
+ *   attempts, and name_probes the name index slots examined by
+ *   name_lookups lookups; the cache counters count pages of the block
+ *   cache of a mounted image, commits the commits that served
+ *   syncs syncs of it, requests_merged the queued requests run as
+ *   part of a transfer of an earlier request, blocks_copied the
+ *   blocks copied because a clone or a snapshot shared them,
+ *   blocks_compressed the blocks written to hold bytes_compressed
+ *   bytes of compressed files, and blocks_deduplicated the blocks
+ *   given back by files sharing them with others that hold the same
+ *   bytes */
+
+struct grtfs_stats{
+  unsigned long bytes_read;
+  unsigned long bytes_written;
+  unsigned long fat_hops;
+  unsigned long blocks_allocated;
+  unsigned long blocks_freed;
+  unsigned long allocator_scans;
+  unsigned long allocator_scan_words;
+  unsigned long name_lookups;
+  unsigned long name_probes;
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+  unsigned long cache_writebacks;
+  unsigned long syncs;
+  unsigned long commits;
+  unsigned long requests;
+  unsigned long requests_merged;
+  unsigned long blocks_copied;
+  unsigned long bytes_compressed;
+  unsigned long blocks_compressed;
+  unsigned long blocks_deduplicated;
+  unsigned long failed_checks[N_CHECKS];
 };
 
 
+/* filled in by grtfs_frag_report(); fragments counts the runs of
+ *   blocks holding the data of the files, at least one per stretch of
+ *   data between holes of a file, and fragmented_files the files that
+ *   have more; largest_free_run is the length of the longest run of
+ *   free blocks; grtfs_fragments() gives the runs of one file */
+
+struct grtfs_frag_report{
+  unsigned long fragments;
+  unsigned int files;
+  unsigned int fragmented_files;
+  unsigned int free_blocks;
+  unsigned int largest_free_run;
+};
+
+
+/* a request for tfs_submit(): op is one of GRTFS_OP_*; a read or
+ *   write transfers byte_count bytes between buffer and the file at
+ *   file_descriptor from offset, as tfs_pread() and tfs_pwrite() do,
+ *   a create creates name and a delete deletes file_descriptor;
+ *   user_data is handed back with its completion */
+
+struct grtfs_request{
+  unsigned int op;
+  unsigned int file_descriptor;
+  char *buffer;
+  unsigned int byte_count;
+  unsigned int offset;
+  char *name;
+  void *user_data;
+};
+
+/* the completion of a request: result is what the call would have
+ *   returned */
+
+struct grtfs_completion{
+  void *user_data;
+  unsigned int op;
+  unsigned int result;
+};
+
+
+/* a file system context holding one image; defined in grtfs.c */
+
+typedef struct grtfs_ctx grtfs_ctx;
+
+/* a request queue and its worker threads; defined in grtfs.c */
+
+typedef struct grtfs_queue grtfs_queue;
+
+/* a frozen copy of the directory and FAT of a context; defined in
+ *   grtfs.c */
+
+typedef struct grtfs_snapshot grtfs_snapshot;
+
+
 /* public interface */
 
-void grtfs_init();
+grtfs_ctx *grtfs_ctx_new();
+
+void grtfs_ctx_free( grtfs_ctx *ctx );
+
+void grtfs_init( grtfs_ctx *ctx );
+
+unsigned int grtfs_init_blocks( grtfs_ctx *ctx, unsigned int n_blocks );
+
+unsigned int grtfs_format( char *path, unsigned int n_blocks );
+
+unsigned int grtfs_mount(  grtfs_ctx *ctx, char *path );
+
+unsigned int grtfs_sync(   grtfs_ctx *ctx );
+
+unsigned int grtfs_unmount( grtfs_ctx *ctx );
+
+void grtfs_set_cache_size( grtfs_ctx *ctx, size_t bytes );
+
+void grtfs_set_journal( grtfs_ctx *ctx, unsigned int on );
 
-void grtfs_list_blocks();
+void grtfs_set_dedup( grtfs_ctx *ctx, unsigned int on );
 
-void grtfs_list_directory();
+void grtfs_list_blocks( grtfs_ctx *ctx );
 
-unsigned int grtfs_create( char *name );
+void grtfs_list_directory( grtfs_ctx *ctx );
 
-unsigned int grtfs_exists( char *name );
+unsigned int grtfs_create( grtfs_ctx *ctx, char *name );
 
-unsigned int grtfs_open(   char *name );
+unsigned int grtfs_create_many( grtfs_ctx *ctx, char **names, unsigned int count,
+                         unsigned int *file_descriptors );
 
-unsigned int grtfs_size(   unsigned int file_descriptor );
+unsigned int grtfs_clone( grtfs_ctx *ctx, unsigned int file_descriptor, char *name );
 
-unsigned int grtfs_seek(   unsigned int file_descriptor,
+unsigned int grtfs_exists( grtfs_ctx *ctx, char *name );
+
+unsigned int grtfs_open(   grtfs_ctx *ctx, char *name );
+
+unsigned int grtfs_size(   grtfs_ctx *ctx, unsigned int file_descriptor );
+
+unsigned int grtfs_seek(   grtfs_ctx *ctx, unsigned int file_descriptor,
                          unsigned int offset );
 
-unsigned int grtfs_read(   unsigned int file_descriptor,
+unsigned int grtfs_read(   grtfs_ctx *ctx, unsigned int file_descriptor,
                          char *buffer,
                          unsigned int byte_count );
 
-unsigned int grtfs_write(  unsigned int file_descriptor,
+unsigned int grtfs_write(  grtfs_ctx *ctx, unsigned int file_descriptor,
                          char *buffer,
                          unsigned int byte_count );
 
-unsigned int grtfs_close(  unsigned int file_descriptor );
+unsigned int grtfs_pread(  grtfs_ctx *ctx, unsigned int file_descriptor,
+                         char *buffer,
+                         unsigned int byte_count,
+                         unsigned int offset );
+
+unsigned int grtfs_view(   grtfs_ctx *ctx, unsigned int file_descriptor,
+                         unsigned int offset, unsigned int byte_count,
+                         struct iovec *spans, unsigned int max_spans,
+                         unsigned int *n_spans );
+
+void grtfs_unview( grtfs_ctx *ctx, unsigned int file_descriptor,
+                         const struct iovec *spans, unsigned int n_spans );
+
+unsigned int grtfs_pwrite( grtfs_ctx *ctx, unsigned int file_descriptor,
+                         char *buffer,
+                         unsigned int byte_count,
+                         unsigned int offset );
+
+unsigned int grtfs_readv(  grtfs_ctx *ctx, unsigned int file_descriptor,
+                         const struct iovec *iov,
+                         unsigned int iovcnt );
+
+unsigned int grtfs_writev( grtfs_ctx *ctx, unsigned int file_descriptor,
+                         const struct iovec *iov,
+                         unsigned int iovcnt );
+
+unsigned int grtfs_truncate( grtfs_ctx *ctx, unsigned int file_descriptor,
+                         unsigned int size );
+
+unsigned int grtfs_fallocate( grtfs_ctx *ctx, unsigned int file_descriptor,
+                         unsigned int size );
+
+unsigned int grtfs_set_compression( grtfs_ctx *ctx, unsigned int file_descriptor,
+                         unsigned int on );
+
+unsigned int grtfs_close(  grtfs_ctx *ctx, unsigned int file_descriptor );
+
+unsigned int grtfs_rename( grtfs_ctx *ctx, unsigned int file_descriptor,
+                         char *name );
+
+unsigned int grtfs_delete( grtfs_ctx *ctx, unsigned int file_descriptor );
+
+unsigned int grtfs_delete_many( grtfs_ctx *ctx, unsigned int *file_descriptors,
+                         unsigned int count, unsigned int *results );
+
+unsigned int grtfs_defrag( grtfs_ctx *ctx, unsigned int budget );
+
+void grtfs_frag_report( grtfs_ctx *ctx, struct grtfs_frag_report *report );
+
+unsigned int grtfs_fragments( grtfs_ctx *ctx, unsigned int file_descriptor );
+
+grtfs_snapshot *grtfs_snapshot_new( grtfs_ctx *ctx );
+
+unsigned int grtfs_snapshot_save( grtfs_snapshot *snapshot, char *path );
+
+unsigned int grtfs_snapshot_restore( grtfs_snapshot *snapshot );
+
+void grtfs_snapshot_free( grtfs_snapshot *snapshot );
+
+grtfs_queue *grtfs_queue_new( grtfs_ctx *ctx, unsigned int depth, unsigned int n_workers );
+
+void grtfs_queue_free( grtfs_queue *queue );
+
+unsigned int grtfs_submit( grtfs_queue *queue, const struct grtfs_request *requests,
+                         unsigned int count );
+
+unsigned int grtfs_complete( grtfs_queue *queue, struct grtfs_completion *completions,
+                         unsigned int max, unsigned int min );
 
-unsigned int grtfs_delete( unsigned int file_descriptor );
+void grtfs_stats( grtfs_ctx *ctx, struct grtfs_stats *stats );
 
-unsigned int file_is_readable( char* name );
+unsigned int file_is_readable( grtfs_ctx *ctx, char* name );
 
-unsigned int file_is_writable( char* name );
+unsigned int file_is_writable( grtfs_ctx *ctx, char* name );
 
-void make_readable( char* name );
+void make_readable( grtfs_ctx *ctx, char* name );
 
-void make_writable( char* name );
+void make_writable( grtfs_ctx *ctx, char* name );
 
 
 /* helper functions */
 
-unsigned int grtfs_check_fd_in_range( unsigned int fd );
-unsigned int grtfs_check_block_in_range( unsigned int b );
-unsigned int grtfs_check_file_is_open( unsigned int fd );
-unsigned int grtfs_check_valid_name( char *name );
-unsigned int grtfs_size( unsigned int file_descriptor );
-unsigned int grtfs_new_directory_entry();
-unsigned int grtfs_map_name_to_fd( char *name );
-unsigned int grtfs_new_block();
+struct chain_map;
+struct meta_block;
+
+void grtfs_check_failed( grtfs_ctx *ctx, unsigned int reason );
+unsigned int grtfs_check_fd_in_range( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_check_block_in_range( grtfs_ctx *ctx, unsigned int b );
+unsigned int grtfs_check_file_is_open( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_check_file_is_writable( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_check_valid_name( grtfs_ctx *ctx, char *name );
+unsigned int grtfs_layout( struct superblock *sb, unsigned int n_blocks, unsigned int journal );
+unsigned int grtfs_attach_image( grtfs_ctx *ctx, char *image );
+unsigned int grtfs_load_directory( grtfs_ctx *ctx );
+void grtfs_release_image( grtfs_ctx *ctx );
+void grtfs_reset_file_state( grtfs_ctx *ctx, unsigned int fd );
+void grtfs_set_fat( grtfs_ctx *ctx, unsigned int b, unsigned int next );
+unsigned int grtfs_flush_directory( grtfs_ctx *ctx );
+unsigned int grtfs_flush_fat( grtfs_ctx *ctx );
+unsigned int grtfs_flush_overlay( grtfs_ctx *ctx );
+unsigned int grtfs_write_home( grtfs_ctx *ctx, char *bytes, unsigned int b, unsigned int count );
+void grtfs_begin_change( grtfs_ctx *ctx );
+void grtfs_end_change( grtfs_ctx *ctx );
+unsigned int grtfs_lock_unpinned( grtfs_ctx *ctx, unsigned int file_descriptor );
+unsigned int grtfs_file_pins( grtfs_ctx *ctx, unsigned int fd );
+uint32_t grtfs_checksum( const char *bytes, size_t length );
+unsigned int grtfs_write_journal( grtfs_ctx *ctx );
+unsigned int grtfs_write_transaction( grtfs_ctx *ctx, uint32_t *list, char *images, unsigned int count );
+unsigned int grtfs_journal_capacity( struct superblock *sb );
+unsigned int grtfs_replay_journal( int file, struct superblock *sb, uint32_t *sequence );
+unsigned int grtfs_clear_journal( int file, struct superblock *sb );
+unsigned int grtfs_commit( grtfs_ctx *ctx );
+unsigned int grtfs_cache_init( grtfs_ctx *ctx );
+void grtfs_cache_free( grtfs_ctx *ctx );
+unsigned int grtfs_cache_write_pages( grtfs_ctx *ctx, int *pages, unsigned int count );
+void grtfs_cache_touch( grtfs_ctx *ctx, int p );
+int grtfs_cache_page( grtfs_ctx *ctx, unsigned int number, unsigned int overwrite );
+unsigned int grtfs_cache_copy( grtfs_ctx *ctx, unsigned int b, unsigned int offset, char *buffer, unsigned int length, unsigned int write );
+int grtfs_compare_keys( const void *a, const void *b );
+unsigned int grtfs_cache_flush( grtfs_ctx *ctx );
+unsigned int grtfs_cache_flush_run( grtfs_ctx *ctx, unsigned int b, unsigned int count );
+unsigned int grtfs_cache_flush_file( grtfs_ctx *ctx, unsigned int fd );
+struct directory_header *grtfs_directory_header( grtfs_ctx *ctx );
+struct meta_block *grtfs_find_meta( grtfs_ctx *ctx, unsigned int b );
+char *grtfs_read_meta( grtfs_ctx *ctx, unsigned int b, char *buffer );
+char *grtfs_change_meta( grtfs_ctx *ctx, unsigned int b, unsigned int fresh );
+void grtfs_drop_meta( grtfs_ctx *ctx, unsigned int b );
+void grtfs_purge_overlay( grtfs_ctx *ctx, unsigned int all );
+int grtfs_compare_meta( const void *a, const void *b );
+unsigned int grtfs_dirty_meta( grtfs_ctx *ctx );
+unsigned int grtfs_copy_overlay( grtfs_ctx *ctx, uint32_t *list, char *images, unsigned int count );
+void grtfs_redirty_overlay( grtfs_ctx *ctx, uint32_t *list, unsigned int count );
+void grtfs_limit_overlay( grtfs_ctx *ctx );
+unsigned int grtfs_chain_reserve( struct chain_map *map, unsigned int count );
+void grtfs_chain_append( struct chain_map *map, unsigned int b );
+unsigned int grtfs_chain_block( grtfs_ctx *ctx, struct chain_map *map, unsigned int first, unsigned int logical );
+unsigned int grtfs_new_chain( grtfs_ctx *ctx, struct chain_map *map, unsigned int *first, unsigned int last, unsigned int n );
+void grtfs_release_chain( grtfs_ctx *ctx, struct chain_map *map, unsigned int first, unsigned int n );
+void grtfs_free_released( grtfs_ctx *ctx, uint32_t *released, unsigned int count );
+void grtfs_keep_released( grtfs_ctx *ctx, uint32_t *released, unsigned int count );
+struct directory_entry *grtfs_home_entry( grtfs_ctx *ctx, unsigned int fd, struct directory_entry *buffer );
+unsigned int grtfs_write_entry( grtfs_ctx *ctx, unsigned int fd, struct directory_entry *entry );
+struct directory_entry *grtfs_read_entry( grtfs_ctx *ctx, unsigned int fd, struct directory_entry *buffer );
+unsigned int grtfs_grow_directory( grtfs_ctx *ctx );
+unsigned int grtfs_new_home( grtfs_ctx *ctx );
+void grtfs_free_home( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_find_active( grtfs_ctx *ctx, unsigned int fd );
+void grtfs_insert_active( grtfs_ctx *ctx, unsigned int a );
+void grtfs_remove_active( grtfs_ctx *ctx, unsigned int a );
+void grtfs_lru_remove( grtfs_ctx *ctx, unsigned int a );
+void grtfs_lru_append( grtfs_ctx *ctx, unsigned int a );
+void grtfs_reset_active( grtfs_ctx *ctx );
+unsigned int grtfs_store_entry( grtfs_ctx *ctx, unsigned int a );
+unsigned int grtfs_store_entries( grtfs_ctx *ctx );
+unsigned int grtfs_new_active( grtfs_ctx *ctx );
+unsigned int grtfs_activate( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_lock_fd( grtfs_ctx *ctx, unsigned int fd, unsigned int write );
+unsigned int grtfs_lock_file( grtfs_ctx *ctx, unsigned int file_descriptor, unsigned int write );
+unsigned int grtfs_new_file( grtfs_ctx *ctx, char *name );
+void grtfs_release_directory_entry( grtfs_ctx *ctx, unsigned int a );
+unsigned int grtfs_map_name_to_fd( grtfs_ctx *ctx, char *name );
+unsigned int grtfs_name_hash( char *name );
+struct name_bucket *grtfs_name_bucket( grtfs_ctx *ctx, struct chain_map *map, unsigned int first, unsigned int i, unsigned int change, struct name_bucket *buffer );
+unsigned int grtfs_insert_bucket( grtfs_ctx *ctx, struct chain_map *map, unsigned int first, unsigned int mask, uint32_t hash, unsigned int fd );
+unsigned int grtfs_lookup_name( grtfs_ctx *ctx, char *name );
+unsigned int grtfs_index_name( grtfs_ctx *ctx, unsigned int fd, char *name );
+void grtfs_unindex_name( grtfs_ctx *ctx, unsigned int fd, char *name );
+unsigned int grtfs_reserve_name( grtfs_ctx *ctx );
+int grtfs_compare_fds( const void *a, const void *b );
+unsigned int grtfs_home_used( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_chain_fragments( grtfs_ctx *ctx, struct directory_entry *entry, unsigned int *joinable );
+void grtfs_scan_fat( grtfs_ctx *ctx, unsigned int s );
+unsigned int grtfs_new_block( grtfs_ctx *ctx );
+void grtfs_mark_free( grtfs_ctx *ctx, unsigned int b );
+void grtfs_free_block( grtfs_ctx *ctx, unsigned int b );
+unsigned int grtfs_next_free( grtfs_ctx *ctx, unsigned int b );
+unsigned int grtfs_run_length( grtfs_ctx *ctx, unsigned int b, unsigned int max );
+void grtfs_mark_used( grtfs_ctx *ctx, unsigned int b, unsigned int length );
+unsigned int grtfs_find_run( grtfs_ctx *ctx, unsigned int want, unsigned int limit, unsigned int *length );
+unsigned int grtfs_new_run( grtfs_ctx *ctx, unsigned int goal, unsigned int want, unsigned int *length );
+unsigned int grtfs_copy_blocks( grtfs_ctx *ctx, unsigned int b, unsigned int offset, char *buffer, unsigned int length, unsigned int write );
+unsigned int grtfs_map_append( grtfs_ctx *ctx, unsigned int fd, unsigned int block, unsigned int length, unsigned int hole );
+unsigned int grtfs_map_splice( grtfs_ctx *ctx, unsigned int fd, unsigned int e, unsigned int n );
+unsigned int grtfs_map_file( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_map_shared( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_find_extent( grtfs_ctx *ctx, unsigned int fd, unsigned int logical );
+unsigned int grtfs_unshare( grtfs_ctx *ctx, unsigned int fd, unsigned int first, unsigned int last );
+unsigned int grtfs_extend_file( grtfs_ctx *ctx, unsigned int fd, unsigned int n_blocks );
+void grtfs_trim_file( grtfs_ctx *ctx, unsigned int fd, unsigned int n_blocks );
+void grtfs_link_extent( grtfs_ctx *ctx, unsigned int fd, unsigned int e, unsigned int next );
+unsigned int grtfs_append_hole( grtfs_ctx *ctx, unsigned int fd, unsigned int n_blocks );
+unsigned int grtfs_split_hole( grtfs_ctx *ctx, unsigned int fd, unsigned int e, unsigned int logical, unsigned int want, unsigned int *run );
+unsigned int grtfs_fill_holes( grtfs_ctx *ctx, unsigned int fd, unsigned int from, unsigned int to );
+unsigned int grtfs_zero_file( grtfs_ctx *ctx, unsigned int fd, unsigned int from, unsigned int to );
+unsigned int grtfs_move_blocks( grtfs_ctx *ctx, unsigned int fd, unsigned int e, unsigned int start, unsigned int n );
+unsigned int grtfs_defrag_file( grtfs_ctx *ctx, unsigned int fd, unsigned int budget );
+unsigned int grtfs_iov_bytes( const struct iovec *iov, unsigned int iovcnt );
+int grtfs_compare_requests( const void *a, const void *b );
+void grtfs_run_batch( grtfs_ctx *ctx, struct grtfs_request *batch, unsigned int *results, unsigned int n );
+void *grtfs_queue_worker( void *arg );
+unsigned int grtfs_copy_file( grtfs_ctx *ctx, unsigned int fd, const struct iovec *iov, unsigned int byte_offset, unsigned int byte_count, unsigned int write );
+unsigned int grtfs_read_file( grtfs_ctx *ctx, unsigned int fd, const struct iovec *iov, unsigned int iovcnt, unsigned int byte_offset, unsigned int advance );
+unsigned int grtfs_write_file( grtfs_ctx *ctx, unsigned int fd, const struct iovec *iov, unsigned int iovcnt, unsigned int byte_offset );
+unsigned int grtfs_write_blocks( grtfs_ctx *ctx, unsigned int fd, const struct iovec *iov, unsigned int byte_offset, unsigned int byte_count );
+unsigned int grtfs_write_inline( grtfs_ctx *ctx, unsigned int fd, const struct iovec *iov, unsigned int byte_offset, unsigned int byte_count );
+unsigned int grtfs_unpack_tail( grtfs_ctx *ctx, unsigned int fd );
+void grtfs_pack_tail( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_map_groups( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_add_group( grtfs_ctx *ctx, unsigned int fd, unsigned int block, unsigned int length );
+unsigned int grtfs_compress( const char *source, unsigned int length, char *destination, unsigned int capacity );
+unsigned int grtfs_emit_sequence( const char *literals, unsigned int n_literals, unsigned int distance, unsigned int match, char *destination, unsigned int capacity, unsigned int *out );
+int grtfs_read_length( const unsigned char *source, unsigned int end, unsigned int *in, unsigned int nibble );
+int grtfs_decompress( const char *source, unsigned int length, char *destination, unsigned int capacity );
+unsigned int grtfs_load_group( grtfs_ctx *ctx, unsigned int fd, unsigned int g );
+unsigned int grtfs_store_group( grtfs_ctx *ctx, unsigned int fd, unsigned int g, const char *data, unsigned int length );
+unsigned int grtfs_copy_groups( grtfs_ctx *ctx, unsigned int file_descriptor, const struct iovec *iov, unsigned int byte_offset, unsigned int byte_count, unsigned int write );
+unsigned int grtfs_truncate_groups( grtfs_ctx *ctx, unsigned int fd, unsigned int size );
+uint32_t grtfs_dedup_hash( const char *bytes, uint32_t next );
+void grtfs_dedup_insert( grtfs_ctx *ctx, uint32_t hash, unsigned int b, unsigned int fd );
+unsigned int grtfs_dedup_match( grtfs_ctx *ctx, unsigned int owner, unsigned int c, const char *bytes, uint32_t next );
+void grtfs_forget_hashes( grtfs_ctx *ctx, unsigned int fd, unsigned int logical );
+void grtfs_dedup_file( grtfs_ctx *ctx, unsigned int fd );
+unsigned int grtfs_transfer( grtfs_ctx *ctx, unsigned int fd, const struct iovec *iov, unsigned int iovcnt, unsigned int offset, unsigned int advance, unsigned int write );
+void grtfs_list_entry( grtfs_ctx *ctx, struct directory_entry *entry );
+unsigned int file_has_access( grtfs_ctx *ctx, char *name, unsigned int access );
+void toggle_access( grtfs_ctx *ctx, char *name, unsigned int access );
 
 #endif //__GRTFS_H__
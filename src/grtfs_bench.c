@@ -0,0 +1,1162 @@
+/* benchmark suite
+ *
+ * every result is one line of whitespace-separated columns, so runs
+ *   of different commits can be diffed or loaded as a table; lines
+ *   starting with # are comments
+ *
+ *   name       what was timed
+ *   ops        operations timed
+ *   ops/s      operations per second
+ *   p50_ns     median latency of one operation
+ *   p99_ns     99th percentile latency of one operation
+ *   MB/s       bytes transferred per second, 0 when nothing is
+ *
+ * operations much shorter than a clock read are timed in batches, and
+ *   a batch's average counts as the latency of each of its operations
+ */
+
+#include "grtfs.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LARGE_IMAGE_BLOCKS ( 64 * 1024 * 1024 / BLOCK_SIZE )
+#define HUGE_IMAGE_BLOCKS ( 1024 * 1024 * 1024 / BLOCK_SIZE )
+#define FILE_SIZE ( 16 * 1024 * 1024 )
+#define MAX_CHUNK ( 1024 * 1024 )
+#define SMALL_CHUNK 1024
+#define MIN_SECONDS 0.25
+#define MAX_SAMPLES ( 1 << 18 )
+#define IMAGE_PATH "out/bench.img"
+#define MAX_THREADS 8
+#define THREAD_FILE_SIZE ( 1024 * 1024 )
+#define THREAD_CHUNK 4096
+#define THREAD_OPS 20000
+#define SPARSE_STRIDE ( 256 * 1024 )
+#define SPARSE_RECORD 4096
+#define LOG_RECORD 4096
+#define DEFRAG_FILES 4
+#define DEFRAG_CHUNK 512
+#define DEFRAG_BUDGET 4096
+#define SYNC_RECORD 4096
+#define SYNC_OPS 200
+#define QUEUE_RECORD 512
+#define QUEUE_DEPTH 256
+#define QUEUE_WORKERS 4
+#define VIEW_CHUNK 65536
+#define MAX_SPANS ( VIEW_CHUNK / BLOCK_SIZE + 2 )
+#define CLONE_RECORD 4096
+#define SMALL_FILE 43
+#define TAIL_FILE 300
+#define COMPRESS_CHUNK 65536
+#define COMPRESS_RECORD 4096
+#define DEDUP_FILE ( 256 * 1024 )
+#define APPEND_RECORD 128
+#define APPEND_OPS 8000
+#define DIRECTORY_IMAGE_BLOCKS ( 2 * 1024 * 1024 )
+#define DIRECTORY_FILES 1000000
+#define DIRECTORY_BATCH 1000
+
+/* latencies of one benchmark: samples[i] is the average latency of the
+ *   operations of the i-th timed batch */
+struct samples{
+        double *ns;
+        unsigned int n;
+        unsigned long ops;
+        double seconds;
+};
+
+static char *buffer;
+static grtfs_ctx *ctx;
+
+/* state of the operation being run */
+static unsigned int op_fd;
+static unsigned int op_chunk;
+static unsigned int op_offset;
+static unsigned int op_files;
+static unsigned int op_seed = 1;
+static unsigned long op_sum;
+
+static double now(){
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+static void samples_init( struct samples *s ){
+        s->ns = malloc( MAX_SAMPLES * sizeof( double ) );
+        s->n = 0;
+        s->ops = 0;
+        s->seconds = 0;
+}
+
+/* adds a batch of ops operations that took seconds */
+static void sample( struct samples *s, double seconds, unsigned int ops ){
+        if( s->n < MAX_SAMPLES ) s->ns[s->n++] = seconds / ops * 1e9;
+        s->ops += ops;
+        s->seconds += seconds;
+}
+
+static int compare_doubles( const void *a, const void *b ){
+        double x = *(const double *) a, y = *(const double *) b;
+        return( ( x > y ) - ( x < y ) );
+}
+
+/* prints the result line of a benchmark moving bytes_per_op bytes per
+ *   operation and frees its samples */
+static void report( char *name, struct samples *s, double bytes_per_op ){
+        double p50 = 0, p99 = 0;
+        if( s->n > 0 ){
+                qsort( s->ns, s->n, sizeof( double ), compare_doubles );
+                p50 = s->ns[s->n / 2];
+                p99 = s->ns[(unsigned long) s->n * 99 / 100];
+        }
+        printf( "%-20s %9lu %12.0f %10.0f %10.0f %10.1f\n", name, s->ops,
+                        s->ops / s->seconds, p50, p99,
+                        bytes_per_op * s->ops / s->seconds / 1e6 );
+        fflush( stdout );
+        free( s->ns );
+}
+
+/* times op in batches of batch calls for at least MIN_SECONDS and
+ *   reports it */
+static void run( char *name, void (*op)(), unsigned int batch, unsigned int bytes_per_op ){
+        struct samples s;
+        unsigned int i;
+        double start;
+        samples_init( &s );
+        while( ( s.seconds < MIN_SECONDS ) && ( s.n < MAX_SAMPLES ) ){
+                start = now();
+                for( i = 0; i < batch; i++ ) op();
+                sample( &s, now() - start, batch );
+        }
+        report( name, &s, bytes_per_op );
+}
+
+/* chunk sized transfers at the stream position, wrapping around to the
+ *   start of the file at its end */
+static void op_sequential_write(){
+        if( op_offset + op_chunk > FILE_SIZE ){
+                grtfs_seek( ctx, op_fd, 0 );
+                op_offset = 0;
+        }
+        op_offset += grtfs_write( ctx, op_fd, buffer, op_chunk );
+}
+
+static void op_sequential_read(){
+        if( op_offset + op_chunk > FILE_SIZE ){
+                grtfs_seek( ctx, op_fd, 0 );
+                op_offset = 0;
+        }
+        op_offset += grtfs_read( ctx, op_fd, buffer, op_chunk );
+}
+
+/* chunk sized transfers at random offsets */
+static void op_random_write(){
+        grtfs_pwrite( ctx, op_fd, buffer, op_chunk, rand_r( &op_seed ) % ( FILE_SIZE - op_chunk ) );
+}
+
+static void op_random_read(){
+        grtfs_pread( ctx, op_fd, buffer, op_chunk, rand_r( &op_seed ) % ( FILE_SIZE - op_chunk ) );
+}
+
+/* a seek to a random offset followed by a short read */
+static void op_seek_read(){
+        grtfs_seek( ctx, op_fd, rand_r( &op_seed ) % ( FILE_SIZE - op_chunk ) );
+        grtfs_read( ctx, op_fd, buffer, op_chunk );
+}
+
+/* creates, closes, opens, closes again and deletes a directory full of
+ *   files, timing each kind of call over the whole directory */
+static void bench_metadata(){
+        struct samples create, open, close, delete;
+        unsigned int fd[N_DIRECTORY_ENTRIES], i, n = N_DIRECTORY_ENTRIES - FIRST_VALID_FD;
+        char names[N_DIRECTORY_ENTRIES][FILENAME_LENGTH + 1];
+        double start;
+
+        grtfs_init( ctx );
+        for( i = 0; i < n; i++ ) sprintf( names[i], "meta%u", i );
+        samples_init( &create );
+        samples_init( &open );
+        samples_init( &close );
+        samples_init( &delete );
+        while( ( create.seconds + open.seconds + close.seconds + delete.seconds < 4 * MIN_SECONDS ) &&
+                        ( create.n < MAX_SAMPLES ) ){
+                start = now();
+                for( i = 0; i < n; i++ ) fd[i] = grtfs_create( ctx, names[i] );
+                sample( &create, now() - start, n );
+                start = now();
+                for( i = 0; i < n; i++ ) grtfs_close( ctx, fd[i] );
+                sample( &close, now() - start, n );
+                start = now();
+                for( i = 0; i < n; i++ ) fd[i] = grtfs_open( ctx, names[i] );
+                sample( &open, now() - start, n );
+                start = now();
+                for( i = 0; i < n; i++ ) grtfs_close( ctx, fd[i] );
+                sample( &close, now() - start, n );
+                start = now();
+                for( i = 0; i < n; i++ ) grtfs_delete( ctx, fd[i] );
+                sample( &delete, now() - start, n );
+        }
+        report( "create", &create, 0 );
+        report( "open", &open, 0 );
+        report( "close", &close, 0 );
+        report( "delete", &delete, 0 );
+}
+
+/* creates and deletes a directory full of files in batches of the
+ *   whole directory */
+static void bench_metadata_batch(){
+        struct samples create, delete;
+        unsigned int fd[N_DIRECTORY_ENTRIES], result[N_DIRECTORY_ENTRIES];
+        unsigned int i, n = N_DIRECTORY_ENTRIES - FIRST_VALID_FD;
+        char names[N_DIRECTORY_ENTRIES][FILENAME_LENGTH + 1], *name[N_DIRECTORY_ENTRIES];
+        double start;
+
+        grtfs_init( ctx );
+        for( i = 0; i < n; i++ ){
+                sprintf( names[i], "meta%u", i );
+                name[i] = names[i];
+        }
+        samples_init( &create );
+        samples_init( &delete );
+        while( ( create.seconds + delete.seconds < 2 * MIN_SECONDS ) && ( create.n < MAX_SAMPLES ) ){
+                start = now();
+                grtfs_create_many( ctx, name, n, fd );
+                sample( &create, now() - start, n );
+                for( i = 0; i < n; i++ ) grtfs_close( ctx, fd[i] );
+                start = now();
+                grtfs_delete_many( ctx, fd, n, result );
+                sample( &delete, now() - start, n );
+        }
+        report( "create_many", &create, 0 );
+        report( "delete_many", &delete, 0 );
+}
+
+/* builds a FILE_SIZE file holding a SPARSE_RECORD record every
+ *   SPARSE_STRIDE bytes, leaving holes between the records or writing
+ *   the zeros between them */
+static void op_sparse_file(){
+        unsigned int fd = grtfs_create( ctx, "sparse" ), offset;
+        for( offset = 0; offset < FILE_SIZE; offset += SPARSE_STRIDE )
+                grtfs_pwrite( ctx, fd, buffer, SPARSE_RECORD, offset );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+}
+
+static void op_dense_file(){
+        unsigned int fd = grtfs_create( ctx, "dense" ), offset;
+        memset( buffer + SPARSE_RECORD, 0, SPARSE_STRIDE - SPARSE_RECORD );
+        for( offset = 0; offset < FILE_SIZE; offset += SPARSE_STRIDE )
+                grtfs_pwrite( ctx, fd, buffer, SPARSE_STRIDE, offset );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+}
+
+/* sparse and dense builds of the same file on the large image, and the
+ *   blocks each takes */
+static void bench_sparse(){
+        struct grtfs_stats before, after;
+        unsigned int fd, offset;
+
+        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+        grtfs_stats( ctx, &before );
+        fd = grtfs_create( ctx, "sparse" );
+        for( offset = 0; offset < FILE_SIZE; offset += SPARSE_STRIDE )
+                grtfs_pwrite( ctx, fd, buffer, SPARSE_RECORD, offset );
+        grtfs_close( ctx, fd );
+        grtfs_stats( ctx, &after );
+        grtfs_delete( ctx, fd );
+        printf( "# sparse file of %u KB: %lu blocks, %u blocks written densely\n",
+                        FILE_SIZE / 1024, after.blocks_allocated - before.blocks_allocated -
+                        ( after.blocks_freed - before.blocks_freed ), FILE_SIZE / BLOCK_SIZE );
+        run( "sparse_build", op_sparse_file, 1, FILE_SIZE );
+        run( "dense_build", op_dense_file, 1, FILE_SIZE );
+}
+
+/* appends LOG_RECORD records to a FILE_SIZE log, timing each append,
+ *   first letting the writes allocate and then with the log reserved
+ *   up front by tfs_fallocate() and its unused tail given back by
+ *   tfs_truncate() */
+static void bench_log(){
+        struct samples plain, reserved;
+        unsigned int fd, offset;
+        double start;
+
+        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+        samples_init( &plain );
+        samples_init( &reserved );
+        while( ( plain.seconds + reserved.seconds < 2 * MIN_SECONDS ) && ( plain.n < MAX_SAMPLES ) ){
+                fd = grtfs_create( ctx, "log" );
+                for( offset = 0; offset < FILE_SIZE; offset += LOG_RECORD ){
+                        start = now();
+                        grtfs_write( ctx, fd, buffer, LOG_RECORD );
+                        sample( &plain, now() - start, 1 );
+                }
+                grtfs_close( ctx, fd );
+                grtfs_delete( ctx, fd );
+
+                fd = grtfs_create( ctx, "log" );
+                grtfs_fallocate( ctx, fd, FILE_SIZE );
+                for( offset = 0; offset < FILE_SIZE; offset += LOG_RECORD ){
+                        start = now();
+                        grtfs_write( ctx, fd, buffer, LOG_RECORD );
+                        sample( &reserved, now() - start, 1 );
+                }
+                grtfs_truncate( ctx, fd, offset );
+                grtfs_close( ctx, fd );
+                grtfs_delete( ctx, fd );
+        }
+        report( "log_append_4096", &plain, LOG_RECORD );
+        report( "log_reserved_4096", &reserved, LOG_RECORD );
+}
+
+/* sequential and random transfers of several sizes, and seeks, on a
+ *   FILE_SIZE file of the large image */
+static void bench_transfers(){
+        static unsigned int sequential[] = { 128, 4096, 65536, MAX_CHUNK };
+        static unsigned int random[] = { 128, 4096, 65536 };
+        char name[32];
+        unsigned int i;
+
+        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+        op_fd = grtfs_create( ctx, "data" );
+        if( grtfs_write( ctx, op_fd, buffer, FILE_SIZE ) != FILE_SIZE ){
+                printf( "# data file does not fit\n" );
+                return;
+        }
+
+        for( i = 0; i < sizeof( sequential ) / sizeof( sequential[0] ); i++ ){
+                op_chunk = sequential[i];
+                grtfs_seek( ctx, op_fd, op_offset = 0 );
+                sprintf( name, "seq_write_%u", op_chunk );
+                run( name, op_sequential_write, op_chunk < SMALL_CHUNK ? 64 : 1, op_chunk );
+                grtfs_seek( ctx, op_fd, op_offset = 0 );
+                sprintf( name, "seq_read_%u", op_chunk );
+                run( name, op_sequential_read, op_chunk < SMALL_CHUNK ? 64 : 1, op_chunk );
+        }
+        for( i = 0; i < sizeof( random ) / sizeof( random[0] ); i++ ){
+                op_chunk = random[i];
+                sprintf( name, "rand_write_%u", op_chunk );
+                run( name, op_random_write, 1, op_chunk );
+                sprintf( name, "rand_read_%u", op_chunk );
+                run( name, op_random_read, 1, op_chunk );
+        }
+        op_chunk = 16;
+        run( "seek_read_16", op_seek_read, 1, op_chunk );
+
+        grtfs_close( ctx, op_fd );
+        grtfs_delete( ctx, op_fd );
+}
+
+/* fills the empty image to capacity through grtfs_new_block, timing
+ *   the allocations of each tenth of the fill separately */
+static void bench_allocation(){
+        struct samples cost[10];
+        unsigned int b, capacity, batch, n, decile, done;
+        char name[32];
+        double start;
+
+        grtfs_init( ctx );
+        for( capacity = 0; grtfs_new_block( ctx ) != 0; capacity++ );
+        for( decile = 0; decile < 10; decile++ ) samples_init( &cost[decile] );
+
+        while( cost[0].seconds * 10 < MIN_SECONDS ){
+                grtfs_init( ctx );
+                for( decile = 0; decile < 10; decile++ ){
+                        n = capacity * ( decile + 1 ) / 10 - capacity * decile / 10;
+                        for( done = 0; done < n; done += batch ){
+                                batch = n - done < 64 ? n - done : 64;
+                                start = now();
+                                for( b = 0; b < batch; b++ ) grtfs_new_block( ctx );
+                                sample( &cost[decile], now() - start, batch );
+                        }
+                }
+        }
+
+        printf( "# allocation of %u blocks, by how full the image is\n", capacity );
+        for( decile = 0; decile < 10; decile++ ){
+                sprintf( name, "alloc_%u-%u%%", decile * 10, decile * 10 + 10 );
+                report( name, &cost[decile], 0 );
+        }
+}
+
+/* startup of an image of n_blocks blocks: tfs_init_blocks() in
+ *   memory, tfs_format() of an image file and tfs_mount() of the
+ *   fresh image; size names the geometry in the result names */
+static void bench_startup( char *size, unsigned int n_blocks ){
+        struct samples s;
+        double start;
+        char name[32];
+
+        samples_init( &s );
+        while( s.seconds < MIN_SECONDS ){
+                start = now();
+                grtfs_init_blocks( ctx, n_blocks );
+                sample( &s, now() - start, 1 );
+        }
+        grtfs_init( ctx );
+        snprintf( name, sizeof( name ), "init_%s", size );
+        report( name, &s, 0 );
+
+        samples_init( &s );
+        while( s.seconds < MIN_SECONDS ){
+                start = now();
+                grtfs_format( IMAGE_PATH, n_blocks );
+                sample( &s, now() - start, 1 );
+        }
+        snprintf( name, sizeof( name ), "format_%s", size );
+        report( name, &s, 0 );
+
+        samples_init( &s );
+        while( s.seconds < MIN_SECONDS ){
+                start = now();
+                grtfs_mount( ctx, IMAGE_PATH );
+                sample( &s, now() - start, 1 );
+                grtfs_unmount( ctx );
+        }
+        unlink( IMAGE_PATH );
+        snprintf( name, sizeof( name ), "mount_%s", size );
+        report( name, &s, 0 );
+}
+
+/* transfers on a FILE_SIZE file of a mounted image whose block cache
+ *   holds a quarter of the file, and the sync writing back the dirty
+ *   blocks they leave */
+static void bench_cached(){
+        struct grtfs_stats before, after;
+        struct samples s;
+        double start;
+
+        grtfs_format( IMAGE_PATH, LARGE_IMAGE_BLOCKS );
+        grtfs_set_cache_size( ctx, FILE_SIZE / 4 );
+        grtfs_mount( ctx, IMAGE_PATH );
+        grtfs_stats( ctx, &before );
+        op_fd = grtfs_create( ctx, "data" );
+        grtfs_write( ctx, op_fd, buffer, FILE_SIZE );
+
+        op_chunk = 65536;
+        grtfs_seek( ctx, op_fd, op_offset = 0 );
+        run( "cached_seq_read_65536", op_sequential_read, 1, op_chunk );
+        op_chunk = 4096;
+        run( "cached_rand_read_4096", op_random_read, 1, op_chunk );
+        run( "cached_rand_write_4096", op_random_write, 1, op_chunk );
+
+        samples_init( &s );
+        start = now();
+        grtfs_sync( ctx );
+        sample( &s, now() - start, 1 );
+        report( "cached_sync", &s, 0 );
+
+        grtfs_stats( ctx, &after );
+        printf( "# cache of %u KB: %lu hits, %lu misses, %lu pages written back\n",
+                        FILE_SIZE / 4 / 1024, after.cache_hits - before.cache_hits,
+                        after.cache_misses - before.cache_misses,
+                        after.cache_writebacks - before.cache_writebacks );
+        grtfs_close( ctx, op_fd );
+        grtfs_delete( ctx, op_fd );
+        grtfs_unmount( ctx );
+        unlink( IMAGE_PATH );
+}
+
+/* sequential reads of one of DEFRAG_FILES FILE_SIZE files of a mounted
+ *   image written side by side DEFRAG_CHUNK bytes at a time, with a
+ *   block cache of a sixteenth of the file, before and after
+ *   tfs_defrag() calls of DEFRAG_BUDGET blocks each */
+static void bench_defrag(){
+        struct grtfs_frag_report frag;
+        struct samples s;
+        unsigned int fds[DEFRAG_FILES], i, offset, moved;
+        char name[16];
+        double start;
+
+        grtfs_format( IMAGE_PATH, HUGE_IMAGE_BLOCKS );
+        grtfs_set_cache_size( ctx, FILE_SIZE / 16 );
+        grtfs_mount( ctx, IMAGE_PATH );
+        for( i = 0; i < DEFRAG_FILES; i++ ){
+                snprintf( name, sizeof( name ), "frag%u", i );
+                fds[i] = grtfs_create( ctx, name );
+        }
+        for( offset = 0; offset < FILE_SIZE; offset += DEFRAG_CHUNK ){
+                for( i = 0; i < DEFRAG_FILES; i++ ) grtfs_write( ctx, fds[i], buffer + offset, DEFRAG_CHUNK );
+        }
+        for( i = 0; i < DEFRAG_FILES; i++ ) grtfs_close( ctx, fds[i] );
+        op_fd = grtfs_open( ctx, "frag0" );
+
+        grtfs_frag_report( ctx, &frag );
+        printf( "# %u files of %u KB written in %u byte chunks: %u runs in the first\n",
+                        DEFRAG_FILES, FILE_SIZE / 1024, DEFRAG_CHUNK, grtfs_fragments( ctx, op_fd ) );
+        op_chunk = 65536;
+        grtfs_seek( ctx, op_fd, op_offset = 0 );
+        run( "frag_seq_read_65536", op_sequential_read, 1, op_chunk );
+
+        samples_init( &s );
+        do{
+                start = now();
+                moved = grtfs_defrag( ctx, DEFRAG_BUDGET );
+                if( moved > 0 ) sample( &s, now() - start, 1 );
+        }while( moved > 0 );
+        report( "defrag_4096", &s, DEFRAG_BUDGET * BLOCK_SIZE );
+
+        grtfs_frag_report( ctx, &frag );
+        printf( "# after defrag: %u runs in the first file, %u fragmented files\n",
+                        grtfs_fragments( ctx, op_fd ), frag.fragmented_files );
+        grtfs_seek( ctx, op_fd, op_offset = 0 );
+        run( "defrag_seq_read_65536", op_sequential_read, 1, op_chunk );
+        grtfs_close( ctx, op_fd );
+        grtfs_unmount( ctx );
+        unlink( IMAGE_PATH );
+}
+
+/* expected content of byte offset of thread t's file */
+static char pattern( unsigned int t, unsigned int offset ){
+        return( (char) ( offset * 31 + t * 7 ) );
+}
+
+struct thread_work{
+        pthread_t thread;
+        unsigned int id;
+        unsigned long bytes;
+        unsigned long errors;
+        struct samples latency;
+};
+
+/* one stress thread: builds its own file chunk by chunk, so threads
+ *   allocate blocks concurrently, then rereads and rewrites random
+ *   chunks, checking every byte read, and finally deletes the file;
+ *   the random reads and writes are timed */
+static void *stress_thread( void *arg ){
+        struct thread_work *work = arg;
+        char name[16], chunk[THREAD_CHUNK];
+        unsigned int fd, i, j, offset, seed = work->id + 1;
+        double start;
+
+        sprintf( name, "t%u", work->id );
+        fd = grtfs_create( ctx, name );
+        for( offset = 0; offset < THREAD_FILE_SIZE; offset += THREAD_CHUNK ){
+                for( j = 0; j < THREAD_CHUNK; j++ ) chunk[j] = pattern( work->id, offset + j );
+                work->bytes += grtfs_write( ctx, fd, chunk, THREAD_CHUNK );
+        }
+
+        for( i = 0; i < THREAD_OPS; i++ ){
+                offset = rand_r( &seed ) % ( THREAD_FILE_SIZE - THREAD_CHUNK );
+                if( i % 4 == 0 ){
+                        for( j = 0; j < THREAD_CHUNK; j++ ) chunk[j] = pattern( work->id, offset + j );
+                        start = now();
+                        work->bytes += grtfs_pwrite( ctx, fd, chunk, THREAD_CHUNK, offset );
+                        sample( &work->latency, now() - start, 1 );
+                }else{
+                        start = now();
+                        work->bytes += grtfs_pread( ctx, fd, chunk, THREAD_CHUNK, offset );
+                        sample( &work->latency, now() - start, 1 );
+                        for( j = 0; j < THREAD_CHUNK; j++ )
+                                if( chunk[j] != pattern( work->id, offset + j ) ) work->errors++;
+                }
+        }
+
+        grtfs_seek( ctx, fd, 0 );
+        for( offset = 0; offset < THREAD_FILE_SIZE; offset += THREAD_CHUNK ){
+                grtfs_read( ctx, fd, chunk, THREAD_CHUNK );
+                for( j = 0; j < THREAD_CHUNK; j++ )
+                        if( chunk[j] != pattern( work->id, offset + j ) ) work->errors++;
+        }
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+        return( NULL );
+}
+
+/* creates a file, writes a SYNC_RECORD record to it, closes it, syncs
+ *   the image and deletes it */
+static void op_close_sync(){
+        unsigned int fd = grtfs_create( ctx, "sync" );
+        grtfs_write( ctx, fd, buffer, SYNC_RECORD );
+        grtfs_close( ctx, fd );
+        grtfs_sync( ctx );
+        grtfs_delete( ctx, fd );
+}
+
+/* one sync thread: SYNC_OPS rounds of op_close_sync() on a file of
+ *   its own, each timed */
+static void *sync_thread( void *arg ){
+        struct thread_work *work = arg;
+        char name[16];
+        unsigned int fd, i;
+        double start;
+
+        sprintf( name, "s%u", work->id );
+        for( i = 0; i < SYNC_OPS; i++ ){
+                start = now();
+                fd = grtfs_create( ctx, name );
+                work->bytes += grtfs_write( ctx, fd, buffer, SYNC_RECORD );
+                grtfs_close( ctx, fd );
+                grtfs_sync( ctx );
+                grtfs_delete( ctx, fd );
+                sample( &work->latency, now() - start, 1 );
+        }
+        return( NULL );
+}
+
+/* closes each followed by a sync of a mounted image, with its metadata
+ *   written in place only or through its journal, from one thread and
+ *   from MAX_THREADS threads at once; the syncs the threads asked for
+ *   and the commits that served them are reported in a comment */
+static void bench_journal( char *mode, unsigned int journal ){
+        struct thread_work work[MAX_THREADS];
+        struct grtfs_stats before, after;
+        struct samples all;
+        unsigned int t, i;
+        unsigned long bytes = 0;
+        char name[32];
+        double start, elapsed;
+
+        grtfs_set_journal( ctx, journal );
+        grtfs_format( IMAGE_PATH, LARGE_IMAGE_BLOCKS );
+        grtfs_mount( ctx, IMAGE_PATH );
+        snprintf( name, sizeof( name ), "close_sync_%s", mode );
+        run( name, op_close_sync, 1, SYNC_RECORD );
+
+        grtfs_stats( ctx, &before );
+        start = now();
+        for( t = 0; t < MAX_THREADS; t++ ){
+                work[t].id = t;
+                work[t].bytes = 0;
+                samples_init( &work[t].latency );
+                pthread_create( &work[t].thread, NULL, sync_thread, &work[t] );
+        }
+        for( t = 0; t < MAX_THREADS; t++ ){
+                pthread_join( work[t].thread, NULL );
+                bytes += work[t].bytes;
+        }
+        elapsed = now() - start;
+        grtfs_stats( ctx, &after );
+        samples_init( &all );
+        for( t = 0; t < MAX_THREADS; t++ ){
+                for( i = 0; i < work[t].latency.n; i++ ) sample( &all, work[t].latency.ns[i] / 1e9, 1 );
+                free( work[t].latency.ns );
+        }
+        all.seconds = elapsed;
+        snprintf( name, sizeof( name ), "close_sync_%s_%u", mode, MAX_THREADS );
+        report( name, &all, (double) bytes / all.ops );
+        printf( "# %s: %lu syncs served by %lu commits\n", name,
+                        after.syncs - before.syncs, after.commits - before.commits );
+
+        grtfs_unmount( ctx );
+        unlink( IMAGE_PATH );
+        grtfs_set_journal( ctx, TRUE );
+}
+
+/* a parser's pass over op_chunk bytes of op_fd from op_offset on,
+ *   counting the newlines in them, copying them into buffer first or
+ *   looking at them in place through a view */
+static unsigned long count_newlines( const char *bytes, size_t length ){
+        const char *end = bytes + length;
+        unsigned long n = 0;
+        while( ( bytes = memchr( bytes, '\n', end - bytes ) ) != NULL ){
+                bytes++;
+                n++;
+        }
+        return( n );
+}
+
+static void op_copy_scan(){
+        unsigned int n = grtfs_pread( ctx, op_fd, buffer, op_chunk, op_offset );
+        op_sum += count_newlines( buffer, n );
+        op_offset = ( op_offset + op_chunk ) % FILE_SIZE;
+}
+
+static void op_view_scan(){
+        struct iovec spans[MAX_SPANS];
+        unsigned int i, n_spans;
+        grtfs_view( ctx, op_fd, op_offset, op_chunk, spans, MAX_SPANS, &n_spans );
+        for( i = 0; i < n_spans; i++ ) op_sum += count_newlines( spans[i].iov_base, spans[i].iov_len );
+        grtfs_unview( ctx, op_fd, spans, n_spans );
+        op_offset = ( op_offset + op_chunk ) % FILE_SIZE;
+}
+
+/* scans of a FILE_SIZE file in VIEW_CHUNK pieces by copy and by view,
+ *   on the large image in memory and on a mounted one whose cache
+ *   holds the whole file */
+static void bench_view(){
+        unsigned int mounted;
+        char name[32];
+
+        op_chunk = VIEW_CHUNK;
+        for( mounted = 0; mounted < 2; mounted++ ){
+                if( mounted ){
+                        grtfs_format( IMAGE_PATH, LARGE_IMAGE_BLOCKS );
+                        grtfs_set_cache_size( ctx, 2 * FILE_SIZE );
+                        grtfs_mount( ctx, IMAGE_PATH );
+                }else{
+                        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+                }
+                op_fd = grtfs_create( ctx, "view" );
+                grtfs_write( ctx, op_fd, buffer, FILE_SIZE );
+                op_offset = 0;
+                snprintf( name, sizeof( name ), "%s_copy_scan_%u", mounted ? "cached" : "mem", VIEW_CHUNK );
+                run( name, op_copy_scan, 1, op_chunk );
+                snprintf( name, sizeof( name ), "%s_view_scan_%u", mounted ? "cached" : "mem", VIEW_CHUNK );
+                run( name, op_view_scan, 1, op_chunk );
+                grtfs_close( ctx, op_fd );
+                grtfs_delete( ctx, op_fd );
+                if( mounted ){
+                        grtfs_unmount( ctx );
+                        unlink( IMAGE_PATH );
+                        grtfs_set_cache_size( ctx, FILE_SIZE / 4 );
+                }
+        }
+        printf( "# view: %lu newlines found\n", op_sum );
+}
+
+/* a SMALL_FILE byte file created, written, closed and deleted, and a
+ *   read of the whole of one */
+static void op_small_file(){
+        unsigned int fd = grtfs_create( ctx, "small" );
+        grtfs_write( ctx, fd, buffer, SMALL_FILE );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+}
+
+static void op_small_read(){
+        grtfs_pread( ctx, op_fd, buffer, SMALL_FILE, 0 );
+}
+
+/* small files, and a directory full of SMALL_FILE and of TAIL_FILE
+ *   byte files, whose blocks are reported in a comment */
+static void bench_small(){
+        struct grtfs_stats before, after;
+        unsigned int fd[N_DIRECTORY_ENTRIES], size, i, n = N_DIRECTORY_ENTRIES - FIRST_VALID_FD;
+        char name[16];
+
+        grtfs_init( ctx );
+        run( "small_file_43", op_small_file, 1, SMALL_FILE );
+        op_fd = grtfs_create( ctx, "small" );
+        grtfs_write( ctx, op_fd, buffer, SMALL_FILE );
+        run( "small_read_43", op_small_read, 64, SMALL_FILE );
+        grtfs_close( ctx, op_fd );
+        grtfs_delete( ctx, op_fd );
+
+        for( size = SMALL_FILE; size <= TAIL_FILE; size += TAIL_FILE - SMALL_FILE ){
+                grtfs_stats( ctx, &before );
+                for( i = 0; i < n; i++ ){
+                        snprintf( name, sizeof( name ), "small%u", i );
+                        fd[i] = grtfs_create( ctx, name );
+                        grtfs_write( ctx, fd[i], buffer, size );
+                        grtfs_close( ctx, fd[i] );
+                }
+                grtfs_stats( ctx, &after );
+                printf( "# %u files of %u bytes: %lu blocks, %u blocks without inline data\n", n, size,
+                                after.blocks_allocated - before.blocks_allocated -
+                                ( after.blocks_freed - before.blocks_freed ),
+                                n * ( ( size + BLOCK_SIZE - 1 ) / BLOCK_SIZE ) );
+                for( i = 0; i < n; i++ ) grtfs_delete( ctx, fd[i] );
+        }
+}
+
+/* a copy of the FILE_SIZE file op_fd made by reading and writing it,
+ *   and a clone of it, each deleted again */
+static void op_file_copy(){
+        unsigned int fd = grtfs_create( ctx, "copy" );
+        grtfs_pread( ctx, op_fd, buffer, FILE_SIZE, 0 );
+        grtfs_write( ctx, fd, buffer, FILE_SIZE );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+}
+
+static void op_file_clone(){
+        unsigned int fd = grtfs_clone( ctx, op_fd, "clone" );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+}
+
+/* a clone of op_fd changed by one CLONE_RECORD write at a random
+ *   offset, which copies the shared blocks up to it */
+static void op_clone_write(){
+        unsigned int fd = grtfs_clone( ctx, op_fd, "clone" );
+        grtfs_pwrite( ctx, fd, buffer, CLONE_RECORD, rand_r( &op_seed ) % ( FILE_SIZE - CLONE_RECORD ) );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+}
+
+static void op_snapshot(){
+        grtfs_snapshot_free( grtfs_snapshot_new( ctx ) );
+}
+
+/* copies and clones of a FILE_SIZE file of the large image, and
+ *   snapshots of the image; the blocks the clone writes copied are
+ *   reported in a comment */
+static void bench_clone(){
+        struct grtfs_stats before, after;
+
+        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+        op_fd = grtfs_create( ctx, "source" );
+        grtfs_write( ctx, op_fd, buffer, FILE_SIZE );
+        run( "file_copy", op_file_copy, 1, FILE_SIZE );
+        run( "file_clone", op_file_clone, 1, FILE_SIZE );
+        grtfs_stats( ctx, &before );
+        run( "clone_write_4096", op_clone_write, 1, CLONE_RECORD );
+        grtfs_stats( ctx, &after );
+        printf( "# clone writes copied %lu blocks\n", after.blocks_copied - before.blocks_copied );
+        run( "snapshot_64m", op_snapshot, 1, 0 );
+        grtfs_close( ctx, op_fd );
+        grtfs_delete( ctx, op_fd );
+}
+
+/* sequential and random transfers of a FILE_SIZE file of a mounted
+ *   image with a block cache of a quarter of the file, not compressed
+ *   and compressed; the blocks the compressed writes took, for the
+ *   repeating bytes of the buffer and for random bytes, are reported
+ *   in a comment */
+static void bench_compress(){
+        static char *kinds[] = { "plain", "compressed" };
+        struct grtfs_stats before, after;
+        unsigned int compressed, i, fd;
+        char name[32], *noise;
+
+        grtfs_format( IMAGE_PATH, LARGE_IMAGE_BLOCKS );
+        grtfs_set_cache_size( ctx, FILE_SIZE / 4 );
+        grtfs_mount( ctx, IMAGE_PATH );
+        for( compressed = 0; compressed < 2; compressed++ ){
+                op_fd = grtfs_create( ctx, "data" );
+                grtfs_set_compression( ctx, op_fd, compressed );
+                op_chunk = COMPRESS_CHUNK;
+                op_offset = 0;
+                sprintf( name, "%s_write_%u", kinds[compressed], op_chunk );
+                run( name, op_sequential_write, 1, op_chunk );
+                grtfs_seek( ctx, op_fd, op_offset = 0 );
+                sprintf( name, "%s_read_%u", kinds[compressed], op_chunk );
+                run( name, op_sequential_read, 1, op_chunk );
+                op_chunk = COMPRESS_RECORD;
+                sprintf( name, "%s_rand_read_%u", kinds[compressed], op_chunk );
+                run( name, op_random_read, 1, op_chunk );
+                sprintf( name, "%s_rand_write_%u", kinds[compressed], op_chunk );
+                run( name, op_random_write, 1, op_chunk );
+                grtfs_close( ctx, op_fd );
+                grtfs_delete( ctx, op_fd );
+        }
+
+        noise = malloc( MAX_CHUNK );
+        for( i = 0; i < MAX_CHUNK; i++ ) noise[i] = rand_r( &op_seed );
+        for( i = 0; i < 2; i++ ){
+                fd = grtfs_create( ctx, "data" );
+                grtfs_set_compression( ctx, fd, TRUE );
+                grtfs_stats( ctx, &before );
+                grtfs_write( ctx, fd, i ? noise : buffer, MAX_CHUNK );
+                grtfs_stats( ctx, &after );
+                printf( "# %u KB of %s bytes compressed into %lu blocks, %u blocks uncompressed\n",
+                                MAX_CHUNK / 1024, i ? "random" : "repeating",
+                                after.blocks_compressed - before.blocks_compressed, MAX_CHUNK / BLOCK_SIZE );
+                grtfs_close( ctx, fd );
+                grtfs_delete( ctx, fd );
+        }
+        free( noise );
+        grtfs_unmount( ctx );
+        unlink( IMAGE_PATH );
+}
+
+/* a DEDUP_FILE byte file created, written, closed and deleted while a
+ *   file of the same bytes exists */
+static void op_dedup_file(){
+        unsigned int fd = grtfs_create( ctx, "copy" );
+        grtfs_write( ctx, fd, buffer, DEDUP_FILE );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+}
+
+/* writing files with and without dedup, a log grown by APPEND_OPS
+ *   rounds of opening it, appending an APPEND_RECORD byte record and
+ *   closing it, each timed, and a directory full of DEDUP_FILE byte
+ *   files that differ only in their first block, whose blocks are
+ *   reported in a comment */
+static void bench_dedup(){
+        struct grtfs_stats before, after;
+        struct samples s;
+        unsigned int fd[N_DIRECTORY_ENTRIES], on, i, n = N_DIRECTORY_ENTRIES - FIRST_VALID_FD;
+        char name[32];
+        double start;
+
+        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+        op_fd = grtfs_create( ctx, "source" );
+        grtfs_write( ctx, op_fd, buffer, DEDUP_FILE );
+        for( on = 0; on < 2; on++ ){
+                grtfs_set_dedup( ctx, on );
+                grtfs_close( ctx, op_fd );
+                run( on ? "dedup_file_on" : "dedup_file_off", op_dedup_file, 1, DEDUP_FILE );
+                op_fd = grtfs_open( ctx, "source" );
+        }
+        grtfs_close( ctx, op_fd );
+        grtfs_delete( ctx, op_fd );
+
+        for( on = 0; on < 2; on++ ){
+                grtfs_set_dedup( ctx, on );
+                op_fd = grtfs_create( ctx, "log" );
+                grtfs_close( ctx, op_fd );
+                samples_init( &s );
+                for( i = 0; i < APPEND_OPS; i++ ){
+                        start = now();
+                        op_fd = grtfs_open( ctx, "log" );
+                        grtfs_pwrite( ctx, op_fd, buffer + i * APPEND_RECORD, APPEND_RECORD, i * APPEND_RECORD );
+                        grtfs_close( ctx, op_fd );
+                        sample( &s, now() - start, 1 );
+                }
+                snprintf( name, sizeof( name ), "append_close_%s", on ? "on" : "off" );
+                report( name, &s, APPEND_RECORD );
+                grtfs_delete( ctx, op_fd );
+        }
+
+        for( on = 0; on < 2; on++ ){
+                grtfs_set_dedup( ctx, on );
+                grtfs_stats( ctx, &before );
+                for( i = 0; i < n; i++ ){
+                        snprintf( name, sizeof( name ), "dedup%u", i );
+                        fd[i] = grtfs_create( ctx, name );
+                        grtfs_write( ctx, fd[i], buffer, DEDUP_FILE );
+                        grtfs_pwrite( ctx, fd[i], name, strlen( name ), 0 );
+                        grtfs_close( ctx, fd[i] );
+                }
+                grtfs_stats( ctx, &after );
+                printf( "# %u files of %u KB, dedup %s: %lu blocks, %u blocks of data\n", n, DEDUP_FILE / 1024,
+                                on ? "on" : "off", after.blocks_allocated - before.blocks_allocated -
+                                ( after.blocks_freed - before.blocks_freed ), n * ( DEDUP_FILE / BLOCK_SIZE ) );
+                for( i = 0; i < n; i++ ) grtfs_delete( ctx, fd[i] );
+        }
+        grtfs_set_dedup( ctx, FALSE );
+}
+
+/* a name of one of the op_files files of the directory benchmark, at
+ *   random */
+static void random_directory_name( char *name ){
+        op_seed = op_seed * 1103515245 + 12345;
+        sprintf( name, "dir%u", ( op_seed >> 8 ) % op_files );
+}
+
+static void op_directory_lookup(){
+        char name[16];
+        random_directory_name( name );
+        op_sum += grtfs_exists( ctx, name );
+}
+
+static void op_directory_open(){
+        char name[16];
+        random_directory_name( name );
+        grtfs_close( ctx, grtfs_open( ctx, name ) );
+}
+
+/* mount of an image saved from the op_files files of the directory
+ *   benchmark, whose directory file and name index are read only as
+ *   names are looked up and files opened, and those lookups and opens
+ *   in the mounted image; the context of the in-memory image is kept
+ *   aside meanwhile */
+static void bench_mount(){
+        grtfs_snapshot *snapshot = grtfs_snapshot_new( ctx );
+        grtfs_ctx *memory = ctx;
+        struct samples s;
+        char name[32];
+        double start;
+
+        if( !snapshot || !grtfs_snapshot_save( snapshot, IMAGE_PATH ) ){
+                printf( "# dir_mount_%uk: image not saved\n", op_files / 1000 );
+                if( snapshot ) grtfs_snapshot_free( snapshot );
+                return;
+        }
+        grtfs_snapshot_free( snapshot );
+        ctx = grtfs_ctx_new();
+        samples_init( &s );
+        while( s.seconds < MIN_SECONDS ){
+                start = now();
+                grtfs_mount( ctx, IMAGE_PATH );
+                sample( &s, now() - start, 1 );
+                grtfs_unmount( ctx );
+        }
+        sprintf( name, "dir_mount_%uk", op_files / 1000 );
+        report( name, &s, 0 );
+
+        grtfs_mount( ctx, IMAGE_PATH );
+        op_sum = 0;
+        sprintf( name, "dir_mount_lookup_%uk", op_files / 1000 );
+        run( name, op_directory_lookup, 64, 0 );
+        sprintf( name, "dir_mount_open_%uk", op_files / 1000 );
+        run( name, op_directory_open, 16, 0 );
+        printf( "# dir_mount_lookup_%uk: %lu of the names found\n", op_files / 1000, op_sum );
+        grtfs_unmount( ctx );
+        grtfs_ctx_free( ctx );
+        ctx = memory;
+        unlink( IMAGE_PATH );
+}
+
+/* a directory of 1K, 100K and DIRECTORY_FILES empty files, all but the
+ *   first few in the directory file: creating and closing them, looking
+ *   names up and opening and closing a file; images of 100K files and
+ *   more are also saved and mounted */
+static void bench_directory(){
+        static const unsigned int files[] = { 1000, 100000, DIRECTORY_FILES };
+        struct samples create;
+        unsigned int i = 0, f, k, n;
+        char name[32];
+        double start;
+
+        grtfs_init_blocks( ctx, DIRECTORY_IMAGE_BLOCKS );
+        for( f = 0; f < sizeof( files ) / sizeof( files[0] ); f++ ){
+                op_files = files[f];
+                samples_init( &create );
+                for( ; i < op_files; i += n ){
+                        n = op_files - i < DIRECTORY_BATCH ? op_files - i : DIRECTORY_BATCH;
+                        start = now();
+                        for( k = 0; k < n; k++ ){
+                                sprintf( name, "dir%u", i + k );
+                                grtfs_close( ctx, grtfs_create( ctx, name ) );
+                        }
+                        sample( &create, now() - start, n );
+                }
+                sprintf( name, "dir_create_%uk", op_files / 1000 );
+                report( name, &create, 0 );
+                op_sum = 0;
+                sprintf( name, "dir_lookup_%uk", op_files / 1000 );
+                run( name, op_directory_lookup, 64, 0 );
+                sprintf( name, "dir_open_%uk", op_files / 1000 );
+                run( name, op_directory_open, 16, 0 );
+                printf( "# dir_lookup_%uk: %lu of the names found\n", op_files / 1000, op_sum );
+                if( op_files >= 100000 ) bench_mount();
+        }
+}
+
+/* bursts of QUEUE_DEPTH adjacent QUEUE_RECORD writes and then reads
+ *   along a FILE_SIZE file of the large image, made one call at a
+ *   time and through a queue of QUEUE_WORKERS workers; a burst counts
+ *   as QUEUE_DEPTH operations, and the requests merged into transfers
+ *   of others are reported in a comment */
+static void bench_queue(){
+        static struct grtfs_request requests[QUEUE_DEPTH];
+        static struct grtfs_completion completions[QUEUE_DEPTH];
+        struct samples serial[2], queued[2];
+        struct grtfs_stats before, after;
+        grtfs_queue *queue;
+        unsigned int fd, write, i, n, offset = 0;
+        double start;
+
+        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+        fd = grtfs_create( ctx, "queue" );
+        grtfs_write( ctx, fd, buffer, FILE_SIZE );
+        queue = grtfs_queue_new( ctx, QUEUE_DEPTH, QUEUE_WORKERS );
+        grtfs_stats( ctx, &before );
+        for( write = 0; write < 2; write++ ){
+                samples_init( &serial[write] );
+                samples_init( &queued[write] );
+        }
+        while( ( serial[1].seconds + queued[1].seconds < 2 * MIN_SECONDS ) && ( serial[1].n < MAX_SAMPLES ) ){
+                for( write = 2; write-- > 0; ){
+                        start = now();
+                        for( i = 0; i < QUEUE_DEPTH; i++ ){
+                                if( write ) grtfs_pwrite( ctx, fd, buffer + offset + i * QUEUE_RECORD,
+                                                QUEUE_RECORD, offset + i * QUEUE_RECORD );
+                                else grtfs_pread( ctx, fd, buffer + offset + i * QUEUE_RECORD,
+                                                QUEUE_RECORD, offset + i * QUEUE_RECORD );
+                        }
+                        sample( &serial[write], now() - start, QUEUE_DEPTH );
+
+                        for( i = 0; i < QUEUE_DEPTH; i++ ){
+                                requests[i].op = write ? GRTFS_OP_WRITE : GRTFS_OP_READ;
+                                requests[i].file_descriptor = fd;
+                                requests[i].buffer = buffer + offset + i * QUEUE_RECORD;
+                                requests[i].byte_count = QUEUE_RECORD;
+                                requests[i].offset = offset + i * QUEUE_RECORD;
+                        }
+                        start = now();
+                        grtfs_submit( queue, requests, QUEUE_DEPTH );
+                        for( n = 0; n < QUEUE_DEPTH; )
+                                n += grtfs_complete( queue, completions, QUEUE_DEPTH, QUEUE_DEPTH - n );
+                        sample( &queued[write], now() - start, QUEUE_DEPTH );
+                }
+                offset = ( offset + QUEUE_DEPTH * QUEUE_RECORD ) % FILE_SIZE;
+        }
+        grtfs_stats( ctx, &after );
+        grtfs_queue_free( queue );
+        grtfs_close( ctx, fd );
+        grtfs_delete( ctx, fd );
+        report( "pwrite_serial_512", &serial[1], QUEUE_RECORD );
+        report( "pwrite_queued_512", &queued[1], QUEUE_RECORD );
+        report( "pread_serial_512", &serial[0], QUEUE_RECORD );
+        report( "pread_queued_512", &queued[0], QUEUE_RECORD );
+        printf( "# queued: %lu requests, %lu merged into transfers of others\n",
+                        after.requests - before.requests, after.requests_merged - before.requests_merged );
+}
+
+/* runs the stress threads on one image for 1, 2, 4 .. MAX_THREADS
+ *   threads; ops/s and MB/s are aggregate over all threads, and the
+ *   integrity errors found and the blocks not free again afterwards
+ *   are reported in a comment */
+static void bench_threads(){
+        struct thread_work work[MAX_THREADS];
+        struct samples all;
+        unsigned int n, t, i, capacity, free_blocks;
+        unsigned long bytes, errors;
+        char name[32];
+        double start, elapsed;
+
+        grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+        for( capacity = 0; grtfs_new_block( ctx ) != 0; capacity++ );
+
+        for( n = 1; n <= MAX_THREADS; n *= 2 ){
+                grtfs_init_blocks( ctx, LARGE_IMAGE_BLOCKS );
+                start = now();
+                for( t = 0; t < n; t++ ){
+                        work[t].id = t;
+                        work[t].bytes = 0;
+                        work[t].errors = 0;
+                        samples_init( &work[t].latency );
+                        pthread_create( &work[t].thread, NULL, stress_thread, &work[t] );
+                }
+                bytes = errors = 0;
+                for( t = 0; t < n; t++ ){
+                        pthread_join( work[t].thread, NULL );
+                        bytes += work[t].bytes;
+                        errors += work[t].errors;
+                }
+                elapsed = now() - start;
+                for( free_blocks = 0; grtfs_new_block( ctx ) != 0; free_blocks++ );
+
+                samples_init( &all );
+                for( t = 0; t < n; t++ ){
+                        for( i = 0; i < work[t].latency.n; i++ ) sample( &all, work[t].latency.ns[i] / 1e9, 1 );
+                        free( work[t].latency.ns );
+                }
+                all.seconds = elapsed;
+                sprintf( name, "threads_%u", n );
+                report( name, &all, (double) bytes / all.ops );
+                printf( "# %s: %lu integrity errors, %u blocks leaked\n", name, errors,
+                                capacity - free_blocks );
+        }
+}
+
+int main(){
+        unsigned int i;
+        buffer = malloc( FILE_SIZE );
+        ctx = grtfs_ctx_new();
+        for( i = 0; i < FILE_SIZE; i++ ) buffer[i] = 'a' + i % 26;
+
+        printf( "# %-18s %9s %12s %10s %10s %10s\n", "name", "ops", "ops/s", "p50_ns", "p99_ns", "MB/s" );
+        bench_metadata();
+        bench_metadata_batch();
+        bench_transfers();
+        bench_allocation();
+        bench_startup( "512k", N_BLOCKS );
+        bench_startup( "64m", LARGE_IMAGE_BLOCKS );
+        bench_startup( "1g", HUGE_IMAGE_BLOCKS );
+        bench_cached();
+        bench_sparse();
+        bench_log();
+        bench_defrag();
+        bench_journal( "plain", FALSE );
+        bench_journal( "journal", TRUE );
+        bench_queue();
+        bench_view();
+        bench_clone();
+        bench_small();
+        bench_compress();
+        bench_dedup();
+        bench_directory();
+        bench_threads();
+
+        grtfs_ctx_free( ctx );
+        return 0;
+}
@@ -5,7 +5,11 @@
 int main(){
         unsigned int fd[32];
         char buffer1[1024], buffer2[1024], buffer3[1024];
-        unsigned int length1, length2, count1, count2, count3;
+        unsigned int length1, length2, count1, count2, count3, reads;
+        char field1[5], field2[11];
+        struct iovec fields[2] = { { field1, 4 }, { field2, 10 } };
+        struct grtfs_stats before, after;
+        grtfs_ctx *ctx, *image;
 
         sprintf( buffer1, "%s",
                         "This is a simple-minded test for the trivial file system code.  " );
@@ -26,317 +30,617 @@ int main(){
         printf( "length of buffer1 is %d\n", length1 );
         printf( "length of buffer2 is %d\n", length2 );
 
-        grtfs_init();
+        ctx = grtfs_ctx_new();
+        grtfs_init( ctx );
 
-        grtfs_list_directory();
+        grtfs_list_directory( ctx );
 
-        fd[0] = grtfs_create( "file.txt" );
+        fd[0] = grtfs_create( ctx, "file.txt" );
         if( fd[0] == 0 ) printf( "first create failed\n" );
 
-        fd[1] = grtfs_create( "my_file" );
+        fd[1] = grtfs_create( ctx, "my_file" );
         if( fd[1] == 0 ) printf( "second create failed\n" );
 
-        grtfs_list_directory();
+        grtfs_list_directory( ctx );
 
-        make_writable( "file.txt" ); // toggle to unwritable
-        grtfs_write( fd[0], buffer1, length1 );
-        make_writable( "file.txt" ); // toggle to writable
+        make_writable( ctx, "file.txt" ); // toggle to unwritable
+        grtfs_write( ctx, fd[0], buffer1, length1 );
+        make_writable( ctx, "file.txt" ); // toggle to writable
 
-        count1 = grtfs_write( fd[0], buffer1, length1 );
+        count1 = grtfs_write( ctx, fd[0], buffer1, length1 );
         printf( "%d bytes written to first file\n", count1 );
 
-        count2 = grtfs_write( fd[1], buffer2, length2 );
+        count2 = grtfs_write( ctx, fd[1], buffer2, length2 );
         printf( "%d bytes written to second file\n", count2 );
 
-        count1 = grtfs_write( fd[0], buffer1, length1 );
+        count1 = grtfs_write( ctx, fd[0], buffer1, length1 );
         printf( "%d bytes written to first file\n", count1 );
 
-        grtfs_close( fd[1] );
+        grtfs_close( ctx, fd[1] );
 
-        grtfs_list_directory();
-        grtfs_list_blocks();
+        grtfs_list_directory( ctx );
+        grtfs_list_blocks( ctx );
 
-        make_readable( "file.txt" ); // toggle to unreadable
-        grtfs_read( fd[0], buffer3, 640 );
-        make_readable( "file.txt" ); // toggle to readable
+        make_readable( ctx, "file.txt" ); // toggle to unreadable
+        grtfs_read( ctx, fd[0], buffer3, 640 );
+        make_readable( ctx, "file.txt" ); // toggle to readable
 
-        grtfs_seek( fd[0], 600 );
-        count3 = grtfs_read( fd[0], buffer3, 640 );
+        grtfs_seek( ctx, fd[0], 600 );
+        count3 = grtfs_read( ctx, fd[0], buffer3, 640 );
         printf( "%d bytes read from first file\n", count3 );
         buffer3[count3] = '\0';
         printf( "[%s]\n", buffer3 );
 
-        grtfs_seek( fd[0], 250 );
-        count3 = grtfs_read( fd[0], buffer3, 20 );
+        grtfs_seek( ctx, fd[0], 250 );
+        count3 = grtfs_read( ctx, fd[0], buffer3, 20 );
         printf( "%d bytes read from first file\n", count3 );
         buffer3[count3] = '\0';
         printf( "[%s]\n", buffer3 );
 
-        fd[2] = grtfs_create( "file.txt" );
-        printf( "fd for creating a file with identical name" );
-        printf( " as existing file - %d\n", fd[2] );
-        fd[2] = grtfs_create( "file3" );
-        fd[4] = grtfs_create( "file4" );
-        fd[4] = grtfs_create( "file5" );
-        fd[5] = grtfs_create( "file6" );
-        fd[6] = grtfs_create( "file7" );
-        fd[7] = grtfs_create( "file8" );
-        fd[8] = grtfs_create( "file9" );
-        fd[9] = grtfs_create( "file10" );
-        fd[10] = grtfs_create( "file11" );
-        fd[11] = grtfs_create( "file12" );
-        fd[12] = grtfs_create( "file13" );
-        fd[13] = grtfs_create( "file14" );
-        fd[14] = grtfs_create( "file15" );
-        fd[15] = grtfs_create( "file16" );
-        fd[16] = grtfs_create( "file17" );
-        fd[17] = grtfs_create( "file18" );
-        fd[18] = grtfs_create( "file19" );
-        fd[19] = grtfs_create( "file20" );
-        fd[20] = grtfs_create( "file21" );
-        fd[21] = grtfs_create( "file22" );
-        fd[22] = grtfs_create( "file23" );
-        fd[23] = grtfs_create( "file24" );
-        fd[24] = grtfs_create( "file25" );
-        fd[25] = grtfs_create( "file26" );
-        fd[26] = grtfs_create( "file27" );
-        fd[27] = grtfs_create( "file28" );
-        fd[28] = grtfs_create( "file29" );
-        fd[29] = grtfs_create( "file30" );
-        fd[30] = grtfs_create( "file31" );
-        fd[31] = grtfs_create( "file32" );
-        printf( "fd for creating a thirty-second file - %d\n", fd[31] );
-
-        grtfs_list_directory();
+        grtfs_seek( ctx, fd[0], 0 );
+        grtfs_stats( ctx, &before );
+        for( reads = 0; grtfs_read( ctx, fd[0], buffer3, 16 ) > 0; reads++ );
+        grtfs_stats( ctx, &after );
+        printf( "%d reads of 16 bytes followed %lu FAT links\n",
+                        reads, after.fat_hops - before.fat_hops );
 
-        grtfs_close( fd[0] );
-        grtfs_delete( fd[0] );
-
-        grtfs_list_directory();
-
-        grtfs_close( fd[3] );
-        grtfs_close( fd[4] );
-        grtfs_close( fd[5] );
-        grtfs_close( fd[6] );
-        grtfs_close( fd[7] );
+        count3 = grtfs_pread( ctx, fd[0], buffer3, 20, 250 );
+        buffer3[count3] = '\0';
+        printf( "%d bytes read at offset 250 - [%s]\n", count3, buffer3 );
+        printf( "%d bytes read at the stream position\n",
+                        grtfs_read( ctx, fd[0], buffer3, 20 ) );
 
-        grtfs_delete( fd[6] );
-        grtfs_delete( fd[7] );
-        grtfs_delete( fd[30] );
+        grtfs_seek( ctx, fd[0], 10 );
+        count3 = grtfs_readv( ctx, fd[0], fields, 2 );
+        field1[4] = field2[10] = '\0';
+        printf( "%d bytes read into two buffers - [%s] [%s]\n", count3, field1, field2 );
 
-        grtfs_list_directory();
+        count1 = grtfs_pwrite( ctx, fd[0], "THIS", 4, 0 );
+        printf( "%d bytes written at offset 0\n", count1 );
+        printf( "seek to end of file - %d\n",
+                        grtfs_seek( ctx, fd[0], grtfs_size( ctx, fd[0] ) ) );
 
-        fd[16] = grtfs_create( "added_1" );
-        fd[17] = grtfs_create( "added_2" );
+        fd[2] = grtfs_create( ctx, "file.txt" );
+        printf( "fd for creating a file with identical name" );
+        printf( " as existing file - %d\n", fd[2] );
+        fd[2] = grtfs_create( ctx, "file3" );
+        fd[4] = grtfs_create( ctx, "file4" );
+        fd[4] = grtfs_create( ctx, "file5" );
+        fd[5] = grtfs_create( ctx, "file6" );
+        fd[6] = grtfs_create( ctx, "file7" );
+        fd[7] = grtfs_create( ctx, "file8" );
+        fd[8] = grtfs_create( ctx, "file9" );
+        fd[9] = grtfs_create( ctx, "file10" );
+        fd[10] = grtfs_create( ctx, "file11" );
+        fd[11] = grtfs_create( ctx, "file12" );
+        fd[12] = grtfs_create( ctx, "file13" );
+        fd[13] = grtfs_create( ctx, "file14" );
+        fd[14] = grtfs_create( ctx, "file15" );
+        fd[15] = grtfs_create( ctx, "file16" );
+        fd[16] = grtfs_create( ctx, "file17" );
+        fd[17] = grtfs_create( ctx, "file18" );
+        fd[18] = grtfs_create( ctx, "file19" );
+        fd[19] = grtfs_create( ctx, "file20" );
+        fd[20] = grtfs_create( ctx, "file21" );
+        fd[21] = grtfs_create( ctx, "file22" );
+        fd[22] = grtfs_create( ctx, "file23" );
+        fd[23] = grtfs_create( ctx, "file24" );
+        fd[24] = grtfs_create( ctx, "file25" );
+        fd[25] = grtfs_create( ctx, "file26" );
+        fd[26] = grtfs_create( ctx, "file27" );
+        fd[27] = grtfs_create( ctx, "file28" );
+        fd[28] = grtfs_create( ctx, "file29" );
+        fd[29] = grtfs_create( ctx, "file30" );
+        fd[30] = grtfs_create( ctx, "file31" );
+        fd[31] = grtfs_create( ctx, "file32" );
+        printf( "fd for creating a thirty-second file - %d\n", fd[31] );
 
-        grtfs_list_directory();
-        grtfs_list_blocks();
+        grtfs_list_directory( ctx );
+
+        grtfs_close( ctx, fd[0] );
+        grtfs_delete( ctx, fd[0] );
+
+        grtfs_list_directory( ctx );
+
+        grtfs_close( ctx, fd[3] );
+        grtfs_close( ctx, fd[4] );
+        grtfs_close( ctx, fd[5] );
+        grtfs_close( ctx, fd[6] );
+        grtfs_close( ctx, fd[7] );
+
+        grtfs_delete( ctx, fd[6] );
+        grtfs_delete( ctx, fd[7] );
+        grtfs_delete( ctx, fd[30] );
+
+        grtfs_list_directory( ctx );
+
+        fd[16] = grtfs_create( ctx, "added_1" );
+        fd[17] = grtfs_create( ctx, "added_2" );
+
+        grtfs_list_directory( ctx );
+        grtfs_list_blocks( ctx );
+
+        grtfs_stats( ctx, &after );
+        printf( "%lu bytes read, %lu bytes written, %lu blocks allocated, %lu freed\n",
+                        after.bytes_read, after.bytes_written,
+                        after.blocks_allocated, after.blocks_freed );
+        printf( "%lu name lookups took %lu probes\n", after.name_lookups, after.name_probes );
+        printf( "failed checks: %lu fd range, %lu stale fd, %lu not open, %lu name, %lu access\n",
+                        after.failed_checks[CHECK_FD_RANGE], after.failed_checks[CHECK_STALE_FD],
+                        after.failed_checks[CHECK_NOT_OPEN], after.failed_checks[CHECK_NAME],
+                        after.failed_checks[CHECK_ACCESS] );
+
+        image = grtfs_ctx_new();
+        if( !image || !grtfs_format( "out/grtfs.img", N_BLOCKS ) ||
+                        !grtfs_mount( image, "out/grtfs.img" ) )
+                printf( "cannot make out/grtfs.img, mounted image test skipped\n" );
+        else if( !( fd[0] = grtfs_create( image, "kept.txt" ) ) ||
+                        ( count2 = grtfs_write( image, fd[0], buffer2, length2 ) ) != length2 ||
+                        !grtfs_close( image, fd[0] ) || !grtfs_unmount( image ) )
+                printf( "write to mounted image failed\n" );
+        else{
+                printf( "%d bytes written to mounted image\n", count2 );
+                if( !grtfs_mount( image, "out/grtfs.img" ) ||
+                                !( fd[0] = grtfs_open( image, "kept.txt" ) ) )
+                        printf( "second mount failed\n" );
+                else{
+                        count3 = grtfs_read( image, fd[0], buffer3, length2 );
+                        printf( "%d bytes read from remounted image\n", count3 );
+                        buffer3[count3] = '\0';
+                        printf( "[%s]\n", buffer3 );
+                        grtfs_close( image, fd[0] );
+                }
+        }
+        if( image ) grtfs_ctx_free( image );
+        grtfs_ctx_free( ctx );
 
         return 0;
 }
 
 /* this test driver should print
 
-   length of buffer1 is 320
-   length of buffer2 is 43
-   -- directory listing --
-   fd =  1: unused
-   fd =  2: unused
-   fd =  3: unused
-   fd =  4: unused
-   fd =  5: unused
-   fd =  6: unused
-   fd =  7: unused
-   fd =  8: unused
-   fd =  9: unused
-   fd = 10: unused
-   fd = 11: unused
-   fd = 12: unused
-   fd = 13: unused
-   fd = 14: unused
-   fd = 15: unused
-   -- end --
-   -- directory listing --
-   fd =  1: file.txt, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  2: my_file, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  3: unused
-fd =  4: unused
-fd =  5: unused
-fd =  6: unused
-fd =  7: unused
-fd =  8: unused
-fd =  9: unused
-fd = 10: unused
-fd = 11: unused
-fd = 12: unused
-fd = 13: unused
-fd = 14: unused
-fd = 15: unused
+length of buffer1 is 320
+length of buffer2 is 43
+-- directory listing --
+  fd =  1: unused
+  fd =  2: unused
+  fd =  3: unused
+  fd =  4: unused
+  fd =  5: unused
+  fd =  6: unused
+  fd =  7: unused
+  fd =  8: unused
+  fd =  9: unused
+  fd = 10: unused
+  fd = 11: unused
+  fd = 12: unused
+  fd = 13: unused
+  fd = 14: unused
+  fd = 15: unused
+  fd = 16: unused
+  fd = 17: unused
+  fd = 18: unused
+  fd = 19: unused
+  fd = 20: unused
+  fd = 21: unused
+  fd = 22: unused
+  fd = 23: unused
+  fd = 24: unused
+  fd = 25: unused
+  fd = 26: unused
+  fd = 27: unused
+  fd = 28: unused
+  fd = 29: unused
+  fd = 30: unused
+  fd = 31: unused
+-- end --
+-- directory listing --
+  fd =  1: file.txt, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  2: my_file, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  3: unused
+  fd =  4: unused
+  fd =  5: unused
+  fd =  6: unused
+  fd =  7: unused
+  fd =  8: unused
+  fd =  9: unused
+  fd = 10: unused
+  fd = 11: unused
+  fd = 12: unused
+  fd = 13: unused
+  fd = 14: unused
+  fd = 15: unused
+  fd = 16: unused
+  fd = 17: unused
+  fd = 18: unused
+  fd = 19: unused
+  fd = 20: unused
+  fd = 21: unused
+  fd = 22: unused
+  fd = 23: unused
+  fd = 24: unused
+  fd = 25: unused
+  fd = 26: unused
+  fd = 27: unused
+  fd = 28: unused
+  fd = 29: unused
+  fd = 30: unused
+  fd = 31: unused
 -- end --
+*** Write access denied
 320 bytes written to first file
 43 bytes written to second file
 320 bytes written to first file
 -- directory listing --
-fd =  1: file.txt, currently open, 640 bytes in size
-FAT: 4 5 6 8 9
-fd =  2: my_file, currently closed, 43 bytes in size
-FAT: 7
-fd =  3: unused
-fd =  4: unused
-fd =  5: unused
-fd =  6: unused
-fd =  7: unused
-fd =  8: unused
-fd =  9: unused
-fd = 10: unused
-fd = 11: unused
-fd = 12: unused
-fd = 13: unused
-fd = 14: unused
-fd = 15: unused
+  fd =  1: file.txt, currently open, 640 bytes in size
+           FAT: 165 166 167 168 169 170 171 172 173 174 175
+  fd =  2: my_file, currently closed, 43 bytes in size
+           FAT: no blocks in use, 43 bytes inline
+  fd =  3: unused
+  fd =  4: unused
+  fd =  5: unused
+  fd =  6: unused
+  fd =  7: unused
+  fd =  8: unused
+  fd =  9: unused
+  fd = 10: unused
+  fd = 11: unused
+  fd = 12: unused
+  fd = 13: unused
+  fd = 14: unused
+  fd = 15: unused
+  fd = 16: unused
+  fd = 17: unused
+  fd = 18: unused
+  fd = 19: unused
+  fd = 20: unused
+  fd = 21: unused
+  fd = 22: unused
+  fd = 23: unused
+  fd = 24: unused
+  fd = 25: unused
+  fd = 26: unused
+  fd = 27: unused
+  fd = 28: unused
+  fd = 29: unused
+  fd = 30: unused
+  fd = 31: unused
 -- end --
 -- file alllocation table listing of used blocks --
-block   4 is used and points to   5
-block   5 is used and points to   6
-block   6 is used and points to   8
-block   7 is used and points to   1
-block   8 is used and points to   9
-block   9 is used and points to   1
+  block 161 is used and points to 162
+  block 162 is used and points to 163
+  block 163 is used and points to 164
+  block 164 is used and points to   1
+  block 165 is used and points to 166
+  block 166 is used and points to 167
+  block 167 is used and points to 168
+  block 168 is used and points to 169
+  block 169 is used and points to 170
+  block 170 is used and points to 171
+  block 171 is used and points to 172
+  block 172 is used and points to 173
+  block 173 is used and points to 174
+  block 174 is used and points to 175
+  block 175 is used and points to   1
 -- end --
+*** Read access denied
 40 bytes read from first file
 [test for the trivial file system code.  ]
 20 bytes read from first file
 [ode.  This is a simp]
+40 reads of 16 bytes followed 0 FAT links
+20 bytes read at offset 250 - [ode.  This is a simp]
+0 bytes read at the stream position
+14 bytes read into two buffers - [simp] [le-minded ]
+4 bytes written at offset 0
+seek to end of file - 1
 fd for creating a file with identical name as existing file - 0
-fd for creating a sixteenth file - 0
+fd for creating a thirty-second file - 32
 -- directory listing --
-fd =  1: file.txt, currently open, 640 bytes in size
-FAT: 4 5 6 8 9
-fd =  2: my_file, currently closed, 43 bytes in size
-FAT: 7
-fd =  3: file3, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  4: file4, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  5: file5, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  6: file6, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  7: file7, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  8: file8, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  9: file9, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 10: file10, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 11: file11, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 12: file12, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 13: file13, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 14: file14, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 15: file15, currently open, 0 bytes in size
-FAT: no blocks in use
+  fd =  1: file.txt, currently open, 640 bytes in size
+           FAT: 165 166 167 168 169 170 171 172 173 174 175
+  fd =  2: my_file, currently closed, 43 bytes in size
+           FAT: no blocks in use, 43 bytes inline
+  fd =  3: file3, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  4: file4, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  5: file5, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  6: file6, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  7: file7, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  8: file8, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  9: file9, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 10: file10, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 11: file11, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 12: file12, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 13: file13, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 14: file14, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 15: file15, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 16: file16, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 17: file17, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 18: file18, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 19: file19, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 20: file20, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 21: file21, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 22: file22, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 23: file23, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 24: file24, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 25: file25, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 26: file26, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 27: file27, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 28: file28, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 29: file29, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 30: file30, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 31: file31, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 32: file32, currently open, 0 bytes in size
+           FAT: no blocks in use
 -- end --
 -- directory listing --
-fd =  1: unused
-fd =  2: my_file, currently closed, 43 bytes in size
-FAT: 7
-fd =  3: file3, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  4: file4, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  5: file5, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  6: file6, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  7: file7, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  8: file8, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  9: file9, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 10: file10, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 11: file11, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 12: file12, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 13: file13, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 14: file14, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 15: file15, currently open, 0 bytes in size
-FAT: no blocks in use
+  fd =  1: unused
+  fd =  2: my_file, currently closed, 43 bytes in size
+           FAT: no blocks in use, 43 bytes inline
+  fd =  3: file3, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  4: file4, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  5: file5, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  6: file6, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  7: file7, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  8: file8, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  9: file9, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 10: file10, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 11: file11, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 12: file12, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 13: file13, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 14: file14, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 15: file15, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 16: file16, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 17: file17, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 18: file18, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 19: file19, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 20: file20, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 21: file21, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 22: file22, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 23: file23, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 24: file24, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 25: file25, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 26: file26, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 27: file27, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 28: file28, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 29: file29, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 30: file30, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 31: file31, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 32: file32, currently open, 0 bytes in size
+           FAT: no blocks in use
 -- end --
 *** file_descriptor out of range: 0
 -- directory listing --
-fd =  1: unused
-fd =  2: my_file, currently closed, 43 bytes in size
-FAT: 7
-fd =  3: file3, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  4: file4, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  5: file5, currently closed, 0 bytes in size
-FAT: no blocks in use
-fd =  6: file6, currently closed, 0 bytes in size
-FAT: no blocks in use
-fd =  7: unused
-fd =  8: unused
-fd =  9: file9, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 10: file10, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 11: file11, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 12: file12, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 13: file13, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 14: file14, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 15: file15, currently open, 0 bytes in size
-FAT: no blocks in use
+  fd =  1: unused
+  fd =  2: my_file, currently closed, 43 bytes in size
+           FAT: no blocks in use, 43 bytes inline
+  fd =  3: file3, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  4: file4, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  5: file5, currently closed, 0 bytes in size
+           FAT: no blocks in use
+  fd =  6: file6, currently closed, 0 bytes in size
+           FAT: no blocks in use
+  fd =  7: unused
+  fd =  8: unused
+  fd =  9: file9, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 10: file10, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 11: file11, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 12: file12, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 13: file13, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 14: file14, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 15: file15, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 16: file16, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 17: file17, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 18: file18, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 19: file19, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 20: file20, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 21: file21, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 22: file22, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 23: file23, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 24: file24, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 25: file25, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 26: file26, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 27: file27, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 28: file28, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 29: file29, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 30: file30, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 31: file31, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 32: file32, currently open, 0 bytes in size
+           FAT: no blocks in use
 -- end --
 -- directory listing --
-fd =  1: added_1, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  2: my_file, currently closed, 43 bytes in size
-FAT: 7
-fd =  3: file3, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  4: file4, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  5: file5, currently closed, 0 bytes in size
-FAT: no blocks in use
-fd =  6: file6, currently closed, 0 bytes in size
-FAT: no blocks in use
-fd =  7: added_2, currently open, 0 bytes in size
-FAT: no blocks in use
-fd =  8: unused
-fd =  9: file9, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 10: file10, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 11: file11, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 12: file12, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 13: file13, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 14: file14, currently open, 0 bytes in size
-FAT: no blocks in use
-fd = 15: file15, currently open, 0 bytes in size
-FAT: no blocks in use
+  fd =  1: added_1, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  2: my_file, currently closed, 43 bytes in size
+           FAT: no blocks in use, 43 bytes inline
+  fd =  3: file3, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  4: file4, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  5: file5, currently closed, 0 bytes in size
+           FAT: no blocks in use
+  fd =  6: file6, currently closed, 0 bytes in size
+           FAT: no blocks in use
+  fd =  7: added_2, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd =  8: unused
+  fd =  9: file9, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 10: file10, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 11: file11, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 12: file12, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 13: file13, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 14: file14, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 15: file15, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 16: file16, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 17: file17, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 18: file18, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 19: file19, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 20: file20, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 21: file21, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 22: file22, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 23: file23, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 24: file24, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 25: file25, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 26: file26, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 27: file27, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 28: file28, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 29: file29, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 30: file30, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 31: file31, currently open, 0 bytes in size
+           FAT: no blocks in use
+  fd = 32: file32, currently open, 0 bytes in size
+           FAT: no blocks in use
 -- end --
 -- file alllocation table listing of used blocks --
-block   7 is used and points to   1
+  block 161 is used and points to 162
+  block 162 is used and points to 163
+  block 163 is used and points to 164
+  block 164 is used and points to   1
+  block 176 is used and points to 177
+  block 177 is used and points to 178
+  block 178 is used and points to 179
+  block 179 is used and points to 180
+  block 180 is used and points to 181
+  block 181 is used and points to 182
+  block 182 is used and points to 183
+  block 183 is used and points to 184
+  block 184 is used and points to 185
+  block 185 is used and points to 186
+  block 186 is used and points to 187
+  block 187 is used and points to 188
+  block 188 is used and points to 189
+  block 189 is used and points to 190
+  block 190 is used and points to 191
+  block 191 is used and points to 192
+  block 192 is used and points to 193
+  block 193 is used and points to 194
+  block 194 is used and points to 195
+  block 195 is used and points to 196
+  block 196 is used and points to 197
+  block 197 is used and points to 198
+  block 198 is used and points to 199
+  block 199 is used and points to 200
+  block 200 is used and points to 201
+  block 201 is used and points to 202
+  block 202 is used and points to 203
+  block 203 is used and points to 204
+  block 204 is used and points to 205
+  block 205 is used and points to 206
+  block 206 is used and points to 207
+  block 207 is used and points to   1
 -- end --
+734 bytes read, 687 bytes written, 47 blocks allocated, 11 freed
+38 name lookups took 44 probes
+failed checks: 1 fd range, 0 stale fd, 0 not open, 0 name, 2 access
+43 bytes written to mounted image
+43 bytes read from remounted image
+[And now for something completely different.]
 
 */